@@ -43,6 +43,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -308,6 +309,8 @@ fetch_connect(struct url *cache_url, struct url *url, int af, int verbose)
 	return (conn);
 }
 
+/* the cache may be shared by threads fetching ranges in parallel */
+static pthread_mutex_t connection_cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static conn_t *connection_cache;
 static int cache_global_limit = 0;
 static int cache_per_host_limit = 0;
@@ -339,10 +342,12 @@ fetchConnectionCacheClose(void)
 {
 	conn_t *conn;
 
+	pthread_mutex_lock(&connection_cache_lock);
 	while ((conn = connection_cache) != NULL) {
 		connection_cache = conn->next_cached;
 		(*conn->cache_close)(conn);
 	}
+	pthread_mutex_unlock(&connection_cache_lock);
 }
 
 /*
@@ -354,6 +359,7 @@ fetch_cache_get(const struct url *url, int af)
 {
 	conn_t *conn, *last_conn = NULL;
 
+	pthread_mutex_lock(&connection_cache_lock);
 	for (conn = connection_cache; conn; conn = conn->next_cached) {
 		if (conn->cache_url->port == url->port &&
 		    strcmp(conn->cache_url->scheme, url->scheme) == 0 &&
@@ -366,11 +372,13 @@ fetch_cache_get(const struct url *url, int af)
 				last_conn->next_cached = conn->next_cached;
 			else
 				connection_cache = conn->next_cached;
-			return conn;
+			break;
 		}
+		last_conn = conn;
 	}
+	pthread_mutex_unlock(&connection_cache_lock);
 
-	return NULL;
+	return conn;
 }
 
 /*
@@ -389,16 +397,19 @@ fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 		return;
 	}
 
+	pthread_mutex_lock(&connection_cache_lock);
 	global_count = host_count = 0;
 	last = NULL;
-	for (iter = connection_cache; iter; last = iter, iter = next_cached) {
+	for (iter = connection_cache; iter; iter = next_cached) {
 		next_cached = iter->next_cached;
 		++global_count;
 		if (strcmp(conn->cache_url->host, iter->cache_url->host) == 0)
 			++host_count;
 		if (global_count < cache_global_limit &&
-		    host_count < cache_per_host_limit)
+		    host_count < cache_per_host_limit) {
+			last = iter;
 			continue;
+		}
 		--global_count;
 		if (last != NULL)
 			last->next_cached = iter->next_cached;
@@ -410,6 +421,7 @@ fetch_cache_put(conn_t *conn, int (*closecb)(conn_t *))
 	conn->cache_close = closecb;
 	conn->next_cached = connection_cache;
 	connection_cache = conn;
+	pthread_mutex_unlock(&connection_cache_lock);
 }
 
 /*
@@ -966,10 +978,8 @@ fetchFreeURLList(struct url_list *ue)
 /*** Authentication-related utility functions ********************************/
 
 static const char *
-fetch_read_word(FILE *f)
+fetch_read_word(FILE *f, char word[static 1024])
 {
-	static char word[1024];
-
 	if (fscanf(f, " %1023s ", word) != 1)
 		return (NULL);
 	return (word);
@@ -981,7 +991,7 @@ fetch_read_word(FILE *f)
 int
 fetch_netrc_auth(struct url *url)
 {
-	char fn[PATH_MAX];
+	char fn[PATH_MAX], buf[1024];
 	const char *word;
 	char *p;
 	FILE *f;
@@ -1006,20 +1016,20 @@ fetch_netrc_auth(struct url *url)
 
 	if ((f = fopen(fn, "r")) == NULL)
 		return (-1);
-	while ((word = fetch_read_word(f)) != NULL) {
+	while ((word = fetch_read_word(f, buf)) != NULL) {
 		if (strcmp(word, "default") == 0)
 			break;
 		if (strcmp(word, "machine") == 0 &&
-		    (word = fetch_read_word(f)) != NULL &&
+		    (word = fetch_read_word(f, buf)) != NULL &&
 		    strcasecmp(word, url->host) == 0) {
 			break;
 		}
 	}
 	if (word == NULL)
 		goto ferr;
-	while ((word = fetch_read_word(f)) != NULL) {
+	while ((word = fetch_read_word(f, buf)) != NULL) {
 		if (strcmp(word, "login") == 0) {
-			if ((word = fetch_read_word(f)) == NULL)
+			if ((word = fetch_read_word(f, buf)) == NULL)
 				goto ferr;
 			if (snprintf(url->user, sizeof(url->user),
 				"%s", word) > (int)sizeof(url->user)) {
@@ -1027,7 +1037,7 @@ fetch_netrc_auth(struct url *url)
 				url->user[0] = '\0';
 			}
 		} else if (strcmp(word, "password") == 0) {
-			if ((word = fetch_read_word(f)) == NULL)
+			if ((word = fetch_read_word(f, buf)) == NULL)
 				goto ferr;
 			if (snprintf(url->pwd, sizeof(url->pwd),
 				"%s", word) > (int)sizeof(url->pwd)) {
@@ -1035,7 +1045,7 @@ fetch_netrc_auth(struct url *url)
 				url->pwd[0] = '\0';
 			}
 		} else if (strcmp(word, "account") == 0) {
-			if ((word = fetch_read_word(f)) == NULL)
+			if ((word = fetch_read_word(f, buf)) == NULL)
 				goto ferr;
 			/* XXX not supported! */
 		} else {
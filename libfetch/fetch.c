@@ -40,8 +40,8 @@
 #include "common.h"
 
 auth_t	 fetchAuthMethod;
-int	 fetchLastErrCode;
-char	 fetchLastErrString[MAXERRSTRING];
+__thread int	 fetchLastErrCode;
+__thread char	 fetchLastErrString[MAXERRSTRING];
 int	 fetchTimeout;
 volatile int	 fetchRestartCalls = 1;
 int	 fetchDebug;
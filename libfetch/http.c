@@ -198,6 +198,12 @@ http_fillbuf(struct httpio *io, size_t len)
 			io->error = 1;
 			return (-1);
 		}
+		if (io->buflen == 0 && io->contentlength > 0) {
+			/* connection closed before the whole body was read */
+			errno = EPIPE;
+			io->error = 1;
+			return (-1);
+		}
 		if (io->contentlength)
 			io->contentlength -= io->buflen;
 		io->bufpos = 0;
@@ -225,6 +231,12 @@ http_fillbuf(struct httpio *io, size_t len)
 		io->error = 1;
 		return (-1);
 	}
+	if (io->buflen == 0) {
+		/* connection closed in the middle of a chunk */
+		errno = EPIPE;
+		io->error = 1;
+		return (-1);
+	}
 	io->chunksize -= io->buflen;
 	if (io->contentlength >= 0)
 		io->contentlength -= io->buflen;
@@ -296,7 +308,9 @@ http_closefn(void *v)
 	struct httpio *io = (struct httpio *)v;
 	conn_t *conn = io->conn;
 
-	if (io->keep_alive) {
+	/* only a connection with the whole body consumed can be reused */
+	if (io->keep_alive && !io->error &&
+	    (io->chunked ? io->eof : io->contentlength == 0)) {
 		fetch_cache_put(conn, fetch_close);
 	} else {
 		fetch_close(conn);
@@ -815,17 +829,17 @@ http_get_proxy(struct url * url, const char *flags)
 }
 
 static void
-set_if_modified_since(conn_t *conn, time_t last_modified)
+set_date_header(conn_t *conn, const char *header, time_t t)
 {
 	static const char weekdays[] = "SunMonTueWedThuFriSat";
 	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
 	struct tm tm;
 	char buf[80];
-	gmtime_r(&last_modified, &tm);
+	gmtime_r(&t, &tm);
 	snprintf(buf, sizeof(buf), "%.3s, %02d %.3s %4ld %02d:%02d:%02d GMT",
 	    weekdays + tm.tm_wday * 3, tm.tm_mday, months + tm.tm_mon * 3,
 	    (long)(tm.tm_year + 1900), tm.tm_hour, tm.tm_min, tm.tm_sec);
-	http_cmd(conn, "If-Modified-Since: %s\r\n", buf);
+	http_cmd(conn, "%s: %s\r\n", header, buf);
 }
 
 
@@ -845,7 +859,7 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 {
 	conn_t *conn;
 	struct url *url, *new;
-	int chunked, direct, if_modified_since, need_auth, noredirect, nocache;
+	int chunked, direct, if_modified_since, if_range, need_auth, noredirect, nocache;
 	int keep_alive, verbose, cached;
 	int e, i, n;
 	off_t offset, clength, length, size;
@@ -860,6 +874,7 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 	nocache = CHECK_FLAG('C');
 	verbose = CHECK_FLAG('v');
 	if_modified_since = CHECK_FLAG('i');
+	if_range = CHECK_FLAG('r');
 	keep_alive = 0;
 
 	if (direct && purl) {
@@ -932,7 +947,7 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 		if (nocache)
 			http_cmd(conn, "Cache-Control: no-cache\r\n");
 		if (if_modified_since && url->last_modified > 0)
-			set_if_modified_since(conn, url->last_modified);
+			set_date_header(conn, "If-Modified-Since", url->last_modified);
 
 		/* virtual host */
 		http_cmd(conn, "Host: %s\r\n", host);
@@ -966,8 +981,13 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 			http_cmd(conn, "User-Agent: %s\r\n", p);
 		else
 			http_cmd(conn, "User-Agent: %s\r\n", _LIBFETCH_VER);
-		if (url->offset > 0)
+		if (url->length > 0)
+			http_cmd(conn, "Range: bytes=%lld-%lld\r\n", (long long)url->offset,
+			    (long long)(url->offset + url->length - 1));
+		else if (url->offset > 0)
 			http_cmd(conn, "Range: bytes=%lld-\r\n", (long long)url->offset);
+		if ((url->offset > 0 || url->length > 0) && if_range && url->last_modified > 0)
+			set_date_header(conn, "If-Range", url->last_modified);
 		http_cmd(conn, "\r\n");
 
 		/*
@@ -1162,7 +1182,8 @@ http_request(struct url *URL, const char *op, struct url_stat *us,
 		clength = length;
 	if (clength != -1)
 		length = offset + clength;
-	if (length != -1 && size != -1 && length != size) {
+	if (length != -1 && size != -1 &&
+	    (URL->length > 0 ? length > size : length != size)) {
 		http_seterr(HTTP_PROTOCOL_ERROR);
 		goto ouch;
 	}
@@ -4,6 +4,7 @@
 #include <malloc.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <openssl/pem.h>
@@ -37,16 +38,23 @@ struct adb_block *adb_block_next(struct adb_block *cur, apk_blob_t b)
 }
 
 /* Init stuff */
+static inline char *adb_w_chunk_base(const struct adb_w_chunk *c)
+{
+	return c->ptr - (c->offs & (ADB_BLOCK_ALIGNMENT - 1));
+}
+
 int adb_free(struct adb *db)
 {
 	if (db->mmap.ptr) {
 		munmap(db->mmap.ptr, db->mmap.len);
+	} else if (db->chunk) {
+		free(db->bucket);
+		for (size_t i = 0; i < db->num_chunks; i++)
+			free(adb_w_chunk_base(&db->chunk[i]));
+		free(db->chunk);
+		free(db->chunk_map);
 	} else {
-		struct adb_w_bucket *bucket, *nxt;
-		int i;
-		for (i = 0; i < db->num_buckets; i++)
-			list_for_each_entry_safe(bucket, nxt, &db->bucket[i], node)
-				free(bucket);
+		free(db->bucket);
 		free(db->adb.ptr);
 	}
 	return 0;
@@ -54,15 +62,20 @@ int adb_free(struct adb *db)
 
 void adb_reset(struct adb *db)
 {
-	struct adb_w_bucket *bucket, *nxt;
-	int i;
-
-	for (i = 0; i < db->num_buckets; i++) {
-		list_for_each_entry_safe(bucket, nxt, &db->bucket[i], node)
-			free(bucket);
-		list_init(&db->bucket[i]);
-	}
+	if (db->bucket) memset(db->bucket, 0, db->num_buckets * sizeof db->bucket[0]);
+	db->num_entries = 0;
 	db->adb.len = 0;
+	if (db->num_chunks) {
+		/* Keep the largest chunk so a reused database settles
+		 * into a single one */
+		for (size_t i = 0; i + 1 < db->num_chunks; i++)
+			free(adb_w_chunk_base(&db->chunk[i]));
+		db->chunk[0] = db->chunk[db->num_chunks - 1];
+		db->chunk[0].ptr = adb_w_chunk_base(&db->chunk[0]);
+		db->chunk[0].offs = db->chunk[0].len = 0;
+		db->num_chunks = 1;
+		db->adb.ptr = db->chunk[0].ptr;
+	}
 }
 
 static int __adb_m_parse(struct adb *db, struct apk_trust *t)
@@ -79,6 +92,10 @@ static int __adb_m_parse(struct adb *db, struct apk_trust *t)
 			if (!APK_BLOB_IS_NULL(db->adb)) break;
 			db->adb = b;
 			break;
+		case ADB_BLOCK_HASH:
+			if (APK_BLOB_IS_NULL(db->adb)) break;
+			db->hash = b;
+			break;
 		case ADB_BLOCK_SIG:
 			if (APK_BLOB_IS_NULL(db->adb)) break;
 			if (!trusted &&
@@ -134,14 +151,99 @@ err:
 	return r;
 }
 
+/* Reads the ADB block hashing it at the same time, so the signatures
+ * can be checked without another pass over it. */
+static int adb_m_stream_adb(struct apk_istream *is, struct adb *db, size_t sz, struct adb_verify_ctx *vfy)
+{
+	struct apk_digest_ctx dctx;
+	size_t off, n;
+	ssize_t r;
+
+	db->adb.ptr = malloc(sz);
+	if (!db->adb.ptr) return -ENOMEM;
+
+	r = apk_digest_ctx_init(&dctx, APK_DIGEST_SHA512);
+	if (r) return r;
+	for (off = 0; off < sz; off += n) {
+		n = min(sz - off, (size_t) 64*1024);
+		r = apk_istream_read(is, &db->adb.ptr[off], n);
+		if (r != n) goto done;
+		if (off < db->adb.len) {
+			r = apk_digest_ctx_update(&dctx, &db->adb.ptr[off], min(n, db->adb.len - off));
+			if (r) goto done;
+		}
+	}
+	r = apk_digest_ctx_final(&dctx, &vfy->sha512);
+	if (r == 0) vfy->calc |= 1 << APK_DIGEST_SHA512;
+	r = sz;
+done:
+	apk_digest_ctx_free(&dctx);
+	return r;
+}
+
+/* Signature blocks are verified in threads while the stream is read
+ * further. They are waited for only when trust is needed. */
+#define ADB_MAX_SIG_THREADS	4
+
+struct adb_sig_verify {
+	pthread_t thread;
+	struct apk_trust *trust;
+	struct adb *db;
+	struct adb_verify_ctx *vfy;
+	apk_blob_t sig;
+	int r;
+};
+
+static void *adb_sig_verify_thread(void *arg)
+{
+	struct adb_sig_verify *sv = arg;
+	struct apk_digest_ctx dctx;
+
+	sv->r = apk_digest_ctx_init(&dctx, APK_DIGEST_NONE);
+	if (sv->r) return NULL;
+	sv->r = adb_trust_verify_signature_ctx(sv->trust, &dctx, sv->db, sv->vfy, sv->sig);
+	apk_digest_ctx_free(&dctx);
+	return NULL;
+}
+
+static int adb_sig_verify_start(struct adb_sig_verify *sv, struct apk_trust *t, struct adb *db,
+				struct adb_verify_ctx *vfy, apk_blob_t sig)
+{
+	sv->trust = t;
+	sv->db = db;
+	sv->vfy = vfy;
+	sv->sig = APK_BLOB_PTR_LEN(malloc(sig.len), sig.len);
+	if (!sv->sig.ptr) return -ENOMEM;
+	memcpy(sv->sig.ptr, sig.ptr, sig.len);
+	if (pthread_create(&sv->thread, NULL, adb_sig_verify_thread, sv) != 0) {
+		free(sv->sig.ptr);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+static int adb_sig_verify_wait(struct adb_sig_verify *sv, int *num)
+{
+	int i, trusted = 0;
+
+	for (i = 0; i < *num; i++) {
+		pthread_join(sv[i].thread, NULL);
+		free(sv[i].sig.ptr);
+		if (sv[i].r == 0) trusted = 1;
+	}
+	*num = 0;
+	return trusted;
+}
+
 int adb_m_stream(struct adb *db, struct apk_istream *is, uint32_t expected_schema,
 	struct apk_trust *t, int (*datacb)(struct adb *, size_t, struct apk_istream *))
 {
 	struct adb_verify_ctx vfy = {};
+	struct adb_sig_verify sv[ADB_MAX_SIG_THREADS];
 	struct adb_block blk;
 	struct apk_segment_istream seg;
 	void *sig;
-	int r, block_no = 0;
+	int r, block_no = 0, num_sv = 0;
 	int trusted = t ? 0 : 1;
 	size_t sz;
 
@@ -152,6 +254,7 @@ int adb_m_stream(struct adb *db, struct apk_istream *is, uint32_t expected_schem
 	do {
 		r = apk_istream_read(is, &blk, sizeof blk);
 		if (r == 0) {
+			if (!trusted) trusted = adb_sig_verify_wait(sv, &num_sv);
 			if (!trusted) r = -ENOKEY;
 			else if (!db->adb.ptr) r = -ENOMSG;
 			goto done;
@@ -165,9 +268,8 @@ int adb_m_stream(struct adb *db, struct apk_istream *is, uint32_t expected_schem
 		switch (adb_block_type(&blk)) {
 		case ADB_BLOCK_ADB:
 			if (!APK_BLOB_IS_NULL(db->adb)) goto bad_msg;
-			db->adb.ptr = malloc(sz);
 			db->adb.len = adb_block_length(&blk);
-			if ((r = apk_istream_read(is, db->adb.ptr, sz)) != sz) goto err;
+			if ((r = adb_m_stream_adb(is, db, sz, &vfy)) != sz) goto err;
 			break;
 		case ADB_BLOCK_SIG:
 			if (APK_BLOB_IS_NULL(db->adb)) goto bad_msg;
@@ -176,12 +278,22 @@ int adb_m_stream(struct adb *db, struct apk_istream *is, uint32_t expected_schem
 				r = PTR_ERR(sig);
 				goto err;
 			}
-			if (!trusted &&
-			    adb_trust_verify_signature(t, db, &vfy, APK_BLOB_PTR_LEN(sig, adb_block_length(&blk))) == 0)
+			if (trusted) break;
+			if (num_sv < ARRAY_SIZE(sv) && (vfy.calc & (1 << APK_DIGEST_SHA512)) &&
+			    adb_sig_verify_start(&sv[num_sv], t, db, &vfy, APK_BLOB_PTR_LEN(sig, adb_block_length(&blk))) == 0) {
+				num_sv++;
+				break;
+			}
+			if (adb_trust_verify_signature(t, db, &vfy, APK_BLOB_PTR_LEN(sig, adb_block_length(&blk))) == 0)
 				trusted = 1;
 			break;
+		case ADB_BLOCK_HASH:
+			/* Only useful for random access */
+			if ((r = apk_istream_read(is, NULL, sz)) != sz) goto err;
+			break;
 		case ADB_BLOCK_DATA:
 			if (APK_BLOB_IS_NULL(db->adb)) goto bad_msg;
+			if (!trusted) trusted = adb_sig_verify_wait(sv, &num_sv);
 			if (!trusted) {
 				r = -ENOKEY;
 				goto err;
@@ -203,26 +315,26 @@ bad_msg:
 err:
 	if (r >= 0) r = -EBADMSG;
 done:
+	adb_sig_verify_wait(sv, &num_sv);
 	apk_istream_close(is);
 	return r;
 }
 
-int adb_w_init_dynamic(struct adb *db, uint32_t schema, void *buckets, size_t num_buckets)
+int adb_w_init_dynamic(struct adb *db, uint32_t schema, size_t num_buckets, size_t size_hint)
 {
-	size_t i;
+	size_t n = 64;
 
+	/* num_buckets is the expected number of unique values. The
+	 * deduplication table is allocated on first write, and grows
+	 * when it gets full. size_hint is the expected size of the
+	 * data, zero if not known. */
+	while (n < num_buckets) n *= 2;
 	*db = (struct adb) {
 		.hdr.magic = htole32(ADB_FORMAT_MAGIC),
 		.hdr.schema = htole32(schema),
-		.num_buckets = num_buckets,
-		.bucket = buckets,
+		.num_buckets = n,
+		.size_hint = size_hint,
 	};
-
-	if (num_buckets) {
-		for (i = 0; i < db->num_buckets; i++)
-			list_init(&db->bucket[i]);
-	}
-
 	return 0;
 }
 
@@ -237,17 +349,30 @@ int adb_w_init_static(struct adb *db, void *buf, size_t bufsz)
 }
 
 /* Read interface */
+#define ADB_W_CHUNK_MAP_UNIT	4096
+
+static inline void *adb_w_chunk_ptr(const struct adb *db, size_t offs)
+{
+	const struct adb_w_chunk *c = &db->chunk[db->chunk_map[offs / ADB_W_CHUNK_MAP_UNIT]];
+
+	/* The map has the chunk where each unit starts */
+	while (c + 1 < &db->chunk[db->num_chunks] && c[1].offs <= offs) c++;
+	return c->ptr + offs - c->offs;
+}
+
 static inline void *adb_r_deref(const struct adb *db, adb_val_t v, size_t offs, size_t s)
 {
 	offs += ADB_VAL_VALUE(v);
 	if (offs + s > db->adb.len) return NULL;
+	/* Values never straddle the chunks of a database being written */
+	if (db->num_chunks > 1) return adb_w_chunk_ptr(db, offs);
 	return db->adb.ptr + offs;
 }
 
 adb_val_t adb_r_root(const struct adb *db)
 {
 	if (db->adb.len < sizeof(adb_val_t)) return ADB_NULL;
-	return *(adb_val_t *)(db->adb.ptr + db->adb.len - sizeof(adb_val_t));
+	return *(adb_val_t *)adb_r_deref(db, 0, db->adb.len - sizeof(adb_val_t), sizeof(adb_val_t));
 }
 
 uint32_t adb_r_int(const struct adb *db, adb_val_t v)
@@ -437,6 +562,52 @@ int adb_ra_find(struct adb_obj *arr, int cur, struct adb *db, adb_val_t val)
 
 }
 
+/* FNV-1a over the key bytes with a final mix, so that the bucket of a
+ * key is the same on hosts of either byte order */
+static inline uint32_t adb_h_bucket(apk_blob_t key, uint32_t num_buckets)
+{
+	uint32_t h = 0x811c9dc5U;
+
+	for (size_t i = 0; i < key.len; i++)
+		h = (h ^ (uint8_t) key.ptr[i]) * 0x01000193U;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h & (num_buckets - 1);
+}
+
+int adb_h_lookup(struct adb *db, unsigned table, apk_blob_t key, const uint32_t **slots)
+{
+	const struct adb_hash_hdr *hdr = (const struct adb_hash_hdr *) db->hash.ptr;
+	const uint32_t *p, *end;
+	uint32_t num_buckets, first, last, num;
+	unsigned i;
+
+	if (db->hash.len < sizeof *hdr || hdr->hash_ver != ADB_HASH_FNV1A ||
+	    table >= le32toh(hdr->num_tables)) return -ENOENT;
+	num_buckets = le32toh(hdr->num_buckets);
+	if (num_buckets == 0 || (num_buckets & (num_buckets - 1))) return -ENOENT;
+
+	p = (const uint32_t *)(hdr + 1);
+	end = (const uint32_t *)(db->hash.ptr + db->hash.len);
+	for (i = 0; ; i++) {
+		if (end - p <= num_buckets) return -ENOENT;
+		num = le32toh(p[num_buckets]);
+		if (end - p - num_buckets - 1 < num) return -ENOENT;
+		if (i == table) break;
+		p += num_buckets + 1 + num;
+	}
+
+	i = adb_h_bucket(key, num_buckets);
+	first = le32toh(p[i]);
+	last = le32toh(p[i + 1]);
+	if (first > last || last > num) return -ENOENT;
+	*slots = &p[num_buckets + 1 + first];
+	return last - first;
+}
+
 /* Write interface */
 static inline size_t iovec_len(struct iovec *vec, size_t nvec)
 {
@@ -478,62 +649,134 @@ static adb_val_t adb_w_error(struct adb *db, int rc)
 	return ADB_ERROR(rc);
 }
 
-static size_t adb_w_raw(struct adb *db, struct iovec *vec, size_t n, size_t len, size_t alignment)
+static void *adb_w_reserve(struct adb *db, size_t len)
 {
+	struct adb_w_chunk *c = db->num_chunks ? &db->chunk[db->num_chunks - 1] : NULL;
+	size_t size, unit;
 	void *ptr;
-	size_t offs, i;
 
-	if ((i = ROUND_UP(db->adb.len, alignment) - db->adb.len) != 0) {
-		memset(&db->adb.ptr[db->adb.len], 0, i);
-		db->adb.len += i;
+	/* Data is appended to a list of chunks which are never moved,
+	 * each new one twice the size of the previous. The chunks are
+	 * written out as they are. A chunk starting at an unaligned
+	 * offset begins equally far into its allocation, so the aligned
+	 * values in it are aligned in memory too. */
+	if (!c || c->len + len > c->size) {
+		size = c ? c->size * 2 : (db->size_hint ?: 8192);
+		while (size < len) size *= 2;
+		c = realloc(db->chunk, (db->num_chunks + 1) * sizeof *c);
+		assert(c);
+		db->chunk = c;
+		c = &db->chunk[db->num_chunks++];
+		*c = (struct adb_w_chunk) {
+			.offs = db->adb.len,
+			.size = size,
+			.ptr = malloc(size + ADB_BLOCK_ALIGNMENT),
+		};
+		assert(c->ptr);
+		c->ptr += c->offs & (ADB_BLOCK_ALIGNMENT - 1);
+		db->chunk_map = realloc(db->chunk_map, (c->offs + size) / ADB_W_CHUNK_MAP_UNIT + 1);
+		assert(db->chunk_map);
+		if (db->num_chunks == 1) db->adb.ptr = c->ptr;
 	}
+	ptr = c->ptr + c->len;
+	c->len += len;
 
-	if (db->adb.len + len > db->mmap.len) {
-		assert(db->num_buckets);
-		if (!db->mmap.len) db->mmap.len = 8192;
-		while (db->adb.len + len > db->mmap.len)
-			db->mmap.len *= 2;
-		ptr = realloc(db->adb.ptr, db->mmap.len);
-		assert(ptr);
-		db->adb.ptr = ptr;
+	/* Map the units starting in the new data to this chunk */
+	for (unit = ROUND_UP(db->adb.len, ADB_W_CHUNK_MAP_UNIT) / ADB_W_CHUNK_MAP_UNIT;
+	     unit * ADB_W_CHUNK_MAP_UNIT < db->adb.len + len; unit++)
+		db->chunk_map[unit] = db->num_chunks - 1;
+
+	return ptr;
+}
+
+static size_t adb_w_raw(struct adb *db, struct iovec *vec, size_t n, size_t len, size_t alignment)
+{
+	uint8_t *ptr;
+	size_t pad, i;
+
+	pad = ROUND_UP(db->adb.len, alignment) - db->adb.len;
+	if (db->num_buckets) {
+		ptr = adb_w_reserve(db, pad + len);
+	} else {
+		assert(db->adb.len + pad + len <= db->mmap.len);
+		ptr = (uint8_t *) db->adb.ptr + db->adb.len;
 	}
 
-	offs = db->adb.len;
+	memset(ptr, 0, pad);
+	ptr += pad;
+	assert(((uintptr_t) ptr & (alignment - 1)) == 0);
 	for (i = 0; i < n; i++) {
-		memcpy(&db->adb.ptr[db->adb.len], vec[i].iov_base, vec[i].iov_len);
-		db->adb.len += vec[i].iov_len;
+		memcpy(ptr, vec[i].iov_base, vec[i].iov_len);
+		ptr += vec[i].iov_len;
 	}
+	db->adb.len += pad + len;
 
-	return offs;
+	return db->adb.len - len;
+}
+
+/* Describes the data of the database with iovecs. A database being
+ * written has one for each chunk, others have a single one. */
+static size_t adb_w_iovec(struct adb *db, struct iovec *vec)
+{
+	size_t i;
+
+	if (!db->num_chunks) {
+		vec[0] = (struct iovec) { .iov_base = db->adb.ptr, .iov_len = db->adb.len };
+		return 1;
+	}
+	for (i = 0; i < db->num_chunks; i++)
+		vec[i] = (struct iovec) { .iov_base = db->chunk[i].ptr, .iov_len = db->chunk[i].len };
+	return i;
+}
+
+static inline size_t adb_w_bucketno(struct adb *db, uint32_t hash)
+{
+	/* Fibonacci hashing to spread the low entropy djb2 bits */
+	return (uint32_t)(hash * 0x9e3779b1U) & (db->num_buckets - 1);
+}
+
+static void adb_w_grow_buckets(struct adb *db)
+{
+	struct adb_w_bucket_entry *old = db->bucket, *entry;
+	size_t i, j, num_old = db->num_buckets;
+
+	if (old) db->num_buckets *= 2;
+	db->bucket = calloc(db->num_buckets, sizeof db->bucket[0]);
+	assert(db->bucket);
+	for (i = 0; old && i < num_old; i++) {
+		if (old[i].len == 0) continue;
+		for (j = adb_w_bucketno(db, old[i].hash); ; j = (j + 1) & (db->num_buckets - 1)) {
+			entry = &db->bucket[j];
+			if (entry->len == 0) break;
+		}
+		*entry = old[i];
+	}
+	free(old);
 }
 
 static size_t adb_w_data(struct adb *db, struct iovec *vec, size_t nvec, size_t alignment)
 {
 	size_t len, i;
-	unsigned hash, bucketno;
-	struct adb_w_bucket *bucket;
-	struct adb_w_bucket_entry *entry = 0;
+	unsigned hash;
+	struct adb_w_bucket_entry *entry;
 
 	if (!db->num_buckets) return adb_w_raw(db, vec, nvec, iovec_len(vec, nvec), alignment);
+	if (!db->bucket || (db->num_entries + 1) * 4 > db->num_buckets * 3)
+		adb_w_grow_buckets(db);
 
+	/* Open addressing with linear probing. Empty slots have len zero,
+	 * and entries are never removed. */
 	hash = iovec_hash(vec, nvec, &len);
-	bucketno = hash % db->num_buckets;
-	list_for_each_entry(bucket, &db->bucket[bucketno], node) {
-		for (i = 0, entry = bucket->entries; i < ARRAY_SIZE(bucket->entries); i++, entry++) {
-			if (entry->len == 0) goto add;
-			if (entry->hash != hash) continue;
-			if (entry->len == len && iovec_memcmp(vec, nvec, &((uint8_t*)db->adb.ptr)[entry->offs]) == 0) {
-				if ((entry->offs & alignment) != 0) goto add;
-				return entry->offs;
-			}
+	for (i = adb_w_bucketno(db, hash); ; i = (i + 1) & (db->num_buckets - 1)) {
+		entry = &db->bucket[i];
+		if (entry->len == 0) break;
+		if (entry->hash != hash || entry->len != len) continue;
+		if (iovec_memcmp(vec, nvec, adb_r_deref(db, 0, entry->offs, len)) == 0) {
+			if ((entry->offs & (alignment - 1)) == 0) return entry->offs;
+			goto add;
 		}
-		entry = 0;
 	}
-
-	bucket = calloc(1, sizeof *bucket);
-	list_init(&bucket->node);
-	list_add_tail(&bucket->node, &db->bucket[bucketno]);
-	entry = &bucket->entries[0];
+	db->num_entries++;
 
 add:
 	entry->hash = hash;
@@ -651,15 +894,16 @@ adb_val_t adb_w_adb(struct adb *db, struct adb *valdb)
 {
 	uint32_t bsz;
 	struct adb_block blk = adb_block_init(ADB_BLOCK_ADB, valdb->adb.len);
-	struct iovec vec[] = {
-		{ .iov_base = &bsz, .iov_len = sizeof bsz },
-		{ .iov_base = &blk, .iov_len = sizeof blk },
-		{ .iov_base = valdb->adb.ptr, .iov_len = valdb->adb.len },
-		{ .iov_base = padding_zeroes, .iov_len = adb_block_padding(&blk) },
-	};
+	struct iovec *vec = alloca((valdb->num_chunks + 3) * sizeof *vec);
+	size_t n = 2;
+
 	if (valdb->adb.len <= 4) return ADB_NULL;
-	bsz = htole32(iovec_len(vec, ARRAY_SIZE(vec)) - sizeof bsz);
-	return ADB_VAL(ADB_TYPE_BLOB_32, adb_w_raw(db, vec, ARRAY_SIZE(vec), iovec_len(vec, ARRAY_SIZE(vec)), sizeof(uint32_t)));
+	vec[0] = (struct iovec) { .iov_base = &bsz, .iov_len = sizeof bsz };
+	vec[1] = (struct iovec) { .iov_base = &blk, .iov_len = sizeof blk };
+	n += adb_w_iovec(valdb, &vec[n]);
+	vec[n++] = (struct iovec) { .iov_base = padding_zeroes, .iov_len = adb_block_padding(&blk) };
+	bsz = htole32(iovec_len(vec, n) - sizeof bsz);
+	return ADB_VAL(ADB_TYPE_BLOB_32, adb_w_raw(db, vec, n, iovec_len(vec, n), sizeof(uint32_t)));
 }
 
 adb_val_t adb_w_fromstring(struct adb *db, const uint8_t *kind, apk_blob_t val)
@@ -869,16 +1113,18 @@ void adb_wa_sort_unique(struct adb_obj *arr)
 /* Schema helpers */
 int adb_s_field_by_name_blob(const struct adb_object_schema *schema, apk_blob_t blob)
 {
-	for (int i = 0; i < schema->num_fields-1 && schema->fields[i].name; i++)
-		if (apk_blob_compare(APK_BLOB_STR(schema->fields[i].name), blob) == 0)
+	/* Reserved field numbers leave holes without a name */
+	for (int i = 0; i < schema->num_fields-1; i++)
+		if (schema->fields[i].name &&
+		    apk_blob_compare(APK_BLOB_STR(schema->fields[i].name), blob) == 0)
 			return i + 1;
 	return 0;
 }
 
 int adb_s_field_by_name(const struct adb_object_schema *schema, const char *name)
 {
-	for (int i = 0; i < schema->num_fields-1 && schema->fields[i].name; i++)
-		if (strcmp(schema->fields[i].name, name) == 0)
+	for (int i = 0; i < schema->num_fields-1; i++)
+		if (schema->fields[i].name && strcmp(schema->fields[i].name, name) == 0)
 			return i + 1;
 	return 0;
 }
@@ -958,6 +1204,47 @@ int adb_c_block_copy(struct apk_ostream *os, struct adb_block *b, struct apk_ist
 	return r;
 }
 
+int adb_c_hash(struct apk_ostream *os, unsigned num_tables, const struct adb_hash_entry *e, size_t num)
+{
+	struct adb_hash_hdr *hdr;
+	uint32_t *buf, *tbl, *bucket, num_buckets = 1;
+	size_t i, len, off;
+	int r;
+
+	while (num_buckets * num_tables < num) num_buckets *= 2;
+	len = sizeof *hdr + ((num_buckets + 1) * num_tables + num) * sizeof(uint32_t);
+	hdr = calloc(1, len);
+	if (!hdr) return apk_ostream_cancel(os, -ENOMEM);
+	*hdr = (struct adb_hash_hdr) {
+		.hash_ver = ADB_HASH_FNV1A,
+		.num_tables = htole32(num_tables),
+		.num_buckets = htole32(num_buckets),
+	};
+
+	/* Counting sort into buckets, keeping the slot order */
+	buf = (uint32_t *)(hdr + 1);
+	for (i = 0, tbl = buf; i < num_tables; i++) {
+		bucket = tbl;
+		for (size_t j = 0; j < num; j++)
+			if (e[j].table == i) bucket[adb_h_bucket(e[j].key, num_buckets) + 1]++;
+		for (off = 0; off < num_buckets; off++)
+			bucket[off + 1] += bucket[off];
+		tbl += num_buckets + 1 + bucket[num_buckets];
+		for (size_t j = 0; j < num; j++) {
+			if (e[j].table != i) continue;
+			off = adb_h_bucket(e[j].key, num_buckets);
+			bucket[num_buckets + 1 + bucket[off]++] = htole32(e[j].slot);
+		}
+		for (off = num_buckets; off > 0; off--)
+			bucket[off] = htole32(bucket[off - 1]);
+		bucket[0] = 0;
+	}
+
+	r = adb_c_block(os, ADB_BLOCK_HASH, APK_BLOB_PTR_LEN((char *) hdr, len));
+	free(hdr);
+	return r;
+}
+
 int adb_c_adb(struct apk_ostream *os, struct adb *db, struct apk_trust *t)
 {
 	if (IS_ERR(os))
@@ -965,8 +1252,17 @@ int adb_c_adb(struct apk_ostream *os, struct adb *db, struct apk_trust *t)
 	if (db->hdr.magic != htole32(ADB_FORMAT_MAGIC))
 		return apk_ostream_cancel(os, -EAPKFORMAT);
 
+	struct adb_block blk = adb_block_init(ADB_BLOCK_ADB, db->adb.len);
+	struct iovec *vec = alloca((db->num_chunks + 2) * sizeof *vec);
+	size_t n = 1;
+
+	/* The chunks go out as they are, without joining them first */
+	vec[0] = (struct iovec) { .iov_base = &blk, .iov_len = sizeof blk };
+	n += adb_w_iovec(db, &vec[n]);
+	vec[n++] = (struct iovec) { .iov_base = padding_zeroes, .iov_len = adb_block_padding(&blk) };
+
 	adb_c_header(os, db);
-	adb_c_block(os, ADB_BLOCK_ADB, db->adb);
+	apk_ostream_writev(os, vec, n);
 	if (t) adb_trust_write_signatures(t, db, NULL, os);
 
 	return apk_ostream_error(os);
@@ -979,8 +1275,9 @@ int adb_c_create(struct apk_ostream *os, struct adb *db, struct apk_trust *t)
 }
 
 /* Signatures */
-static int adb_digest_adb(struct adb_verify_ctx *vfy, unsigned int hash_alg, apk_blob_t data, apk_blob_t *pmd)
+static int adb_digest_adb(struct adb_verify_ctx *vfy, unsigned int hash_alg, struct adb *db, apk_blob_t *pmd)
 {
+	struct apk_digest_ctx dctx;
 	struct apk_digest *d;
 	int r;
 
@@ -993,8 +1290,16 @@ static int adb_digest_adb(struct adb_verify_ctx *vfy, unsigned int hash_alg, apk
 	}
 
 	if (!(vfy->calc & (1 << hash_alg))) {
-		if (APK_BLOB_IS_NULL(data)) return -ENOMSG;
-		r = apk_digest_calc(d, hash_alg, data.ptr, data.len);
+		if (APK_BLOB_IS_NULL(db->adb)) return -ENOMSG;
+		if (db->num_chunks > 1) {
+			r = apk_digest_ctx_init(&dctx, hash_alg);
+			for (size_t i = 0; r == 0 && i < db->num_chunks; i++)
+				r = apk_digest_ctx_update(&dctx, db->chunk[i].ptr, db->chunk[i].len);
+			if (r == 0) r = apk_digest_ctx_final(&dctx, d);
+			apk_digest_ctx_free(&dctx);
+		} else {
+			r = apk_digest_calc(d, hash_alg, db->adb.ptr, db->adb.len);
+		}
 		if (r != 0) return r;
 		vfy->calc |= (1 << hash_alg);
 	}
@@ -1031,7 +1336,7 @@ int adb_trust_write_signatures(struct apk_trust *trust, struct adb *db, struct a
 		memset(vfy, 0, sizeof *vfy);
 	}
 
-	r = adb_digest_adb(vfy, APK_DIGEST_SHA512, db->adb, &md);
+	r = adb_digest_adb(vfy, APK_DIGEST_SHA512, db, &md);
 	if (r) return r;
 
 	list_for_each_entry(tkey, &trust->private_key_list, key_node) {
@@ -1057,7 +1362,8 @@ err:
 	return r;
 }
 
-int adb_trust_verify_signature(struct apk_trust *trust, struct adb *db, struct adb_verify_ctx *vfy, apk_blob_t sigb)
+int adb_trust_verify_signature_ctx(struct apk_trust *trust, struct apk_digest_ctx *dctx,
+				   struct adb *db, struct adb_verify_ctx *vfy, apk_blob_t sigb)
 {
 	struct apk_trust_key *tkey;
 	struct adb_sign_hdr *sig;
@@ -1073,11 +1379,11 @@ int adb_trust_verify_signature(struct apk_trust *trust, struct adb *db, struct a
 
 	list_for_each_entry(tkey, &trust->trusted_key_list, key_node) {
 		if (memcmp(sig0->id, tkey->key.id, sizeof sig0->id) != 0) continue;
-		if (adb_digest_adb(vfy, sig->hash_alg, db->adb, &md) != 0) continue;
+		if (adb_digest_adb(vfy, sig->hash_alg, db, &md) != 0) continue;
 
-		if (apk_verify_start(&trust->dctx, &tkey->key) != 0 ||
-		    adb_digest_v0_signature(&trust->dctx, &db->hdr, sig0, md) != 0 ||
-		    apk_verify(&trust->dctx, sig0->sig, sigb.len - sizeof *sig0) != 0)
+		if (apk_verify_start(dctx, &tkey->key) != 0 ||
+		    adb_digest_v0_signature(dctx, &db->hdr, sig0, md) != 0 ||
+		    apk_verify(dctx, sig0->sig, sigb.len - sizeof *sig0) != 0)
 			continue;
 
 		return 0;
@@ -1086,6 +1392,11 @@ int adb_trust_verify_signature(struct apk_trust *trust, struct adb *db, struct a
 	return -EKEYREJECTED;
 }
 
+int adb_trust_verify_signature(struct apk_trust *trust, struct adb *db, struct adb_verify_ctx *vfy, apk_blob_t sigb)
+{
+	return adb_trust_verify_signature_ctx(trust, &trust->dctx, db, vfy, sigb);
+}
+
 /* Container transformation interface */
 int adb_c_xfrm(struct adb_xfrm *x, int (*cb)(struct adb_xfrm *, struct adb_block *, struct apk_istream *))
 {
@@ -54,6 +54,7 @@ struct adb_header {
 #define ADB_BLOCK_ALIGNMENT	8
 #define ADB_BLOCK_END		-1
 #define ADB_BLOCK_ADB		0
+#define ADB_BLOCK_HASH		1
 #define ADB_BLOCK_SIG		2
 #define ADB_BLOCK_DATA		3
 
@@ -86,6 +87,26 @@ struct adb_sign_v0 {
 	uint8_t sig[0];
 };
 
+/* Hash block. Optional lookup tables from a key to the slots of the
+ * array items having it. The block is not covered by the signatures, so
+ * readers must check that the items really match. All fields are little
+ * endian, and after the header come for each table the num_buckets + 1
+ * bucket start indexes and then the slots. Readers ignore blocks with
+ * a hash_ver they do not know. */
+#define ADB_HASH_FNV1A		1
+
+struct adb_hash_hdr {
+	uint8_t hash_ver;
+	uint8_t reserved[3];
+	uint32_t num_tables;
+	uint32_t num_buckets;
+};
+
+struct adb_hash_entry {
+	uint32_t table, slot;
+	apk_blob_t key;
+};
+
 /* Block enumeration */
 struct adb_block *adb_block_first(apk_blob_t b);
 struct adb_block *adb_block_next(struct adb_block *cur, apk_blob_t b);
@@ -134,20 +155,25 @@ struct adb_adb_schema {
 };
 
 /* Database read interface */
-struct adb_w_bucket {
-	struct list_head node;
-	struct adb_w_bucket_entry {
-		uint32_t hash;
-		uint32_t offs;
-		uint32_t len;
-	} entries[40];
+struct adb_w_bucket_entry {
+	uint32_t hash;
+	uint32_t offs;
+	uint32_t len;
+};
+
+struct adb_w_chunk {
+	size_t offs, len, size;
+	char *ptr;
 };
 
 struct adb {
-	apk_blob_t mmap, data, adb;
+	apk_blob_t mmap, data, adb, hash;
 	struct adb_header hdr;
-	size_t num_buckets;
-	struct list_head *bucket;
+	size_t num_buckets, num_entries;
+	struct adb_w_bucket_entry *bucket;
+	size_t num_chunks, size_hint;
+	struct adb_w_chunk *chunk;
+	uint8_t *chunk_map;
 };
 
 struct adb_obj {
@@ -164,9 +190,8 @@ void adb_reset(struct adb *);
 int adb_m_blob(struct adb *, apk_blob_t, struct apk_trust *);
 int adb_m_map(struct adb *, int fd, uint32_t expected_schema, struct apk_trust *);
 int adb_m_stream(struct adb *db, struct apk_istream *is, uint32_t expected_schema, struct apk_trust *trust, int (*datacb)(struct adb *, size_t, struct apk_istream *));
-#define adb_w_init_alloca(db, schema, num_buckets) adb_w_init_dynamic(db, schema, alloca(sizeof(struct list_head[num_buckets])), num_buckets)
 #define adb_w_init_tmp(db, size) adb_w_init_static(db, alloca(size), size)
-int adb_w_init_dynamic(struct adb *db, uint32_t schema, void *buckets, size_t num_buckets);
+int adb_w_init_dynamic(struct adb *db, uint32_t schema, size_t num_buckets, size_t size_hint);
 int adb_w_init_static(struct adb *db, void *buf, size_t bufsz);
 
 /* Primitive read */
@@ -187,6 +212,7 @@ apk_blob_t adb_ro_blob(const struct adb_obj *o, unsigned i);
 struct adb_obj *adb_ro_obj(const struct adb_obj *o, unsigned i, struct adb_obj *);
 int adb_ro_cmp(const struct adb_obj *o1, const struct adb_obj *o2, unsigned i);
 int adb_ra_find(struct adb_obj *arr, int cur, struct adb *db, adb_val_t val);
+int adb_h_lookup(struct adb *db, unsigned table, apk_blob_t key, const uint32_t **slots);
 
 /* Primitive write */
 void adb_w_root(struct adb *, adb_val_t);
@@ -228,6 +254,7 @@ int adb_c_header(struct apk_ostream *os, struct adb *db);
 int adb_c_block(struct apk_ostream *os, uint32_t type, apk_blob_t);
 int adb_c_block_data(struct apk_ostream *os, apk_blob_t hdr, uint32_t size, struct apk_istream *is);
 int adb_c_block_copy(struct apk_ostream *os, struct adb_block *b, struct apk_istream *is, struct adb_verify_ctx *);
+int adb_c_hash(struct apk_ostream *os, unsigned num_tables, const struct adb_hash_entry *e, size_t num);
 int adb_c_adb(struct apk_ostream *os, struct adb *db, struct apk_trust *t);
 int adb_c_create(struct apk_ostream *os, struct adb *db, struct apk_trust *t);
 
@@ -238,6 +265,8 @@ struct adb_verify_ctx {
 };
 
 int adb_trust_write_signatures(struct apk_trust *trust, struct adb *db, struct adb_verify_ctx *vfy, struct apk_ostream *os);
+int adb_trust_verify_signature_ctx(struct apk_trust *trust, struct apk_digest_ctx *dctx,
+				   struct adb *db, struct adb_verify_ctx *vfy, apk_blob_t sigb);
 int adb_trust_verify_signature(struct apk_trust *trust, struct adb *db, struct adb_verify_ctx *vfy, apk_blob_t sigb);
 
 /* Transform existing file */
@@ -265,6 +294,12 @@ struct adb_walk_ops {
 	int (*end)(struct adb_walk *);
 	int (*key)(struct adb_walk *, apk_blob_t key_name);
 	int (*scalar)(struct adb_walk *, apk_blob_t scalar, int multiline);
+
+	/* Optional. fork returns a walker that continues from the current
+	 * state and keeps its output in memory, and join appends that output
+	 * to the parent and frees it. Forks run in other threads. */
+	struct adb_walk *(*fork)(struct adb_walk *);
+	int (*join)(struct adb_walk *, struct adb_walk *forked);
 };
 
 extern const struct adb_walk_ops adb_walk_gentext_ops, adb_walk_genadb_ops;
@@ -272,31 +307,50 @@ extern const struct adb_walk_ops adb_walk_gentext_ops, adb_walk_genadb_ops;
 struct adb_walk {
 	const struct adb_walk_ops *ops;
 	const struct adb_db_schema *schemas;
+	struct apk_string_array *filter;
+	unsigned int jobs;
 };
 
+/* Text is collected in a buffer and written to the stream in large
+ * blocks. A walker without a stream keeps all of its output. */
+#define ADB_WALK_GENTEXT_BUFSZ		(64*1024)
+
 struct adb_walk_gentext {
 	struct adb_walk d;
-	FILE *out;
+	struct apk_ostream *os;
+	char *buf;
+	size_t len, size;
+	int rc;
 	int nest;
 	int line_started : 1;
 	int key_printed : 1;
 };
 
 #define ADB_WALK_GENADB_MAX_IDB		2
-#define ADB_WALK_GENADB_MAX_NESTING	32
-#define ADB_WALK_GENADB_MAX_VALUES	100000
 
+struct adb_walk_genadb_level {
+	struct adb_obj obj;
+	unsigned int curkey;
+	size_t vals;
+};
+
+/* The value stack holds the objects on the current nesting path only,
+ * and arrays get more space as items are added. Completed objects are
+ * written to the database right away. */
 struct adb_walk_genadb {
 	struct adb_walk d;
 	struct adb db;
 	adb_val_t stored_object;
 	struct adb idb[ADB_WALK_GENADB_MAX_IDB];
-	int nest, nestdb, num_vals;
-	struct adb_obj objs[ADB_WALK_GENADB_MAX_NESTING];
-	unsigned int curkey[ADB_WALK_GENADB_MAX_NESTING];
-	adb_val_t vals[ADB_WALK_GENADB_MAX_VALUES];
+	int nest, nestdb, max_nest;
+	size_t num_vals, max_vals;
+	struct adb_walk_genadb_level *lvl;
+	adb_val_t *vals;
 };
 
+void adb_walk_genadb_free(struct adb_walk_genadb *);
+int adb_walk_gentext_close(struct adb_walk_gentext *);
+
 int adb_walk_adb(struct adb_walk *d, struct adb *db, struct apk_trust *trust);
 int adb_walk_istream(struct adb_walk *d, struct apk_istream *is);
 
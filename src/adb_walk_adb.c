@@ -1,8 +1,11 @@
 #include "adb.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include "apk_adb.h"
 #include "apk_applet.h"
 #include "apk_print.h"
@@ -11,10 +14,13 @@ struct adb_walk_ctx {
 	struct adb_walk *d;
 	struct adb *db;
 	struct apk_trust *trust;
+	struct apk_digest_ctx *dctx;
+	unsigned int nest;
 };
 
 static int dump_object(struct adb_walk_ctx *ctx, const struct adb_object_schema *schema, adb_val_t v);
 static int dump_adb(struct adb_walk_ctx *ctx);
+static void dump_array_top(struct adb_walk_ctx *ctx, const struct adb_object_schema *schema, struct adb_obj *o);
 
 static int dump_item(struct adb_walk_ctx *ctx, const char *name, const uint8_t *kind, adb_val_t v)
 {
@@ -24,10 +30,12 @@ static int dump_item(struct adb_walk_ctx *ctx, const char *name, const uint8_t *
 	struct adb_object_schema *obj_schema;
 	char tmp[256];
 	apk_blob_t b;
+	int top;
 
 	if (v == ADB_VAL_NULL) return 0;
 
 	d->ops->key(d, name ? APK_BLOB_STR(name) : APK_BLOB_NULL);
+	top = ctx->nest++ == 0;
 
 	switch (*kind) {
 	case ADB_KIND_ARRAY:
@@ -35,6 +43,10 @@ static int dump_item(struct adb_walk_ctx *ctx, const char *name, const uint8_t *
 		adb_r_obj(ctx->db, v, &o, obj_schema);
 		//if (!adb_ra_num(&o)) return 0;
 
+		if (top) {
+			dump_array_top(ctx, obj_schema, &o);
+			break;
+		}
 		d->ops->start_array(d, adb_ra_num(&o));
 		for (size_t i = ADBI_FIRST; i <= adb_ra_num(&o); i++) {
 			dump_item(ctx, NULL, obj_schema->fields[0].kind, adb_ro_val(&o, i));
@@ -42,8 +54,10 @@ static int dump_item(struct adb_walk_ctx *ctx, const char *name, const uint8_t *
 		d->ops->end(d);
 		break;
 	case ADB_KIND_ADB:
-		db.hdr.schema = container_of(kind, struct adb_adb_schema, kind)->schema_id;
-		db.data = adb_r_blob(ctx->db, v);
+		db = (struct adb) {
+			.hdr.schema = container_of(kind, struct adb_adb_schema, kind)->schema_id,
+			.data = adb_r_blob(ctx->db, v),
+		};
 		origdb = ctx->db;
 		ctx->db = &db;
 		d->ops->start_object(d);
@@ -73,9 +87,227 @@ static int dump_item(struct adb_walk_ctx *ctx, const char *name, const uint8_t *
 			d->ops->scalar(d, b, scalar->multiline);
 		break;
 	}
+	ctx->nest--;
+	return 0;
+}
+
+/* Top level arrays can be limited to the packages matching a filter,
+ * and dumped in chunks by worker threads. The chunks are joined in
+ * order, and only a few of them are kept ahead of the one being
+ * written, so memory use does not grow with the database. */
+#define DUMP_CHUNK_ITEMS	64
+
+struct dump_chunk {
+	struct adb_walk *d;
+	int done;
+};
+
+struct dump_array {
+	struct adb_walk_ctx *ctx;
+	const uint8_t *kind;
+	struct adb_obj *obj;
+	uint32_t *items;
+	size_t num_items;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct dump_chunk *chunks;
+	size_t num_chunks, next, joined, window;
+};
+
+static apk_blob_t item_pkgname(struct adb *adb, const uint8_t *kind, adb_val_t v)
+{
+	struct adb db;
+	struct adb_block *blk;
+	struct adb_obj pkg, info;
+
+	if (*kind == ADB_KIND_OBJECT) {
+		adb_r_obj(adb, v, &pkg, &schema_pkginfo);
+		return adb_ro_blob(&pkg, ADBI_PI_NAME);
+	}
+
+	db = (struct adb) { .data = adb_r_blob(adb, v) };
+	adb_foreach_block(blk, db.data) {
+		if (adb_block_type(blk) != ADB_BLOCK_ADB) continue;
+		db.adb = adb_block_blob(blk);
+		adb_r_rootobj(&db, &pkg, &schema_package);
+		return adb_ro_blob(adb_ro_obj(&pkg, ADBI_PKG_PKGINFO, &info), ADBI_PI_NAME);
+	}
+	return APK_BLOB_NULL;
+}
+
+static int item_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static int match_pkgname(struct apk_string_array *filter, apk_blob_t name)
+{
+	char buf[256], **pmatch;
+
+	if (APK_BLOB_IS_NULL(name) || name.len >= sizeof buf) return 0;
+	memcpy(buf, name.ptr, name.len);
+	buf[name.len] = 0;
+	foreach_array_item(pmatch, filter)
+		if (fnmatch(*pmatch, buf, 0) == 0) return 1;
 	return 0;
 }
 
+static size_t select_items(struct adb_walk_ctx *ctx, const struct adb_object_schema *schema,
+			   struct adb_obj *o, uint32_t *items)
+{
+	struct apk_string_array *filter = ctx->d->filter;
+	const uint8_t *kind = schema->fields[0].kind;
+	size_t i, n = 0;
+	char **pmatch;
+	int slot;
+
+	if (!filter || filter->num == 0 ||
+	    (schema != &schema_pkginfo_array && schema != &schema_package_adb_array)) {
+		for (i = ADBI_FIRST; i <= adb_ra_num(o); i++)
+			items[n++] = i;
+		return n;
+	}
+
+	foreach_array_item(pmatch, filter)
+		if (strpbrk(*pmatch, "*?[") != NULL || schema != &schema_pkginfo_array) goto scan;
+
+	/* Plain names in an index are looked up from its hash table */
+	foreach_array_item(pmatch, filter) {
+		for (i = 0; &filter->item[i] < pmatch; i++)
+			if (strcmp(filter->item[i], *pmatch) == 0) break;
+		if (&filter->item[i] != pmatch) continue;
+		for (slot = 0; (slot = apk_ndx_find(o, APK_NDX_HASH_NAME, APK_BLOB_STR(*pmatch), slot)) > 0; )
+			items[n++] = slot;
+	}
+	qsort(items, n, sizeof items[0], item_cmp);
+	return n;
+
+scan:
+	for (i = ADBI_FIRST; i <= adb_ra_num(o); i++)
+		if (match_pkgname(filter, item_pkgname(ctx->db, kind, adb_ro_val(o, i))))
+			items[n++] = i;
+	return n;
+}
+
+static void dump_items(struct adb_walk_ctx *ctx, struct dump_array *da, size_t chunk)
+{
+	size_t i = chunk * DUMP_CHUNK_ITEMS, end = min(i + DUMP_CHUNK_ITEMS, da->num_items);
+
+	for (; i < end; i++)
+		dump_item(ctx, NULL, da->kind, adb_ro_val(da->obj, da->items[i]));
+}
+
+static void *dump_array_thread(void *arg)
+{
+	struct dump_array *da = arg;
+	struct adb_walk_ctx ctx = *da->ctx;
+	struct adb_walk *d = ctx.d;
+	struct apk_digest_ctx dctx;
+	size_t i;
+
+	/* Signatures of nested databases are verified with a digest
+	 * context of this thread. Without one, its chunks are left for
+	 * the main thread to dump. */
+	ctx.dctx = apk_digest_ctx_init(&dctx, APK_DIGEST_NONE) == 0 ? &dctx : NULL;
+
+	pthread_mutex_lock(&da->mutex);
+	for (;;) {
+		while (da->next < da->num_chunks && da->next >= da->joined + da->window)
+			pthread_cond_wait(&da->cond, &da->mutex);
+		if (da->next >= da->num_chunks) break;
+		i = da->next++;
+		ctx.d = ctx.dctx ? d->ops->fork(d) : NULL;
+		pthread_mutex_unlock(&da->mutex);
+
+		if (ctx.d) dump_items(&ctx, da, i);
+
+		pthread_mutex_lock(&da->mutex);
+		da->chunks[i] = (struct dump_chunk) { .d = ctx.d, .done = 1 };
+		pthread_cond_broadcast(&da->cond);
+	}
+	pthread_mutex_unlock(&da->mutex);
+	if (ctx.dctx) apk_digest_ctx_free(&dctx);
+	return NULL;
+}
+
+static int dump_array_parallel(struct dump_array *da, unsigned int jobs)
+{
+	struct adb_walk *d = da->ctx->d;
+	pthread_t *threads;
+	unsigned int n = 0;
+	size_t i;
+
+	if (jobs > da->num_chunks) jobs = da->num_chunks;
+	da->window = jobs * 2;
+	da->chunks = calloc(da->num_chunks, sizeof da->chunks[0]);
+	threads = calloc(jobs, sizeof threads[0]);
+	if (!da->chunks || !threads) goto err;
+
+	pthread_mutex_init(&da->mutex, NULL);
+	pthread_cond_init(&da->cond, NULL);
+	for (n = 0; n < jobs; n++)
+		if (pthread_create(&threads[n], NULL, dump_array_thread, da) != 0) break;
+	if (n == 0) goto err_threads;
+
+	for (i = 0; i < da->num_chunks; i++) {
+		pthread_mutex_lock(&da->mutex);
+		while (!da->chunks[i].done)
+			pthread_cond_wait(&da->cond, &da->mutex);
+		pthread_mutex_unlock(&da->mutex);
+
+		/* A chunk that could not be forked is dumped here */
+		if (da->chunks[i].d) d->ops->join(d, da->chunks[i].d);
+		else dump_items(da->ctx, da, i);
+
+		pthread_mutex_lock(&da->mutex);
+		da->joined++;
+		pthread_cond_broadcast(&da->cond);
+		pthread_mutex_unlock(&da->mutex);
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+err_threads:
+	pthread_cond_destroy(&da->cond);
+	pthread_mutex_destroy(&da->mutex);
+err:
+	free(threads);
+	free(da->chunks);
+	return n ? 0 : -1;
+}
+
+static void dump_array_top(struct adb_walk_ctx *ctx, const struct adb_object_schema *schema, struct adb_obj *o)
+{
+	struct adb_walk *d = ctx->d;
+	struct dump_array da = {
+		.ctx = ctx,
+		.kind = schema->fields[0].kind,
+		.obj = o,
+	};
+	size_t i;
+
+	da.items = malloc((adb_ra_num(o) + 1) * sizeof da.items[0]);
+	if (!da.items) {
+		d->ops->start_array(d, adb_ra_num(o));
+		for (i = ADBI_FIRST; i <= adb_ra_num(o); i++)
+			dump_item(ctx, NULL, da.kind, adb_ro_val(o, i));
+		d->ops->end(d);
+		return;
+	}
+	da.num_items = select_items(ctx, schema, o, da.items);
+	da.num_chunks = (da.num_items + DUMP_CHUNK_ITEMS - 1) / DUMP_CHUNK_ITEMS;
+
+	d->ops->start_array(d, da.num_items);
+	if (d->jobs <= 1 || !d->ops->fork || da.num_chunks < 2 ||
+	    dump_array_parallel(&da, d->jobs) != 0) {
+		for (i = 0; i < da.num_chunks; i++)
+			dump_items(ctx, &da, i);
+	}
+	d->ops->end(d);
+	free(da.items);
+}
+
 static int dump_object(struct adb_walk_ctx *ctx, const struct adb_object_schema *schema, adb_val_t v)
 {
 	size_t schema_len = 0;
@@ -132,13 +364,18 @@ static int dump_adb(struct adb_walk_ctx *ctx)
 			break;
 		case ADB_BLOCK_SIG:
 			s = (struct adb_sign_hdr*) b.ptr;
-			r = adb_trust_verify_signature(ctx->trust, ctx->db, &vfy, b);
+			r = adb_trust_verify_signature_ctx(ctx->trust, ctx->dctx, ctx->db, &vfy, b);
 			len = snprintf(tmp, sizeof tmp, "sig v%02x h%02x ", s->sign_ver, s->hash_alg);
 			for (size_t j = sizeof *s; j < b.len; j++)
 				len += snprintf(&tmp[len], sizeof tmp - len, "%02x", (uint8_t)b.ptr[j]);
 			len += snprintf(&tmp[len], sizeof tmp - len, ": %s", r ? apk_error_str(r) : "OK");
 			d->ops->comment(d, APK_BLOB_PTR_LEN(tmp, len));
 			break;
+		case ADB_BLOCK_HASH:
+			len = snprintf(tmp, sizeof tmp, "hash block v%02x, size: %d",
+				b.len ? (uint8_t) b.ptr[0] : 0, adb_block_length(blk));
+			d->ops->comment(d, APK_BLOB_PTR_LEN(tmp, len));
+			break;
 		case ADB_BLOCK_DATA:
 			len = snprintf(tmp, sizeof tmp, "data block, size: %d", adb_block_length(blk));
 			d->ops->comment(d, APK_BLOB_PTR_LEN(tmp, len));
@@ -161,6 +398,7 @@ int adb_walk_adb(struct adb_walk *d, struct adb *db, struct apk_trust *trust)
 		.d = d,
 		.db = db,
 		.trust = trust,
+		.dctx = &trust->dctx,
 	};
 	d->ops->schema(d, db->hdr.schema);
 	return dump_adb(&ctx);
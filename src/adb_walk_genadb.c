@@ -1,7 +1,99 @@
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include "adb.h"
 #include "apk_print.h"
 
+#define GENADB_ARRAY_INITIAL	16
+
+static int genadb_reserve(struct adb_walk_genadb *dt, size_t num)
+{
+	adb_val_t *vals;
+	size_t max = dt->max_vals ?: 256;
+	int i;
+
+	while (max < dt->num_vals + num) max *= 2;
+	if (max == dt->max_vals) return 0;
+
+	vals = realloc(dt->vals, max * sizeof *vals);
+	if (!vals) return -ENOMEM;
+	dt->vals = vals;
+	dt->max_vals = max;
+	for (i = 0; i <= dt->nest && i < dt->max_nest; i++)
+		dt->lvl[i].obj.obj = &vals[dt->lvl[i].vals];
+	return 0;
+}
+
+static int genadb_push(struct adb_walk_genadb *dt, const struct adb_object_schema *schema, struct adb *db)
+{
+	struct adb_walk_genadb_level *l;
+	size_t num = schema->num_fields;
+	int r;
+
+	if (dt->nest >= dt->max_nest) {
+		int max = dt->max_nest ? dt->max_nest * 2 : 8;
+		l = realloc(dt->lvl, max * sizeof *l);
+		if (!l) return -ENOMEM;
+		dt->lvl = l;
+		dt->max_nest = max;
+	}
+
+	/* Arrays start small and grow in genadb_array_room() */
+	if (schema->kind == ADB_KIND_ARRAY && num > GENADB_ARRAY_INITIAL)
+		num = GENADB_ARRAY_INITIAL;
+
+	/* Set before reserving, which rebases every level up to nest */
+	l = &dt->lvl[dt->nest];
+	l->vals = dt->num_vals;
+	if ((r = genadb_reserve(dt, num)) != 0) return r;
+
+	l->curkey = 0;
+	l->obj = (struct adb_obj) {
+		.schema = schema,
+		.db = db,
+		.obj = &dt->vals[l->vals],
+		.num = 1,
+	};
+	memset(l->obj.obj, 0, sizeof(adb_val_t[num]));
+	l->obj.obj[ADBI_NUM_ENTRIES] = num;
+	dt->num_vals += num;
+	return 0;
+}
+
+static int genadb_array_room(struct adb_walk_genadb *dt)
+{
+	struct adb_walk_genadb_level *l = &dt->lvl[dt->nest];
+	uint32_t max = l->obj.obj[ADBI_NUM_ENTRIES], num;
+	int r;
+
+	/* Only the innermost array is appended to, so it is at the top of
+	 * the value stack. When the schema limit is hit, the append fails. */
+	if (l->obj.num < max || max >= l->obj.schema->num_fields) return 0;
+	num = max * 2;
+	if (num > l->obj.schema->num_fields) num = l->obj.schema->num_fields;
+	if ((r = genadb_reserve(dt, num - max)) != 0) return r;
+
+	memset(&l->obj.obj[max], 0, sizeof(adb_val_t[num - max]));
+	l->obj.obj[ADBI_NUM_ENTRIES] = num;
+	dt->num_vals += num - max;
+	return 0;
+}
+
+void adb_walk_genadb_free(struct adb_walk_genadb *dt)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dt->idb); i++)
+		if (dt->idb[i].num_buckets) adb_free(&dt->idb[i]);
+	memset(dt->idb, 0, sizeof dt->idb);
+	free(dt->lvl);
+	free(dt->vals);
+	dt->lvl = NULL;
+	dt->vals = NULL;
+	dt->max_nest = 0;
+	dt->max_vals = 0;
+}
+
 static int adb_walk_genadb_schema(struct adb_walk *d, uint32_t schema_id)
 {
 	struct adb_walk_genadb *dt = container_of(d, struct adb_walk_genadb, d);
@@ -10,14 +102,12 @@ static int adb_walk_genadb_schema(struct adb_walk *d, uint32_t schema_id)
 	dt->db.hdr.schema = htole32(schema_id);
 	for (s = d->schemas; s->magic; s++)
 		if (s->magic == schema_id) break;
-	if (!s) return -EAPKDBFORMAT;
+	if (!s->magic) return -EAPKDBFORMAT;
 
-	adb_wo_init(&dt->objs[0], &dt->vals[0], s->root, &dt->db);
-	dt->num_vals += s->root->num_fields;
-	if (dt->num_vals >= ARRAY_SIZE(dt->vals)) return -E2BIG;
 	dt->nest = 0;
-
-	return 0;
+	dt->nestdb = 0;
+	dt->num_vals = 0;
+	return genadb_push(dt, s->root, &dt->db);
 }
 
 static int adb_walk_genadb_comment(struct adb_walk *d, apk_blob_t comment)
@@ -28,32 +118,39 @@ static int adb_walk_genadb_comment(struct adb_walk *d, apk_blob_t comment)
 static int adb_walk_genadb_start_object(struct adb_walk *d)
 {
 	struct adb_walk_genadb *dt = container_of(d, struct adb_walk_genadb, d);
+	struct adb_walk_genadb_level *parent;
+	const struct adb_object_schema *schema = NULL;
+	const uint8_t *kind;
+	struct adb *db;
 
 	if (!dt->db.hdr.schema) return -EAPKDBFORMAT;
-	if (dt->nest >= ARRAY_SIZE(dt->objs)) return -EAPKDBFORMAT;
 
-	if (dt->curkey[dt->nest] == 0 &&
-	    dt->objs[dt->nest].schema->kind == ADB_KIND_OBJECT)
+	parent = &dt->lvl[dt->nest];
+	if (parent->curkey == 0 && parent->obj.schema->kind == ADB_KIND_OBJECT)
 		return -EAPKDBFORMAT;
 
-	dt->nest++;
-	adb_wo_init_val(
-		&dt->objs[dt->nest], &dt->vals[dt->num_vals],
-		&dt->objs[dt->nest-1], dt->curkey[dt->nest-1]);
-
-	if (*adb_ro_kind(&dt->objs[dt->nest-1], dt->curkey[dt->nest-1]) == ADB_KIND_ADB) {
-		struct adb_adb_schema *schema = container_of(&dt->objs[dt->nest-1].schema->kind, struct adb_adb_schema, kind);
+	db = parent->obj.db;
+	kind = adb_ro_kind(&parent->obj, parent->curkey);
+	switch (*kind) {
+	case ADB_KIND_OBJECT:
+	case ADB_KIND_ARRAY:
+		schema = container_of(kind, struct adb_object_schema, kind);
+		break;
+	case ADB_KIND_ADB:
+		schema = container_of(kind, struct adb_adb_schema, kind)->schema;
 		if (dt->nestdb >= ARRAY_SIZE(dt->idb)) return -E2BIG;
-		adb_reset(&dt->idb[dt->nestdb]);
-		dt->idb[dt->nestdb].hdr.schema = htole32(schema->schema_id);
-		dt->objs[dt->nest].db = &dt->idb[dt->nestdb];
-		dt->nestdb++;
+		db = &dt->idb[dt->nestdb++];
+		if (!db->num_buckets)
+			adb_w_init_dynamic(db, 0, 100, 0);
+		adb_reset(db);
+		db->hdr.schema = htole32(container_of(kind, struct adb_adb_schema, kind)->schema_id);
+		break;
+	default:
+		return -EAPKDBFORMAT;
 	}
 
-	dt->num_vals += dt->objs[dt->nest].schema->num_fields;
-	if (dt->num_vals >= ARRAY_SIZE(dt->vals)) return -E2BIG;
-
-	return 0;
+	dt->nest++;
+	return genadb_push(dt, schema, db);
 }
 
 static int adb_walk_genadb_start_array(struct adb_walk *d, unsigned int num)
@@ -64,33 +161,33 @@ static int adb_walk_genadb_start_array(struct adb_walk *d, unsigned int num)
 static int adb_walk_genadb_end(struct adb_walk *d)
 {
 	struct adb_walk_genadb *dt = container_of(d, struct adb_walk_genadb, d);
+	struct adb_walk_genadb_level *l = &dt->lvl[dt->nest];
 	adb_val_t val;
+	int r;
 
-	val = adb_w_obj(&dt->objs[dt->nest]);
+	val = adb_w_obj(&l->obj);
 	if (ADB_IS_ERROR(val))
 		return -ADB_VAL_VALUE(val);
 
-	dt->curkey[dt->nest] = 0;
-	dt->num_vals -= dt->objs[dt->nest].schema->num_fields;
-
+	dt->num_vals = l->vals;
 	if (dt->nest == 0) {
 		dt->stored_object = val;
 		return 0;
 	}
 
-	dt->nest--;
-
-	if (*adb_ro_kind(&dt->objs[dt->nest], dt->curkey[dt->nest]) == ADB_KIND_ADB) {
+	l = &dt->lvl[--dt->nest];
+	if (*adb_ro_kind(&l->obj, l->curkey) == ADB_KIND_ADB) {
 		dt->nestdb--;
 		adb_w_root(&dt->idb[dt->nestdb], val);
-		val = adb_w_adb(&dt->db, &dt->idb[dt->nestdb]);
+		val = adb_w_adb(l->obj.db, &dt->idb[dt->nestdb]);
 	}
 
-	if (dt->curkey[dt->nest] == 0) {
-		adb_wa_append(&dt->objs[dt->nest], val);
+	if (l->curkey == 0) {
+		if ((r = genadb_array_room(dt)) != 0) return r;
+		adb_wa_append(&l->obj, val);
 	} else {
-		adb_wo_val(&dt->objs[dt->nest], dt->curkey[dt->nest], val);
-		dt->curkey[dt->nest] = 0;
+		adb_wo_val(&l->obj, l->curkey, val);
+		l->curkey = 0;
 	}
 
 	return 0;
@@ -99,13 +196,14 @@ static int adb_walk_genadb_end(struct adb_walk *d)
 static int adb_walk_genadb_key(struct adb_walk *d, apk_blob_t key)
 {
 	struct adb_walk_genadb *dt = container_of(d, struct adb_walk_genadb, d);
-	uint8_t kind = dt->objs[dt->nest].schema->kind;
+	struct adb_walk_genadb_level *l = &dt->lvl[dt->nest];
+	uint8_t kind = l->obj.schema->kind;
 
 	if (kind != ADB_KIND_OBJECT && kind != ADB_KIND_ADB)
 		return -EAPKDBFORMAT;
 
-	dt->curkey[dt->nest] = adb_s_field_by_name_blob(dt->objs[dt->nest].schema, key);
-	if (dt->curkey[dt->nest] == 0)
+	l->curkey = adb_s_field_by_name_blob(l->obj.schema, key);
+	if (l->curkey == 0)
 		return -EAPKDBFORMAT;
 
 	return 0;
@@ -114,16 +212,19 @@ static int adb_walk_genadb_key(struct adb_walk *d, apk_blob_t key)
 static int adb_walk_genadb_scalar(struct adb_walk *d, apk_blob_t scalar, int multiline)
 {
 	struct adb_walk_genadb *dt = container_of(d, struct adb_walk_genadb, d);
+	struct adb_walk_genadb_level *l = &dt->lvl[dt->nest];
+	int r;
 
-	if (dt->objs[dt->nest].schema->kind == ADB_KIND_ARRAY) {
-		adb_wa_append_fromstring(&dt->objs[dt->nest], scalar);
+	if (l->obj.schema->kind == ADB_KIND_ARRAY) {
+		if ((r = genadb_array_room(dt)) != 0) return r;
+		adb_wa_append_fromstring(&l->obj, scalar);
 	} else {
-		if (dt->curkey[dt->nest] == 0)
-			adb_wo_fromstring(&dt->objs[dt->nest], scalar);
+		if (l->curkey == 0)
+			adb_wo_fromstring(&l->obj, scalar);
 		else
-			adb_wo_val_fromstring(&dt->objs[dt->nest], dt->curkey[dt->nest], scalar);
+			adb_wo_val_fromstring(&l->obj, l->curkey, scalar);
 	}
-	dt->curkey[dt->nest] = 0;
+	l->curkey = 0;
 
 	return 0;
 }
@@ -1,16 +1,61 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "adb.h"
 #include "apk_print.h"
 
+static void adb_walk_gentext_flush(struct adb_walk_gentext *dt)
+{
+	if (dt->len && dt->os && !dt->rc)
+		apk_ostream_write(dt->os, dt->buf, dt->len);
+	dt->len = 0;
+}
+
+static void adb_walk_gentext_write(struct adb_walk_gentext *dt, const void *ptr, size_t len)
+{
+	size_t size;
+	char *buf;
+
+	if (dt->len + len > dt->size) {
+		if (dt->os) adb_walk_gentext_flush(dt);
+		if (dt->len + len > dt->size) {
+			size = dt->size ?: ADB_WALK_GENTEXT_BUFSZ;
+			while (size < dt->len + len) size *= 2;
+			buf = realloc(dt->buf, size);
+			if (!buf) {
+				dt->rc = -ENOMEM;
+				return;
+			}
+			dt->buf = buf;
+			dt->size = size;
+		}
+	}
+	memcpy(&dt->buf[dt->len], ptr, len);
+	dt->len += len;
+}
+
+static void adb_walk_gentext_blob(struct adb_walk_gentext *dt, apk_blob_t b)
+{
+	adb_walk_gentext_write(dt, b.ptr, b.len);
+}
+
+static void adb_walk_gentext_line(struct adb_walk_gentext *dt, apk_blob_t b)
+{
+	adb_walk_gentext_blob(dt, b);
+	adb_walk_gentext_write(dt, "\n", 1);
+}
+
 static void adb_walk_gentext_indent(struct adb_walk_gentext *dt)
 {
-	int i;
+	static const char spaces[] = "                                ";
+	size_t n;
 
 	if (!dt->line_started) {
-		for (i = 0; i < dt->nest; i++) {
-			fprintf(dt->out, "  ");
-		}
+		for (n = dt->nest * 2; n > 0; n -= min(n, sizeof spaces - 1))
+			adb_walk_gentext_write(dt, spaces, min(n, sizeof spaces - 1));
 	} else {
-		fprintf(dt->out, " ");
+		adb_walk_gentext_write(dt, " ", 1);
 	}
 	dt->line_started = 1;
 }
@@ -24,10 +69,10 @@ static void adb_walk_gentext_newline(struct adb_walk_gentext *dt)
 static int adb_walk_gentext_schema(struct adb_walk *d, uint32_t schema_id)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
+	char tmp[32];
 
 	adb_walk_gentext_indent(dt);
-	fprintf(out, "#%%SCHEMA: %08X\n", schema_id);
+	adb_walk_gentext_line(dt, APK_BLOB_PTR_LEN(tmp, snprintf(tmp, sizeof tmp, "#%%SCHEMA: %08X", schema_id)));
 	adb_walk_gentext_newline(dt);
 	return 0;
 }
@@ -35,10 +80,10 @@ static int adb_walk_gentext_schema(struct adb_walk *d, uint32_t schema_id)
 static int adb_walk_gentext_comment(struct adb_walk *d, apk_blob_t comment)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
 
 	adb_walk_gentext_indent(dt);
-	fprintf(out, "# "BLOB_FMT"\n", BLOB_PRINTF(comment));
+	adb_walk_gentext_blob(dt, APK_BLOB_STRLIT("# "));
+	adb_walk_gentext_line(dt, comment);
 	adb_walk_gentext_newline(dt);
 	return 0;
 }
@@ -46,10 +91,10 @@ static int adb_walk_gentext_comment(struct adb_walk *d, apk_blob_t comment)
 static int adb_walk_gentext_start_array(struct adb_walk *d, unsigned int num)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
+	char tmp[32];
 
 	adb_walk_gentext_indent(dt);
-	fprintf(out, "# %d items\n", num);
+	adb_walk_gentext_line(dt, APK_BLOB_PTR_LEN(tmp, snprintf(tmp, sizeof tmp, "# %d items", num)));
 	adb_walk_gentext_newline(dt);
 	dt->nest++;
 	return 0;
@@ -66,11 +111,10 @@ static int adb_walk_gentext_start_object(struct adb_walk *d)
 static int adb_walk_gentext_end(struct adb_walk *d)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
 
 	if (dt->line_started) {
 		adb_walk_gentext_indent(dt);
-		fprintf(out, "# empty object\n");
+		adb_walk_gentext_line(dt, APK_BLOB_STRLIT("# empty object"));
 		adb_walk_gentext_newline(dt);
 	}
 	dt->nest--;
@@ -80,19 +124,19 @@ static int adb_walk_gentext_end(struct adb_walk *d)
 static int adb_walk_gentext_key(struct adb_walk *d, apk_blob_t key)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
 
 	if (!APK_BLOB_IS_NULL(key)) {
 		if (dt->key_printed) {
-			fprintf(out, "\n");
+			adb_walk_gentext_write(dt, "\n", 1);
 			adb_walk_gentext_newline(dt);
 		}
 		adb_walk_gentext_indent(dt);
-		fprintf(out, BLOB_FMT":", BLOB_PRINTF(key));
+		adb_walk_gentext_blob(dt, key);
+		adb_walk_gentext_write(dt, ":", 1);
 		dt->key_printed = 1;
 	} else {
 		adb_walk_gentext_indent(dt);
-		fprintf(out, "-");
+		adb_walk_gentext_write(dt, "-", 1);
 	}
 	return 0;
 }
@@ -100,7 +144,6 @@ static int adb_walk_gentext_key(struct adb_walk *d, apk_blob_t key)
 static int adb_walk_gentext_scalar(struct adb_walk *d, apk_blob_t scalar, int multiline)
 {
 	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
-	FILE *out = dt->out;
 	apk_blob_t nl = APK_BLOB_STR("\n");
 
 	adb_walk_gentext_indent(dt);
@@ -109,28 +152,75 @@ static int adb_walk_gentext_scalar(struct adb_walk *d, apk_blob_t scalar, int mu
 		/* long or multiline */
 		apk_blob_t l;
 
-		fprintf(out, "|\n");
+		adb_walk_gentext_line(dt, APK_BLOB_STRLIT("|"));
 		adb_walk_gentext_newline(dt);
 
 		dt->nest++;
 		while (apk_blob_split(scalar, nl, &l, &scalar)) {
 			adb_walk_gentext_indent(dt);
-			fprintf(out, BLOB_FMT"\n", BLOB_PRINTF(l));
+			adb_walk_gentext_line(dt, l);
 			adb_walk_gentext_newline(dt);
 		}
 		if (scalar.len) {
 			adb_walk_gentext_indent(dt);
-			fprintf(out, BLOB_FMT"\n", BLOB_PRINTF(scalar));
+			adb_walk_gentext_line(dt, scalar);
 			adb_walk_gentext_newline(dt);
 		}
 		dt->nest--;
 	} else {
-		fprintf(out, BLOB_FMT"\n", BLOB_PRINTF(scalar));
+		adb_walk_gentext_line(dt, scalar);
 		adb_walk_gentext_newline(dt);
 	}
 	return 0;
 }
 
+static struct adb_walk *adb_walk_gentext_fork(struct adb_walk *d)
+{
+	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
+	struct adb_walk_gentext *ft;
+
+	ft = malloc(sizeof *ft);
+	if (!ft) return NULL;
+	*ft = (struct adb_walk_gentext) {
+		.d = dt->d,
+		.nest = dt->nest,
+		.line_started = dt->line_started,
+		.key_printed = dt->key_printed,
+	};
+	return &ft->d;
+}
+
+static int adb_walk_gentext_join(struct adb_walk *d, struct adb_walk *forked)
+{
+	struct adb_walk_gentext *dt = container_of(d, struct adb_walk_gentext, d);
+	struct adb_walk_gentext *ft = container_of(forked, struct adb_walk_gentext, d);
+
+	if (ft->rc && !dt->rc) dt->rc = ft->rc;
+	if (dt->os && ft->len >= ADB_WALK_GENTEXT_BUFSZ) {
+		/* Large output goes out as is instead of through the buffer */
+		adb_walk_gentext_flush(dt);
+		if (!dt->rc) apk_ostream_write(dt->os, ft->buf, ft->len);
+	} else {
+		adb_walk_gentext_write(dt, ft->buf, ft->len);
+	}
+	free(ft->buf);
+	free(ft);
+	return dt->rc;
+}
+
+int adb_walk_gentext_close(struct adb_walk_gentext *dt)
+{
+	int rc;
+
+	adb_walk_gentext_flush(dt);
+	free(dt->buf);
+	dt->buf = NULL;
+	dt->size = 0;
+	rc = dt->rc;
+	if (!rc && dt->os) rc = apk_ostream_error(dt->os);
+	return rc;
+}
+
 const struct adb_walk_ops adb_walk_gentext_ops = {
 	.schema = adb_walk_gentext_schema,
 	.comment = adb_walk_gentext_comment,
@@ -139,4 +229,6 @@ const struct adb_walk_ops adb_walk_gentext_ops = {
 	.end = adb_walk_gentext_end,
 	.key = adb_walk_gentext_key,
 	.scalar = adb_walk_gentext_scalar,
+	.fork = adb_walk_gentext_fork,
+	.join = adb_walk_gentext_join,
 };
@@ -59,6 +59,7 @@ static void version(struct apk_out *out, const char *prefix)
 	OPT(OPT_GLOBAL_arch,			APK_OPT_ARG "arch") \
 	OPT(OPT_GLOBAL_cache_dir,		APK_OPT_ARG "cache-dir") \
 	OPT(OPT_GLOBAL_cache_max_age,		APK_OPT_ARG "cache-max-age") \
+	OPT(OPT_GLOBAL_fetch_connections,	APK_OPT_ARG "fetch-connections") \
 	OPT(OPT_GLOBAL_force,			APK_OPT_SH("f") "force") \
 	OPT(OPT_GLOBAL_force_binary_stdout,	"force-binary-stdout") \
 	OPT(OPT_GLOBAL_force_broken_world,	"force-broken-world") \
@@ -68,6 +69,7 @@ static void version(struct apk_out *out, const char *prefix)
 	OPT(OPT_GLOBAL_force_refresh,		"force-refresh") \
 	OPT(OPT_GLOBAL_help,			APK_OPT_SH("h") "help") \
 	OPT(OPT_GLOBAL_interactive,		APK_OPT_SH("i") "interactive") \
+	OPT(OPT_GLOBAL_io_readahead,		APK_OPT_ARG "io-readahead") \
 	OPT(OPT_GLOBAL_keys_dir,		APK_OPT_ARG "keys-dir") \
 	OPT(OPT_GLOBAL_no_cache,		"no-cache") \
 	OPT(OPT_GLOBAL_no_network,		"no-network") \
@@ -185,6 +187,12 @@ static int option_parse_global(void *ctx, struct apk_ctx *ac, int opt, const cha
 	case OPT_GLOBAL_cache_max_age:
 		ac->cache_max_age = atoi(optarg) * 60;
 		break;
+	case OPT_GLOBAL_fetch_connections:
+		ac->fetch_connections = atoi(optarg);
+		if (ac->fetch_connections > 16) ac->fetch_connections = 16;
+		break;
+	case OPT_GLOBAL_io_readahead:
+		return apk_opt_count(&ac->out, "io-readahead", optarg, 0, APK_IO_READAHEAD_MAX, &ac->io_readahead);
 	case OPT_GLOBAL_arch:
 		ac->arch = optarg;
 		break;
@@ -215,11 +223,14 @@ const struct apk_option_group optgroup_global = {
 
 #define COMMIT_OPTIONS(OPT) \
 	OPT(OPT_COMMIT_clean_protected,		"clean-protected") \
+	OPT(OPT_COMMIT_durable,			"durable") \
 	OPT(OPT_COMMIT_initramfs_diskless_boot,	"initramfs-diskless-boot") \
 	OPT(OPT_COMMIT_no_commit_hooks,		"no-commit-hooks") \
 	OPT(OPT_COMMIT_no_scripts,		"no-scripts") \
 	OPT(OPT_COMMIT_overlay_from_stdin,	"overlay-from-stdin") \
-	OPT(OPT_COMMIT_simulate,		APK_OPT_SH("s") "simulate")
+	OPT(OPT_COMMIT_scripts_memfd,		"scripts-memfd") \
+	OPT(OPT_COMMIT_simulate,		APK_OPT_SH("s") "simulate") \
+	OPT(OPT_COMMIT_trigger_jobs,		APK_OPT_ARG "trigger-jobs")
 
 APK_OPT_GROUP(optiondesc_commit, "Commit", COMMIT_OPTIONS);
 
@@ -232,15 +243,23 @@ static int option_parse_commit(void *ctx, struct apk_ctx *ac, int opt, const cha
 	case OPT_COMMIT_clean_protected:
 		ac->flags |= APK_CLEAN_PROTECTED;
 		break;
+	case OPT_COMMIT_durable:
+		ac->flags |= APK_DURABLE;
+		break;
 	case OPT_COMMIT_overlay_from_stdin:
 		ac->flags |= APK_OVERLAY_FROM_STDIN;
 		break;
 	case OPT_COMMIT_no_scripts:
 		ac->flags |= APK_NO_SCRIPTS;
 		break;
+	case OPT_COMMIT_scripts_memfd:
+		ac->flags |= APK_SCRIPTS_MEMFD;
+		break;
 	case OPT_COMMIT_no_commit_hooks:
 		ac->flags |= APK_NO_COMMIT_HOOKS;
 		break;
+	case OPT_COMMIT_trigger_jobs:
+		return apk_opt_count(&ac->out, "trigger-jobs", optarg, 1, 64, &ac->trigger_jobs);
 	case OPT_COMMIT_initramfs_diskless_boot:
 		ac->open_flags |= APK_OPENF_CREATE;
 		ac->flags |= APK_NO_COMMIT_HOOKS;
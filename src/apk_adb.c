@@ -78,6 +78,103 @@ unsigned int adb_pkg_field_index(char f)
 	return map[(unsigned char)f - 'A'];
 }
 
+/* Index hash tables from package and provided names to packages array slots */
+static int ndx_match(struct adb_obj *pkgs, unsigned table, apk_blob_t name, int slot)
+{
+	struct adb_obj pkg, deps, dep;
+	int i;
+
+	adb_ro_obj(pkgs, slot, &pkg);
+	switch (table) {
+	case APK_NDX_HASH_NAME:
+		return apk_blob_compare(name, adb_ro_blob(&pkg, ADBI_PI_NAME)) == 0;
+	case APK_NDX_HASH_PROVIDES:
+		adb_ro_obj(&pkg, ADBI_PI_PROVIDES, &deps);
+		for (i = ADBI_FIRST; i <= adb_ra_num(&deps); i++) {
+			adb_ro_obj(&deps, i, &dep);
+			if (apk_blob_compare(name, adb_ro_blob(&dep, ADBI_DEP_NAME)) == 0)
+				return 1;
+		}
+		break;
+	}
+	return 0;
+}
+
+int apk_ndx_c_hash(struct apk_ostream *os, struct adb_obj *pkgs)
+{
+	struct adb_hash_entry *e = NULL, *ne;
+	struct adb_obj pkg, deps, dep;
+	size_t num = 0, max = 0;
+	int i, j, r;
+
+	for (i = ADBI_FIRST; i <= adb_ra_num(pkgs); i++) {
+		adb_ro_obj(pkgs, i, &pkg);
+		adb_ro_obj(&pkg, ADBI_PI_PROVIDES, &deps);
+		if (num + 1 + adb_ra_num(&deps) > max) {
+			max = max ? max * 2 : 1024;
+			ne = realloc(e, max * sizeof *e);
+			if (!ne) {
+				free(e);
+				return apk_ostream_cancel(os, -ENOMEM);
+			}
+			e = ne;
+		}
+		e[num++] = (struct adb_hash_entry) {
+			.table = APK_NDX_HASH_NAME,
+			.slot = i,
+			.key = adb_ro_blob(&pkg, ADBI_PI_NAME),
+		};
+		for (j = ADBI_FIRST; j <= adb_ra_num(&deps); j++) {
+			adb_ro_obj(&deps, j, &dep);
+			e[num++] = (struct adb_hash_entry) {
+				.table = APK_NDX_HASH_PROVIDES,
+				.slot = i,
+				.key = adb_ro_blob(&dep, ADBI_DEP_NAME),
+			};
+		}
+	}
+	r = adb_c_hash(os, APK_NDX_HASH_MAX, e, num);
+	free(e);
+	return r;
+}
+
+int apk_ndx_find(struct adb_obj *pkgs, unsigned table, apk_blob_t name, int cur)
+{
+	const uint32_t *slots;
+	int i, n, slot;
+
+	/* Candidates are in ascending slot order. Without a hash block,
+	 * fall back to a binary search by name or checking every package. */
+	n = adb_h_lookup(pkgs->db, table, name, &slots);
+	if (n < 0 && table == APK_NDX_HASH_NAME) {
+		/* The array is sorted by name */
+		struct adb_obj pkg;
+		int lo = cur + 1, hi = adb_ra_num(pkgs) + 1, mid;
+
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			adb_ro_obj(pkgs, mid, &pkg);
+			if (apk_blob_sort(adb_ro_blob(&pkg, ADBI_PI_NAME), name) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo <= adb_ra_num(pkgs) && ndx_match(pkgs, table, name, lo)) return lo;
+		return -1;
+	}
+	if (n < 0) {
+		for (slot = cur + 1; slot <= adb_ra_num(pkgs); slot++)
+			if (ndx_match(pkgs, table, name, slot)) return slot;
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		slot = le32toh(slots[i]);
+		if (slot <= cur || slot > adb_ra_num(pkgs)) continue;
+		if (ndx_match(pkgs, table, name, slot)) return slot;
+	}
+	return -1;
+}
+
 /* Schema */
 
 static apk_blob_t string_tostring(struct adb *db, adb_val_t val, char *buf, size_t bufsz)
@@ -449,6 +546,7 @@ const struct adb_object_schema schema_file = {
 		ADB_FIELD(ADBI_FI_MTIME,	"mtime",	scalar_int),
 		ADB_FIELD(ADBI_FI_HASHES,	"hash",		scalar_hexblob),
 		ADB_FIELD(ADBI_FI_TARGET,	"target",	scalar_string),
+		ADB_FIELD(ADBI_FI_DATA_OFFSET,	"data-offset",	scalar_int),
 	},
 };
 
@@ -506,6 +604,7 @@ const struct adb_object_schema schema_package = {
 		ADB_FIELD(ADBI_PKG_SCRIPTS,	"scripts",	schema_scripts),
 		ADB_FIELD(ADBI_PKG_TRIGGERS,	"triggers",	schema_string_array),
 		//ADB_FIELD(ADBI_PKG_PASSWD,	"passwd",	schema_string_array),
+		ADB_FIELD(ADBI_PKG_DATA_SIZE,	"data-size",	scalar_int),
 	},
 };
 
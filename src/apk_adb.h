@@ -47,7 +47,8 @@
 #define ADBI_FI_MTIME		0x04
 #define ADBI_FI_HASHES		0x05
 #define ADBI_FI_TARGET		0x06
-#define ADBI_FI_MAX		0x07
+#define ADBI_FI_DATA_OFFSET	0x07
+#define ADBI_FI_MAX		0x08
 
 /* Directory Info */
 #define ADBI_DI_NAME		0x01
@@ -71,8 +72,12 @@
 #define ADBI_PKG_SCRIPTS	0x03
 #define ADBI_PKG_TRIGGERS	0x04
 #define ADBI_PKG_PASSWD		0x05
-#define ADBI_PKG_MAX		0x06
+#define ADBI_PKG_DATA_SIZE	0x06
+#define ADBI_PKG_MAX		0x07
 
+/* Data blocks of seekable packages are compressed independently. The
+ * file data-offset is relative to the first data block, which starts
+ * data-size bytes before the end of the package file. */
 struct adb_data_package {
 	uint32_t path_idx;
 	uint32_t file_idx;
@@ -102,7 +107,14 @@ extern const struct adb_object_schema
 	schema_string_array, schema_scripts, schema_package, schema_package_adb_array,
 	schema_index, schema_idb;
 
+/* Index hash tables */
+#define APK_NDX_HASH_NAME	0
+#define APK_NDX_HASH_PROVIDES	1
+#define APK_NDX_HASH_MAX	2
+
 /* */
 int apk_dep_split(apk_blob_t *b, apk_blob_t *bdep);
 adb_val_t adb_wo_pkginfo(struct adb_obj *obj, unsigned int f, apk_blob_t val);
 unsigned int adb_pkg_field_index(char f);
+int apk_ndx_c_hash(struct apk_ostream *os, struct adb_obj *pkgs);
+int apk_ndx_find(struct adb_obj *pkgs, unsigned table, apk_blob_t name, int cur);
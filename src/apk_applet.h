@@ -53,11 +53,13 @@ struct apk_applet {
 	int (*main)(void *ctx, struct apk_ctx *ac, struct apk_string_array *args);
 };
 
-extern const struct apk_option_group optgroup_global, optgroup_commit, optgroup_signing;
+extern const struct apk_option_group optgroup_global, optgroup_commit, optgroup_signing, optgroup_query;
 
 void apk_applet_register(struct apk_applet *);
 void apk_applet_register_builtin(void);
 struct apk_applet *apk_applet_find(const char *name);
+int apk_opt_count(struct apk_out *out, const char *opt, const char *arg,
+		  unsigned int min, unsigned int max, unsigned int *val);
 void apk_applet_help(struct apk_applet *applet, struct apk_out *out);
 typedef void (*apk_init_func_t)(void);
 
@@ -92,6 +92,7 @@ int apk_blob_spn(apk_blob_t blob, const apk_spn_match accept, apk_blob_t *l, apk
 int apk_blob_cspn(apk_blob_t blob, const apk_spn_match reject, apk_blob_t *l, apk_blob_t *r);
 int apk_blob_split(apk_blob_t blob, apk_blob_t split, apk_blob_t *l, apk_blob_t *r);
 int apk_blob_rsplit(apk_blob_t blob, char split, apk_blob_t *l, apk_blob_t *r);
+int apk_blob_split_lines(apk_blob_t blob, apk_blob_t *lines, int max, apk_blob_t *left);
 apk_blob_t apk_blob_pushed(apk_blob_t buffer, apk_blob_t left);
 unsigned long apk_blob_hash_seed(apk_blob_t, unsigned long seed);
 unsigned long apk_blob_hash(apk_blob_t str);
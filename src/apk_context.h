@@ -26,6 +26,8 @@
 #define APK_NO_CACHE			BIT(9)
 #define APK_NO_COMMIT_HOOKS		BIT(10)
 #define APK_NO_CHROOT			BIT(11)
+#define APK_DURABLE			BIT(12)
+#define APK_SCRIPTS_MEMFD		BIT(13)
 
 #define APK_FORCE_OVERWRITE		BIT(0)
 #define APK_FORCE_OLD_APK		BIT(1)
@@ -55,6 +57,9 @@ struct apk_database;
 
 struct apk_ctx {
 	unsigned int flags, force, lock_wait;
+	unsigned int trigger_jobs;
+	unsigned int io_readahead;
+	unsigned int fetch_connections;
 	struct apk_out out;
 	struct apk_progress progress;
 	unsigned int cache_max_age;
@@ -67,6 +72,7 @@ struct apk_ctx {
 	const char *uvol;
 	struct apk_string_array *repository_list;
 	struct apk_string_array *private_keys;
+	struct apk_string_array *index_files;
 
 	struct apk_trust trust;
 	struct apk_id_cache id_cache;
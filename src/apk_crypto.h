@@ -40,7 +40,19 @@ struct apk_digest {
 
 #define APK_DIGEST_BLOB(d) APK_BLOB_PTR_LEN((void*)((d).data), (d).len)
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define APK_DIGEST_FETCH
+/* Implementations fetched by apk_crypto_init(). The legacy EVP_sha1() style
+ * getters make OpenSSL 3 look up the provider on every digest init, which
+ * dominates the cost of hashing small files. */
+extern EVP_MD *apk_digest_evp[APK_DIGEST_SHA512 + 1];
+#endif
+
 static inline const EVP_MD *apk_digest_alg_to_evp(uint8_t alg) {
+#ifdef APK_DIGEST_FETCH
+	if (alg <= APK_DIGEST_SHA512 && apk_digest_evp[alg])
+		return apk_digest_evp[alg];
+#endif
 	switch (alg) {
 	case APK_DIGEST_NONE:	return EVP_md_null();
 	case APK_DIGEST_MD5:	return EVP_md5();
@@ -165,6 +177,10 @@ static inline void apk_crypto_init(void)
 #endif
 }
 
+#elif defined(APK_DIGEST_FETCH)
+
+void apk_crypto_init(void);
+
 #else
 
 static inline void apk_crypto_init(void) {}
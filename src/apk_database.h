@@ -110,10 +110,19 @@ struct apk_name {
 	};
 };
 
+struct apk_repository_mirror {
+	char *url;
+	unsigned int latency;		/* milliseconds, 0 if not measured */
+	unsigned int throughput;	/* KiB/s, 0 if not measured */
+	unsigned int failed : 1;
+};
+APK_ARRAY(apk_mirror_array, struct apk_repository_mirror);
+
 struct apk_repository {
 	const char *url;
 	struct apk_checksum csum;
 	apk_blob_t description;
+	struct apk_mirror_array *mirrors;
 };
 
 #define APK_REPOSITORY_CACHED		0
@@ -145,6 +154,9 @@ struct apk_database {
 	int open_complete : 1;
 	int compat_newfeatures : 1;
 	int compat_notinstallable : 1;
+	int script_memfd_checked : 1;
+	int script_memfd : 1;
+	int mirrors_changed : 1;
 
 	struct apk_dependency_array *world;
 	struct apk_id_cache *id_cache;
@@ -153,6 +165,13 @@ struct apk_database {
 	struct apk_repository_tag repo_tags[APK_MAX_TAGS];
 	struct apk_atom_pool atoms;
 
+	struct {
+		unsigned int num;
+		int overflow;
+		dev_t dev[APK_MAX_SYNCFS];
+		int fd[APK_MAX_SYNCFS];
+	} syncfs;
+
 	struct {
 		struct apk_hash names;
 		struct apk_hash packages;
@@ -195,8 +214,12 @@ int apk_db_write_config(struct apk_database *db);
 int apk_db_permanent(struct apk_database *db);
 int apk_db_check_world(struct apk_database *db, struct apk_dependency_array *world);
 int apk_db_fire_triggers(struct apk_database *db);
-int apk_db_run_script(struct apk_database *db, char *fn, char **argv);
+int apk_db_run_script(struct apk_database *db, int script_fd, char *fn, char **argv);
+pid_t apk_db_spawn_script(struct apk_database *db, int script_fd, char *fn, char **argv, int out_fd, int err_fd);
+int apk_db_script_status(struct apk_database *db, char *fn, int status);
 void apk_db_update_directory_permissions(struct apk_database *db);
+void apk_db_syncfs_track(struct apk_database *db, const char *dir);
+int apk_db_syncfs(struct apk_database *db);
 static inline time_t apk_db_url_since(struct apk_database *db, time_t since) {
 	return apk_ctx_since(db->ctx, since);
 }
@@ -108,6 +108,7 @@ static inline int IS_ERR_OR_NULL(const void *ptr) { return IS_ERR(ptr) || !ptr;
 
 #define APK_MAX_REPOS		32	/* see struct apk_package */
 #define APK_MAX_TAGS		16	/* see solver; unsigned short */
+#define APK_MAX_SYNCFS		8	/* see struct apk_database */
 #define APK_CACHE_CSUM_BYTES	4
 
 static inline size_t apk_calc_installed_size(size_t size)
@@ -10,6 +10,7 @@
 #define APK_IO
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <time.h>
 
@@ -18,9 +19,12 @@
 #include "apk_atom.h"
 #include "apk_crypto.h"
 
+struct cache_item;
+
 struct apk_id_hash {
 	int empty;
 	struct hlist_head by_id[16], by_name[16];
+	struct cache_item *last;
 };
 
 struct apk_id_cache {
@@ -57,6 +61,9 @@ struct apk_file_info {
 };
 
 extern size_t apk_io_bufsize;
+extern unsigned int apk_io_readahead;
+
+#define APK_IO_READAHEAD_MAX	64
 
 struct apk_istream;
 struct apk_ostream;
@@ -65,6 +72,9 @@ struct apk_istream_ops {
 	void (*get_meta)(struct apk_istream *is, struct apk_file_meta *meta);
 	ssize_t (*read)(struct apk_istream *is, void *ptr, size_t size);
 	int (*close)(struct apk_istream *is);
+	/* optional: move up to size bytes to fd within the kernel,
+	 * returns -ENOTSUP if it cannot be done for this fd */
+	ssize_t (*splice)(struct apk_istream *is, int fd, size_t size);
 };
 
 #define APK_ISTREAM_SINGLE_READ			0x0001
@@ -87,14 +97,18 @@ typedef int (*apk_archive_entry_parser)(void *ctx,
 
 struct apk_istream *apk_istream_from_file(int atfd, const char *file);
 struct apk_istream *apk_istream_from_file_gz(int atfd, const char *file);
+struct apk_istream *apk_istream_from_file_mmap(int atfd, const char *file);
 struct apk_istream *apk_istream_from_fd(int fd);
 struct apk_istream *apk_istream_from_fd_url_if_modified(int atfd, const char *url, time_t since);
+struct apk_istream *apk_istream_from_fd_url_range(int atfd, const char *url, time_t since,
+						  off_t *offset, time_t validator);
 static inline int apk_istream_error(struct apk_istream *is, int err) { if (!is->err) is->err = err; return err; }
 ssize_t apk_istream_read(struct apk_istream *is, void *ptr, size_t size);
 void *apk_istream_get(struct apk_istream *is, size_t len);
 apk_blob_t apk_istream_get_max(struct apk_istream *is, size_t size);
 apk_blob_t apk_istream_get_delim(struct apk_istream *is, apk_blob_t token);
 static inline apk_blob_t apk_istream_get_all(struct apk_istream *is) { return apk_istream_get_max(is, APK_IO_ALL); }
+int apk_istream_get_lines(struct apk_istream *is, apk_blob_t *lines, int max);
 ssize_t apk_istream_splice(struct apk_istream *is, int fd, size_t size,
 			   apk_progress_cb cb, void *cb_ctx, struct apk_digest_ctx *dctx);
 ssize_t apk_stream_copy(struct apk_istream *is, struct apk_ostream *os, size_t size,
@@ -117,6 +131,15 @@ static inline int apk_istream_close(struct apk_istream *is)
 	return is->ops->close(is);
 }
 
+#define APK_COMPRESSION_GZIP	0
+#define APK_COMPRESSION_ZSTD	1
+#define APK_COMPRESSION_METHOD(c)	((c) & 0xff)
+#define APK_COMPRESSION_LEVEL(c)	((c) >> 8)
+
+#define APK_ZSTD_DEFAULT_LEVEL	9
+
+int apk_compression_by_name(const char *name);
+
 #define APK_MPART_DATA		1 /* data processed so far */
 #define APK_MPART_BOUNDARY	2 /* final part of data, before boundary */
 #define APK_MPART_END		3 /* signals end of stream */
@@ -129,6 +152,21 @@ static inline struct apk_istream *apk_istream_gunzip(struct apk_istream *is)
 {
 	return apk_istream_gunzip_mpart(is, NULL, NULL);
 }
+/* The gunzip reader detects the format of each member, and decodes
+ * zstd frames too when built with zstd support. */
+static inline struct apk_istream *apk_istream_decompress_mpart(struct apk_istream *is,
+								apk_multipart_cb cb, void *ctx)
+{
+	return apk_istream_gunzip_mpart(is, cb, ctx);
+}
+static inline struct apk_istream *apk_istream_decompress(struct apk_istream *is)
+{
+	return apk_istream_gunzip_mpart(is, NULL, NULL);
+}
+
+void *apk_zstd_decoder_new(void);
+void apk_zstd_decoder_free(void *dec);
+int apk_zstd_decode(void *dec, const uint8_t **in, size_t *in_len, uint8_t **out, size_t *out_len);
 
 struct apk_segment_istream {
 	struct apk_istream is;
@@ -137,11 +175,22 @@ struct apk_segment_istream {
 	time_t mtime;
 };
 struct apk_istream *apk_istream_segment(struct apk_segment_istream *sis, struct apk_istream *is, size_t len, time_t mtime);
-struct apk_istream *apk_istream_tee(struct apk_istream *from, int atfd, const char *to, int copy_meta,
-				    apk_progress_cb cb, void *cb_ctx);
+
+#define APK_ISTREAM_TEE_COPY_META	0x0001
+#define APK_ISTREAM_TEE_RESUME		0x0002
+
+/* Data read from the source, and the time spent waiting for it */
+struct apk_transfer_stats {
+	off_t bytes;
+	uint64_t usec;
+};
+
+struct apk_istream *apk_istream_tee(struct apk_istream *from, int atfd, const char *to, unsigned int flags,
+				    apk_progress_cb cb, void *cb_ctx, struct apk_transfer_stats *stats);
 
 struct apk_ostream_ops {
 	ssize_t (*write)(struct apk_ostream *os, const void *buf, size_t size);
+	ssize_t (*writev)(struct apk_ostream *os, const struct iovec *vec, size_t nvec);
 	int (*close)(struct apk_ostream *os);
 };
 
@@ -151,11 +200,16 @@ struct apk_ostream {
 };
 
 struct apk_ostream *apk_ostream_gzip(struct apk_ostream *);
+#define APK_GZIP_THREADS_MAX	64
+struct apk_ostream *apk_ostream_gzip_threads(struct apk_ostream *, unsigned int threads);
+struct apk_ostream *apk_ostream_zstd(struct apk_ostream *, int level);
+struct apk_ostream *apk_ostream_compress(struct apk_ostream *, int compression, unsigned int threads);
 struct apk_ostream *apk_ostream_counter(off_t *);
 struct apk_ostream *apk_ostream_to_fd(int fd);
 struct apk_ostream *apk_ostream_to_file(int atfd, const char *file, mode_t mode);
 struct apk_ostream *apk_ostream_to_file_gz(int atfd, const char *file, const char *tmpfile, mode_t mode);
 size_t apk_ostream_write_string(struct apk_ostream *ostream, const char *string);
+ssize_t apk_ostream_writev(struct apk_ostream *os, const struct iovec *vec, size_t nvec);
 static inline int apk_ostream_error(struct apk_ostream *os) { return os->rc; }
 static inline int apk_ostream_cancel(struct apk_ostream *os, int rc) { if (!os->rc) os->rc = rc; return rc; }
 static inline ssize_t apk_ostream_write(struct apk_ostream *os, const void *buf, size_t size)
@@ -188,6 +242,9 @@ typedef int apk_dir_file_cb(void *ctx, int dirfd, const char *entry);
 int apk_dir_foreach_file(int dirfd, apk_dir_file_cb cb, void *ctx);
 
 const char *apk_url_local_file(const char *url);
+int apk_url_fetch_ranges(const char *url, int fd, off_t offset, off_t size, unsigned int connections,
+			 time_t since, time_t validator, struct apk_file_meta *meta,
+			 apk_progress_cb cb, void *cb_ctx);
 
 void apk_id_cache_init(struct apk_id_cache *idc, int root_fd);
 void apk_id_cache_free(struct apk_id_cache *idc);
@@ -182,6 +182,10 @@ int apk_ipkg_add_script(struct apk_installed_package *ipkg,
 			unsigned int type, unsigned int size);
 void apk_ipkg_run_script(struct apk_installed_package *ipkg, struct apk_database *db,
 			 unsigned int type, char **argv);
+pid_t apk_ipkg_spawn_script(struct apk_installed_package *ipkg, struct apk_database *db,
+			    unsigned int type, char **argv, int out_fd, int err_fd);
+void apk_ipkg_reap_script(struct apk_installed_package *ipkg, struct apk_database *db,
+			  unsigned int type, int status, int out_fd, int err_fd);
 
 struct apk_package *apk_pkg_parse_index_entry(struct apk_database *db, apk_blob_t entry);
 int apk_pkg_write_index_entry(struct apk_package *pkg, struct apk_ostream *os);
@@ -0,0 +1,54 @@
+/* apk_query.h - Alpine Package Keeper (APK)
+ *
+ * Copyright (C) 2005-2008 Natanael Copa <n@tanael.org>
+ * Copyright (C) 2008-2021 Timo Teräs <timo.teras@iki.fi>
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#ifndef APK_QUERY_H
+#define APK_QUERY_H
+
+#include "adb.h"
+#include "apk_context.h"
+
+/* Read-only queries answered straight from mapped v3 indexes. The
+ * package objects point into the shared file mappings, so nothing is
+ * parsed or copied until a field is asked for. */
+
+struct apk_query_index {
+	const char *url;
+	struct adb db;
+	struct adb_obj pkgs;
+	int cur;
+};
+
+struct apk_query_pkg {
+	struct apk_query_index *ndx;
+	struct adb_obj obj;
+};
+
+struct apk_query {
+	struct apk_ctx *ac;
+	size_t num_ndx;
+	struct apk_query_index *ndx;
+	struct apk_query_pkg *pkgs;
+	size_t num_pkgs, max_pkgs;
+};
+
+typedef void (*apk_query_match_cb)(struct apk_query *q, const char *match, apk_blob_t name,
+				   struct apk_query_pkg *pkgs, size_t num, void *ctx);
+
+static inline int apk_query_enabled(struct apk_ctx *ac) { return ac->index_files->num != 0; }
+
+int apk_query_open(struct apk_query *q, struct apk_ctx *ac);
+void apk_query_close(struct apk_query *q);
+
+void apk_query_foreach_matching(struct apk_query *q, struct apk_string_array *filter, unsigned int match,
+				apk_query_match_cb cb, void *ctx);
+void apk_query_foreach_rdepend(struct apk_query *q, apk_blob_t name,
+			       void (*cb)(struct apk_query *q, struct apk_query_pkg *pkg, void *ctx),
+			       void *ctx);
+
+#endif
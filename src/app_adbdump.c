@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include "apk_adb.h"
@@ -12,13 +14,49 @@ static const struct adb_db_schema dbschemas[] = {
 	{},
 };
 
-static int mmap_and_dump_adb(struct apk_trust *trust, int fd, struct apk_out *out)
+struct adbdump_ctx {
+	struct apk_string_array *match;
+	unsigned int jobs;
+};
+
+#define ADBDUMP_OPTIONS(OPT) \
+	OPT(OPT_ADBDUMP_jobs,		APK_OPT_ARG "jobs") \
+	OPT(OPT_ADBDUMP_match,		APK_OPT_ARG "match")
+
+APK_OPT_APPLET(option_desc, ADBDUMP_OPTIONS);
+
+static int option_parse_applet(void *pctx, struct apk_ctx *ac, int opt, const char *optarg)
+{
+	struct adbdump_ctx *ctx = (struct adbdump_ctx *) pctx;
+
+	switch (opt) {
+	case OPT_ADBDUMP_jobs:
+		ctx->jobs = atoi(optarg);
+		break;
+	case OPT_ADBDUMP_match:
+		if (!ctx->match) apk_string_array_init(&ctx->match);
+		*apk_string_array_add(&ctx->match) = (char*) optarg;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+	return 0;
+}
+
+static const struct apk_option_group optgroup_applet = {
+	.desc = option_desc,
+	.parse = option_parse_applet,
+};
+
+static int mmap_and_dump_adb(struct adbdump_ctx *ctx, struct apk_trust *trust, int fd, struct apk_ostream *os)
 {
 	struct adb db;
 	struct adb_walk_gentext td = {
 		.d.ops = &adb_walk_gentext_ops,
 		.d.schemas = dbschemas,
-		.out = out->out,
+		.d.filter = ctx->match,
+		.d.jobs = ctx->jobs,
+		.os = os,
 	};
 	int r;
 
@@ -26,29 +64,41 @@ static int mmap_and_dump_adb(struct apk_trust *trust, int fd, struct apk_out *ou
 	if (r) return r;
 
 	adb_walk_adb(&td.d, &db, trust);
+	r = adb_walk_gentext_close(&td);
 	adb_free(&db);
-	return 0;
+	return r;
 }
 
 static int adbdump_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
+	struct adbdump_ctx *ctx = pctx;
 	struct apk_out *out = &ac->out;
+	struct apk_ostream *os;
 	char **arg;
-	int r;
+	int r = 0, rc;
+
+	/* Closing the stream must not close stdout itself */
+	os = apk_ostream_to_fd(dup(STDOUT_FILENO));
+	if (IS_ERR(os)) return PTR_ERR(os);
 
 	foreach_array_item(arg, args) {
-		r = mmap_and_dump_adb(apk_ctx_get_trust(ac), open(*arg, O_RDONLY), out);
+		r = mmap_and_dump_adb(ctx, apk_ctx_get_trust(ac), open(*arg, O_RDONLY), os);
 		if (r) {
 			apk_err(out, "%s: %s", *arg, apk_error_str(r));
-			return r;
+			break;
 		}
 	}
+	rc = apk_ostream_close(os);
+	if (!r) r = rc;
+	if (ctx->match) apk_string_array_free(&ctx->match);
 
-	return 0;
+	return r;
 }
 
 static struct apk_applet apk_adbdump = {
 	.name = "adbdump",
+	.context_size = sizeof(struct adbdump_ctx),
+	.optgroups = { &optgroup_global, &optgroup_applet },
 	.main = adbdump_main,
 };
 APK_DEFINE_APPLET(apk_adbdump);
@@ -64,11 +114,8 @@ static int adbgen_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *
 		.d.schemas = dbschemas,
 	};
 
-	adb_w_init_alloca(&genadb.db, 0, 1000);
-	adb_w_init_alloca(&genadb.idb[0], 0, 100);
 	foreach_array_item(arg, args) {
-		adb_reset(&genadb.db);
-		adb_reset(&genadb.idb[0]);
+		adb_w_init_dynamic(&genadb.db, 0, 1000, 0);
 		r = adb_walk_istream(&genadb.d, apk_istream_from_file(AT_FDCWD, *arg));
 		if (!r) {
 			adb_w_root(&genadb.db, genadb.stored_object);
@@ -76,9 +123,9 @@ static int adbgen_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *
 				apk_ctx_get_trust(ac));
 		}
 		adb_free(&genadb.db);
-		adb_free(&genadb.idb[0]);
 		if (r) apk_err(out, "%s: %s", *arg, apk_error_str(r));
 	}
+	adb_walk_genadb_free(&genadb);
 
 	return 0;
 }
@@ -205,8 +205,8 @@ static int conv_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *ar
 	list_init(&ctx->script_head);
 	apk_atom_init(&ctx->atoms);
 
-	adb_w_init_alloca(&ctx->dbi, ADB_SCHEMA_INSTALLED_DB, 10);
-	adb_w_init_alloca(&ctx->dbp, ADB_SCHEMA_PACKAGE, 1000);
+	adb_w_init_dynamic(&ctx->dbi, ADB_SCHEMA_INSTALLED_DB, 10, 0);
+	adb_w_init_dynamic(&ctx->dbp, ADB_SCHEMA_PACKAGE, 1000, 0);
 	adb_wo_alloca(&idb, &schema_idb, &ctx->dbi);
 	adb_wo_alloca(&ctx->pkgs, &schema_package_adb_array, &ctx->dbi);
 
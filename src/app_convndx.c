@@ -59,7 +59,7 @@ static int load_index(struct conv_ctx *ctx, struct apk_istream *is)
 	ctx->found = 0;
 	apk_sign_ctx_init(&ctx->sctx, APK_SIGN_VERIFY, NULL, apk_ctx_get_trust(ctx->ac));
 	r = apk_tar_parse(
-		apk_istream_gunzip_mpart(is, apk_sign_ctx_mpart_cb, &ctx->sctx),
+		apk_istream_decompress_mpart(is, apk_sign_ctx_mpart_cb, &ctx->sctx),
 		load_apkindex, ctx, apk_ctx_get_id_cache(ctx->ac));
 	apk_sign_ctx_free(&ctx->sctx);
 	if (r >= 0 && ctx->found == 0) r = -ENOMSG;
@@ -76,7 +76,7 @@ static int conv_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *ar
 	int r;
 
 	ctx->ac = ac;
-	adb_w_init_alloca(&ctx->dbi, ADB_SCHEMA_INDEX, 1000);
+	adb_w_init_dynamic(&ctx->dbi, ADB_SCHEMA_INDEX, 1000, 0);
 	adb_wo_alloca(&ndx, &schema_index, &ctx->dbi);
 	adb_wo_alloca(&ctx->pkgs, &schema_pkginfo_array, &ctx->dbi);
 
@@ -8,6 +8,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <spawn.h>
 #include <unistd.h>
@@ -31,19 +32,26 @@ struct extract_ctx {
 	unsigned int cur_path, cur_file;
 
 	struct apk_pathbuilder pb;
+	struct apk_string_array *filter;
+	const char *local_file;
+	unsigned int num_extracted;
 	unsigned int is_uvol : 1;
+	unsigned int seek : 1;
 };
 
 
 #define EXTRACT_OPTIONS(OPT) \
 	OPT(OPT_EXTRACT_destination,	APK_OPT_ARG "destination") \
-	OPT(OPT_EXTRACT_no_chown,	"no-chown")
+	OPT(OPT_EXTRACT_no_chown,	"no-chown") \
+	OPT(OPT_EXTRACT_path,		APK_OPT_ARG APK_OPT_SH("p") "path")
 
 APK_OPT_APPLET(option_desc, EXTRACT_OPTIONS);
 
 static int option_parse_applet(void *pctx, struct apk_ctx *ac, int opt, const char *optarg)
 {
 	struct extract_ctx *ctx = (struct extract_ctx *) pctx;
+	char *p;
+	size_t len;
 
 	switch (opt) {
 	case OPT_EXTRACT_destination:
@@ -52,6 +60,14 @@ static int option_parse_applet(void *pctx, struct apk_ctx *ac, int opt, const ch
 	case OPT_EXTRACT_no_chown:
 		ctx->extract_flags |= APK_EXTRACTF_NO_CHOWN;
 		break;
+	case OPT_EXTRACT_path:
+		p = (char *) optarg;
+		while (*p == '/') p++;
+		for (len = strlen(p); len > 0 && p[len-1] == '/'; len--)
+			p[len-1] = 0;
+		if (!ctx->filter) apk_string_array_init(&ctx->filter);
+		*apk_string_array_add(&ctx->filter) = p;
+		break;
 	default:
 		return -ENOTSUP;
 	}
@@ -70,6 +86,28 @@ static void apk_extract_acl(struct apk_file_info *fi, struct adb_obj *o, struct
 	fi->gid = apk_id_cache_resolve_gid(idc, adb_ro_blob(o, ADBI_ACL_GROUP), 65534);
 }
 
+static int path_within(apk_blob_t path, apk_blob_t dir)
+{
+	if (!apk_blob_starts_with(path, dir)) return 0;
+	return path.len == dir.len || path.ptr[dir.len] == '/';
+}
+
+/* A selected path extracts the named file, or everything below the
+ * named directory. The directories leading to it are created too. */
+static int extract_selected(struct extract_ctx *ctx, int is_dir)
+{
+	apk_blob_t name = apk_pathbuilder_get(&ctx->pb);
+	char **pf;
+
+	if (ctx->filter->num == 0) return 1;
+	foreach_array_item(pf, ctx->filter) {
+		apk_blob_t sel = APK_BLOB_STR(*pf);
+		if (path_within(name, sel)) return 1;
+		if (is_dir && path_within(sel, name)) return 1;
+	}
+	return 0;
+}
+
 static int uvol_detect(struct apk_ctx *ac, struct apk_pathbuilder *pb)
 {
 	apk_blob_t b = apk_pathbuilder_get(pb);
@@ -188,6 +226,7 @@ static int apk_extract_file(struct extract_ctx *ctx, off_t sz, struct apk_istrea
 	apk_digest_ctx_free(&dctx);
 	if (r != 0) return r;
 	if (apk_digest_cmp(&fi.digest, &d) != 0) return -EAPKDBFORMAT;
+	ctx->num_extracted++;
 	return 0;
 }
 
@@ -236,6 +275,7 @@ static int apk_extract_next_file(struct extract_ctx *ctx)
 			apk_pathbuilder_setb(&ctx->pb, adb_ro_blob(&ctx->path, ADBI_DI_NAME));
 			ctx->is_uvol = uvol_detect(ac, &ctx->pb);
 			adb_ro_obj(&ctx->path, ADBI_DI_FILES, &ctx->files);
+			if (!extract_selected(ctx, 1)) continue;
 			r = apk_extract_directory(ctx);
 			if (r != 0) return r;
 		}
@@ -247,22 +287,15 @@ static int apk_extract_next_file(struct extract_ctx *ctx)
 		    APK_BLOB_IS_NULL(target)) {
 			return 0;
 		}
+		if (!extract_selected(ctx, 0)) continue;
 		r = apk_extract_file(ctx, 0, 0);
 		if (r != 0) return r;
 	} while (1);
 }
 
-static int apk_extract_data_block(struct adb *db, size_t sz, struct apk_istream *is)
+static int apk_extract_data(struct extract_ctx *ctx, size_t sz, struct apk_istream *is)
 {
-	struct extract_ctx *ctx = container_of(db, struct extract_ctx, db);
 	struct adb_data_package *hdr;
-	int r;
-
-	r = apk_extract_next_file(ctx);
-	if (r != 0) {
-		if (r > 0) r = -EAPKFORMAT;
-		return r;
-	}
 
 	hdr = apk_istream_get(is, sizeof *hdr);
 	sz -= sizeof *hdr;
@@ -274,20 +307,100 @@ static int apk_extract_data_block(struct adb *db, size_t sz, struct apk_istream
 		// got data for some unexpected file
 		return -EAPKFORMAT;
 	}
+	if (!extract_selected(ctx, 0)) return 0;
 
 	return apk_extract_file(ctx, sz, is);
 }
 
+static int apk_extract_data_block(struct adb *db, size_t sz, struct apk_istream *is)
+{
+	struct extract_ctx *ctx = container_of(db, struct extract_ctx, db);
+	int r;
+
+	if (!ctx->cur_path && ctx->filter->num && ctx->local_file) {
+		// seek to the selected files if the package has offsets
+		adb_r_rootobj(&ctx->db, &ctx->pkg, &schema_package);
+		if (adb_ro_val(&ctx->pkg, ADBI_PKG_DATA_SIZE) != ADB_NULL) {
+			ctx->seek = 1;
+			return -ECANCELED;
+		}
+	}
+
+	r = apk_extract_next_file(ctx);
+	if (r != 0) {
+		if (r > 0) r = -EAPKFORMAT;
+		return r;
+	}
+
+	return apk_extract_data(ctx, sz, is);
+}
+
+static int apk_extract_seek_file(struct extract_ctx *ctx, int fd, off_t data_start)
+{
+	struct apk_istream *is;
+	struct adb_block *blk;
+	int r;
+
+	if (adb_ro_val(&ctx->file, ADBI_FI_DATA_OFFSET) == ADB_NULL) return -EAPKFORMAT;
+	if (lseek(fd, data_start + adb_ro_int(&ctx->file, ADBI_FI_DATA_OFFSET), SEEK_SET) < 0)
+		return -errno;
+
+	is = apk_istream_decompress(apk_istream_from_fd(dup(fd)));
+	if (IS_ERR(is)) return PTR_ERR(is);
+	blk = apk_istream_get(is, sizeof *blk);
+	if (IS_ERR(blk)) r = PTR_ERR(blk);
+	else if (adb_block_type(blk) != ADB_BLOCK_DATA) r = -EAPKFORMAT;
+	else r = apk_extract_data(ctx, adb_block_length(blk), is);
+	apk_istream_close(is);
+	return r;
+}
+
+static int apk_extract_seekable(struct extract_ctx *ctx)
+{
+	struct stat st;
+	off_t data_size;
+	int fd, r;
+
+	fd = openat(AT_FDCWD, ctx->local_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -errno;
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		goto done;
+	}
+	data_size = adb_ro_int(&ctx->pkg, ADBI_PKG_DATA_SIZE);
+	if (data_size > st.st_size) {
+		r = -EAPKFORMAT;
+		goto done;
+	}
+
+	// the signature was verified when streaming the header, and
+	// the file data is checked against the hashes in it
+	while ((r = apk_extract_next_file(ctx)) == 0) {
+		r = apk_extract_seek_file(ctx, fd, st.st_size - data_size);
+		if (r != 0) break;
+	}
+	if (r == 1) r = 0;
+done:
+	close(fd);
+	return r;
+}
+
 static int apk_extract_pkg(struct extract_ctx *ctx, const char *fn)
 {
 	struct apk_ctx *ac = ctx->ac;
 	struct apk_trust *trust = apk_ctx_get_trust(ac);
 	int r;
 
+	ctx->db = (struct adb) {};
+	ctx->cur_path = 0;
+	ctx->seek = 0;
+	ctx->local_file = apk_url_local_file(fn);
 	r = adb_m_stream(&ctx->db,
-		apk_istream_gunzip(apk_istream_from_fd_url(AT_FDCWD, fn, apk_ctx_since(ac, 0))),
+		apk_istream_decompress(apk_istream_from_fd_url(AT_FDCWD, fn, apk_ctx_since(ac, 0))),
 		ADB_SCHEMA_PACKAGE, trust, apk_extract_data_block);
-	if (r == 0) {
+	if (r == -ECANCELED && ctx->seek) {
+		r = apk_extract_seekable(ctx);
+	} else if (r == 0) {
 		r = apk_extract_next_file(ctx);
 		if (r == 0) r = -EAPKFORMAT;
 		if (r == 1) r = 0;
@@ -301,7 +414,7 @@ static int extract_main(void *pctx, struct apk_ctx *ac, struct apk_string_array
 	struct extract_ctx *ctx = pctx;
 	struct apk_out *out = &ac->out;
 	char **parg;
-	int r;
+	int r = 0;
 
 	ctx->ac = ac;
 	ctx->extract_flags |= APK_EXTRACTF_NO_OVERWRITE;
@@ -314,6 +427,7 @@ static int extract_main(void *pctx, struct apk_ctx *ac, struct apk_string_array
 		return r;
 	}
 
+	if (!ctx->filter) apk_string_array_init(&ctx->filter);
 	foreach_array_item(parg, args) {
 		apk_out(out, "Extracting %s...", *parg);
 		r = apk_extract_pkg(ctx, *parg);
@@ -322,6 +436,11 @@ static int extract_main(void *pctx, struct apk_ctx *ac, struct apk_string_array
 			break;
 		}
 	}
+	if (r == 0 && ctx->filter->num && !ctx->num_extracted) {
+		apk_err(out, "No files matched the selected paths");
+		r = -ENOENT;
+	}
+	apk_string_array_free(&ctx->filter);
 	close(ctx->root_fd);
 	return r;
 }
@@ -30,11 +30,15 @@ struct index_ctx {
 	const char *description;
 	const char *rewrite_arch;
 	time_t index_mtime;
+	unsigned int compress_threads;
+	int compression;
 	int method;
 	unsigned short index_flags;
 };
 
 #define INDEX_OPTIONS(OPT) \
+	OPT(OPT_INDEX_compress_threads,	APK_OPT_ARG "compress-threads") \
+	OPT(OPT_INDEX_compression,	APK_OPT_ARG "compression") \
 	OPT(OPT_INDEX_description,	APK_OPT_ARG APK_OPT_SH("d") "description") \
 	OPT(OPT_INDEX_index,		APK_OPT_ARG APK_OPT_SH("x") "index") \
 	OPT(OPT_INDEX_no_warnings,	"no-warnings") \
@@ -46,8 +50,18 @@ APK_OPT_APPLET(option_desc, INDEX_OPTIONS);
 static int option_parse_applet(void *ctx, struct apk_ctx *ac, int opt, const char *optarg)
 {
 	struct index_ctx *ictx = (struct index_ctx *) ctx;
+	struct apk_out *out = &ac->out;
 
 	switch (opt) {
+	case OPT_INDEX_compress_threads:
+		return apk_opt_count(out, "compress-threads", optarg, 1, APK_GZIP_THREADS_MAX, &ictx->compress_threads);
+	case OPT_INDEX_compression:
+		ictx->compression = apk_compression_by_name(optarg);
+		if (ictx->compression < 0) {
+			apk_err(out, "unsupported compression: %s", optarg);
+			return -EINVAL;
+		}
+		break;
 	case OPT_INDEX_description:
 		ictx->description = optarg;
 		break;
@@ -218,7 +232,7 @@ static int index_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *ar
 		apk_ostream_close(counter);
 
 		if (r >= 0) {
-			os = apk_ostream_gzip(os);
+			os = apk_ostream_compress(os, ictx->compression, ictx->compress_threads);
 			if (ictx->description != NULL) {
 				struct apk_file_info fi_desc;
 				memset(&fi_desc, 0, sizeof(fi));
@@ -15,6 +15,8 @@
 #include "apk_package.h"
 #include "apk_database.h"
 #include "apk_print.h"
+#include "apk_adb.h"
+#include "apk_query.h"
 
 struct info_ctx {
 	struct apk_database *db;
@@ -360,6 +362,109 @@ static void print_name_info(struct apk_database *db, const char *match, struct a
 		info_subaction(ctx, p->pkg);
 }
 
+static void query_print_blob(struct adb_obj *pkg, const char *text, apk_blob_t value)
+{
+	apk_blob_t name = adb_ro_blob(pkg, ADBI_PI_NAME);
+
+	if (verbosity > 1)
+		printf(BLOB_FMT ": " BLOB_FMT, BLOB_PRINTF(name), BLOB_PRINTF(value));
+	else
+		printf(BLOB_FMT "-" BLOB_FMT " %s:\n" BLOB_FMT "\n",
+		       BLOB_PRINTF(name), BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)),
+		       text, BLOB_PRINTF(value));
+}
+
+static void query_print_dep_array(struct adb_obj *pkg, unsigned int field, const char *text)
+{
+	struct adb_obj deps, dep;
+	apk_blob_t name = adb_ro_blob(pkg, ADBI_PI_NAME), b;
+	char buf[256];
+
+	if (verbosity == 1)
+		printf(BLOB_FMT "-" BLOB_FMT " %s:\n",
+		       BLOB_PRINTF(name), BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)), text);
+	if (verbosity > 1)
+		printf(BLOB_FMT ": ", BLOB_PRINTF(name));
+	adb_ro_obj(pkg, field, &deps);
+	for (int i = ADBI_FIRST; i <= adb_ra_num(&deps); i++) {
+		adb_ro_obj(&deps, i, &dep);
+		b = dep.schema->tostring(&dep, buf, sizeof buf);
+		printf(BLOB_FMT "%s", BLOB_PRINTF(b), verbosity > 1 ? " " : "\n");
+	}
+}
+
+static void query_subaction(struct info_ctx *ctx, struct adb_obj *pkg)
+{
+	off_t size;
+	const char *size_unit;
+	char buf[64];
+
+	/* Same order as info_subaction(), without the parts that need
+	 * the package to be installed */
+	if (ctx->subaction_mask & APK_INFO_DESC) {
+		query_print_blob(pkg, "description", adb_ro_blob(pkg, ADBI_PI_DESCRIPTION));
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_URL) {
+		query_print_blob(pkg, "webpage", adb_ro_blob(pkg, ADBI_PI_URL));
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_SIZE) {
+		size_unit = apk_get_human_size(adb_ro_int(pkg, ADBI_PI_INSTALLED_SIZE), &size);
+		query_print_blob(pkg, "installed size",
+			APK_BLOB_PTR_LEN(buf, snprintf(buf, sizeof buf, "%lld %s", (long long)size, size_unit)));
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_DEPENDS) {
+		query_print_dep_array(pkg, ADBI_PI_DEPENDS, "depends on");
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_PROVIDES) {
+		query_print_dep_array(pkg, ADBI_PI_PROVIDES, "provides");
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_INSTALL_IF) {
+		query_print_dep_array(pkg, ADBI_PI_INSTALL_IF, "has auto-install rule");
+		puts("");
+	}
+	if (ctx->subaction_mask & APK_INFO_LICENSE) {
+		query_print_blob(pkg, "license", adb_ro_blob(pkg, ADBI_PI_LICENSE));
+		puts("");
+	}
+}
+
+static void query_name_info(struct apk_query *q, const char *match, apk_blob_t name,
+			    struct apk_query_pkg *pkgs, size_t num, void *pctx)
+{
+	struct info_ctx *ctx = (struct info_ctx *) pctx;
+
+	if (APK_BLOB_IS_NULL(name)) {
+		ctx->errors++;
+		return;
+	}
+	for (size_t i = 0; i < num; i++)
+		query_subaction(ctx, &pkgs[i].obj);
+}
+
+static int info_query(struct info_ctx *ictx, struct apk_ctx *ac, struct apk_string_array *args)
+{
+	struct apk_query q;
+	int r;
+
+	if (ictx->action != NULL) {
+		apk_err(&ac->out, "--installed and --who-owns need the installed database");
+		return -EINVAL;
+	}
+	/* Nothing is installed in an index */
+	if (args->num == 0) return 0;
+
+	r = apk_query_open(&q, ac);
+	if (r) return r;
+	apk_query_foreach_matching(&q, args, APK_FOREACH_NULL_MATCHES_ALL, query_name_info, ictx);
+	apk_query_close(&q);
+	return ictx->errors;
+}
+
 #define INFO_OPTIONS(OPT) \
 	OPT(OPT_INFO_all,		APK_OPT_SH("a") "all") \
 	OPT(OPT_INFO_contents,		APK_OPT_SH("L") "contents") \
@@ -449,6 +554,8 @@ static int info_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *arg
 	ictx->db = db;
 	if (ictx->subaction_mask == 0)
 		ictx->subaction_mask = APK_INFO_DESC | APK_INFO_URL | APK_INFO_SIZE;
+	if (apk_query_enabled(ac))
+		return info_query(ictx, ac, args);
 	if (ictx->action != NULL) {
 		ictx->action(ictx, db, args);
 	} else if (args->num > 0) {
@@ -474,7 +581,7 @@ static struct apk_applet apk_info = {
 	.name = "info",
 	.open_flags = APK_OPENF_READ,
 	.context_size = sizeof(struct info_ctx),
-	.optgroups = { &optgroup_global, &optgroup_applet },
+	.optgroups = { &optgroup_global, &optgroup_applet, &optgroup_query },
 	.main = info_main,
 };
 
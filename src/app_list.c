@@ -16,6 +16,8 @@
 #include "apk_package.h"
 #include "apk_database.h"
 #include "apk_print.h"
+#include "apk_adb.h"
+#include "apk_query.h"
 
 struct list_ctx {
 	int verbosity;
@@ -172,6 +174,83 @@ static void print_result(struct apk_database *db, const char *match, struct apk_
 	}
 }
 
+static void query_print_package(struct adb_obj *pkg, const struct list_ctx *ctx)
+{
+	apk_blob_t name = adb_ro_blob(pkg, ADBI_PI_NAME), b;
+	char **pmatch;
+
+	if (ctx->match_origin) {
+		b = adb_ro_blob(pkg, ADBI_PI_ORIGIN);
+		foreach_array_item(pmatch, ctx->filters)
+			if (b.len && apk_blob_compare(APK_BLOB_STR(*pmatch), b) == 0)
+				goto match;
+		return;
+	}
+match:
+	b = adb_ro_blob(pkg, ADBI_PI_ORIGIN);
+	printf(BLOB_FMT "-" BLOB_FMT " " BLOB_FMT " {" BLOB_FMT "} (" BLOB_FMT ")",
+		BLOB_PRINTF(name), BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)),
+		BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_ARCH)),
+		BLOB_PRINTF(b.len ? b : name),
+		BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_LICENSE)));
+
+	if (ctx->verbosity > 1) {
+		printf("\n  " BLOB_FMT "\n", BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_DESCRIPTION)));
+		if (ctx->verbosity > 2)
+			printf("  <" BLOB_FMT ">\n", BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_URL)));
+	}
+
+	printf("\n");
+}
+
+static void query_print_rdep(struct apk_query *q, struct apk_query_pkg *qp, void *pctx)
+{
+	const struct list_ctx *ctx = pctx;
+
+	if (ctx->match_providers)
+		printf("<" BLOB_FMT "> ", BLOB_PRINTF(adb_ro_blob(&qp->obj, ADBI_PI_NAME)));
+	query_print_package(&qp->obj, ctx);
+}
+
+static void query_print_result(struct apk_query *q, const char *match, apk_blob_t name,
+			       struct apk_query_pkg *pkgs, size_t num, void *pctx)
+{
+	const struct list_ctx *ctx = pctx;
+	struct apk_query_pkg *qp;
+
+	if (APK_BLOB_IS_NULL(name))
+		return;
+
+	if (ctx->match_depends) {
+		apk_query_foreach_rdepend(q, name, query_print_rdep, pctx);
+		return;
+	}
+	for (qp = pkgs; qp < &pkgs[num]; qp++) {
+		if (!ctx->match_providers &&
+		    apk_blob_compare(adb_ro_blob(&qp->obj, ADBI_PI_NAME), name) != 0)
+			continue;
+		if (ctx->match_providers)
+			printf("<" BLOB_FMT "> ", BLOB_PRINTF(name));
+		query_print_package(&qp->obj, ctx);
+	}
+}
+
+static int list_query(struct list_ctx *ctx, struct apk_ctx *ac, struct apk_string_array *args)
+{
+	struct apk_query q;
+	int r;
+
+	/* Nothing from an index is installed */
+	if (ctx->installed || ctx->upgradable)
+		return 0;
+
+	r = apk_query_open(&q, ac);
+	if (r) return r;
+	apk_query_foreach_matching(&q, args, APK_FOREACH_NULL_MATCHES_ALL, query_print_result, ctx);
+	apk_query_close(&q);
+	return 0;
+}
+
 #define LIST_OPTIONS(OPT) \
 	OPT(OPT_LIST_available,		APK_OPT_SH("a") "available") \
 	OPT(OPT_LIST_installed,		APK_OPT_SH("I") "installed") \
@@ -238,6 +317,9 @@ static int list_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *ar
 	if (ctx->match_origin)
 		args = NULL;
 
+	if (apk_query_enabled(ac))
+		return list_query(ctx, ac, args);
+
 	apk_name_foreach_matching(
 		db, args, APK_FOREACH_NULL_MATCHES_ALL | apk_foreach_genid(),
 		print_result, ctx);
@@ -249,7 +331,7 @@ static struct apk_applet apk_list = {
 	.name = "list",
 	.open_flags = APK_OPENF_READ,
 	.context_size = sizeof(struct list_ctx),
-	.optgroups = { &optgroup_global, &optgroup_applet },
+	.optgroups = { &optgroup_global, &optgroup_applet, &optgroup_query },
 	.main = list_main,
 };
 
@@ -113,7 +113,7 @@ static void process_file(struct apk_database *db, const char *match)
 
 	apk_sign_ctx_init(&sctx, APK_SIGN_VERIFY, NULL, apk_ctx_get_trust(db->ctx));
 	r = apk_tar_parse(
-		apk_istream_gunzip_mpart(apk_istream_from_file(AT_FDCWD, match), apk_sign_ctx_mpart_cb, &sctx),
+		apk_istream_decompress_mpart(apk_istream_from_file(AT_FDCWD, match), apk_sign_ctx_mpart_cb, &sctx),
 		read_file_entry, &ctx, idc);
 	apk_sign_ctx_free(&sctx);
 	if (r < 0) apk_err(out, "%s: %s", match, apk_error_str(r));
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "apk_adb.h"
@@ -21,24 +22,33 @@
 #include "apk_database.h"
 #include "apk_print.h"
 
+struct mkndx_file {
+	const char *name;
+	size_t size;
+	int reuse;
+	int r;
+	apk_blob_t pkginfo;
+};
+
 struct mkndx_ctx {
 	const char *index;
 	const char *output;
 	const char *description;
 	apk_blob_t rewrite_arch;
+	unsigned int jobs;
+	unsigned int merge : 1;
 
 	apk_blob_t r;
 	struct adb db;
 	struct adb_obj pkgs;
 	time_t index_mtime;
-
-	struct apk_sign_ctx sctx;
-	size_t file_size;
 };
 
 #define MKNDX_OPTIONS(OPT) \
 	OPT(OPT_MKNDX_description,	APK_OPT_ARG APK_OPT_SH("d") "description") \
 	OPT(OPT_MKNDX_index,		APK_OPT_ARG APK_OPT_SH("x") "index") \
+	OPT(OPT_MKNDX_jobs,		APK_OPT_ARG "jobs") \
+	OPT(OPT_MKNDX_merge,		"merge") \
 	OPT(OPT_MKNDX_output,		APK_OPT_ARG APK_OPT_SH("o") "output") \
 	OPT(OPT_MKNDX_rewrite_arch,	APK_OPT_ARG "rewrite-arch")
 
@@ -58,6 +68,12 @@ static int option_parse_applet(void *ctx, struct apk_ctx *ac, int optch, const c
 	case OPT_MKNDX_description:
 		ictx->description = optarg;
 		break;
+	case OPT_MKNDX_jobs:
+		ictx->jobs = atoi(optarg);
+		break;
+	case OPT_MKNDX_merge:
+		ictx->merge = 1;
+		break;
 	case OPT_MKNDX_rewrite_arch:
 		ictx->rewrite_arch = APK_BLOB_STR(optarg);
 		break;
@@ -84,7 +100,17 @@ static int cmpfield(const void *pa, const void *pb)
 	return apk_blob_sort(a->str, b->str);
 }
 
-static adb_val_t mkndx_read_v2_pkginfo(struct adb *db, struct apk_istream *is, size_t file_size, struct apk_sign_ctx *sctx, apk_blob_t rewrite_arch)
+static int mkndx_next_line(apk_blob_t *b, apk_blob_t *line)
+{
+	if (b->len <= 0) return 0;
+	if (!apk_blob_split(*b, APK_BLOB_STRLIT("\n"), line, b)) {
+		*line = *b;
+		*b = APK_BLOB_NULL;
+	}
+	return 1;
+}
+
+static adb_val_t mkndx_read_v2_pkginfo(struct adb *db, apk_blob_t b, size_t file_size, apk_blob_t rewrite_arch)
 {
 	static struct field fields[]  = {
 		FIELD("arch",			ADBI_PI_ARCH),
@@ -110,7 +136,7 @@ static adb_val_t mkndx_read_v2_pkginfo(struct adb *db, struct apk_istream *is, s
 	};
 	struct field *f, key;
 	struct adb_obj pkginfo, deps[3];
-	apk_blob_t line, l, r, token = APK_BLOB_STR("\n"), bdep;
+	apk_blob_t line, l, r, bdep;
 	int e = 0, i = 0;
 
 	adb_wo_alloca(&pkginfo, &schema_pkginfo, db);
@@ -118,8 +144,7 @@ static adb_val_t mkndx_read_v2_pkginfo(struct adb *db, struct apk_istream *is, s
 	adb_wo_alloca(&deps[1], &schema_dependency_array, db);
 	adb_wo_alloca(&deps[2], &schema_dependency_array, db);
 
-	while (!APK_BLOB_IS_NULL(line = apk_istream_get_delim(is, token))) {
-		if (sctx) apk_sign_ctx_parse_pkginfo_line(sctx, line);
+	while (mkndx_next_line(&b, &line)) {
 		if (line.len < 1 || line.ptr[0] == '#') continue;
 		if (!apk_blob_split(line, APK_BLOB_STR(" = "), &l, &r)) continue;
 
@@ -163,55 +188,225 @@ static adb_val_t mkndx_read_v2_pkginfo(struct adb *db, struct apk_istream *is, s
 	return adb_w_obj(&pkginfo);
 }
 
+struct mkndx_parse {
+	struct apk_sign_ctx sctx;
+	struct mkndx_file *file;
+};
+
 static int mkndx_parse_v2_tar(void *pctx, const struct apk_file_info *ae, struct apk_istream *is)
 {
-	struct mkndx_ctx *ctx = pctx;
-	adb_val_t o;
+	struct mkndx_parse *p = pctx;
+	apk_blob_t b, line;
 	int r;
 
-	r = apk_sign_ctx_process_file(&ctx->sctx, ae, is);
+	r = apk_sign_ctx_process_file(&p->sctx, ae, is);
 	if (r <= 0) return r;
-	if (ctx->sctx.control_verified) return -ECANCELED;
-	if (!ctx->sctx.control_started || ctx->sctx.data_started) return 0;
+	if (p->sctx.control_verified) return -ECANCELED;
+	if (!p->sctx.control_started || p->sctx.data_started) return 0;
 
 	if (strcmp(ae->name, ".PKGINFO") == 0) {
-		o = adb_wa_append(
-			&ctx->pkgs,
-			mkndx_read_v2_pkginfo(
-				&ctx->db, is, ctx->file_size, &ctx->sctx,
-				ctx->rewrite_arch));
-		if (ADB_IS_ERROR(o)) return -ADB_VAL_VALUE(o);
+		b = apk_blob_from_istream(is, ae->size);
+		if (APK_BLOB_IS_NULL(b)) return is->err < 0 ? is->err : -ENOMEM;
+		free(p->file->pkginfo.ptr);
+		p->file->pkginfo = b;
+		while (mkndx_next_line(&b, &line))
+			apk_sign_ctx_parse_pkginfo_line(&p->sctx, line);
 	}
 
 	return 0;
 }
 
+static void mkndx_parse_file(struct mkndx_file *f, struct apk_trust *trust, struct apk_id_cache *idc)
+{
+	struct mkndx_parse p = { .file = f };
+	int r;
+
+	apk_sign_ctx_init(&p.sctx, APK_SIGN_VERIFY, NULL, trust);
+	r = apk_tar_parse(
+		apk_istream_decompress_mpart(apk_istream_from_file(AT_FDCWD, f->name), apk_sign_ctx_mpart_cb, &p.sctx),
+		mkndx_parse_v2_tar, &p, idc);
+	apk_sign_ctx_free(&p.sctx);
+	if (r < 0 && r != -ECANCELED) f->r = r;
+}
+
+/* The packages are read and verified by worker threads. Only the
+ * .PKGINFO text is kept, and the index is built from it in argument
+ * order, so the output does not depend on the number of jobs. */
+struct mkndx_scan {
+	pthread_mutex_t mutex;
+	struct mkndx_file *files;
+	size_t num, next;
+	struct apk_trust *trust;
+	int root_fd;
+};
+
+static struct mkndx_file *mkndx_scan_next(struct mkndx_scan *s)
+{
+	struct mkndx_file *f = NULL;
+
+	pthread_mutex_lock(&s->mutex);
+	for (; s->next < s->num && !f; s->next++) {
+		f = &s->files[s->next];
+		if (f->r < 0 || f->reuse) f = NULL;
+	}
+	pthread_mutex_unlock(&s->mutex);
+	return f;
+}
+
+static void mkndx_scan_files(struct mkndx_scan *s, struct apk_id_cache *idc)
+{
+	struct mkndx_file *f;
+
+	while ((f = mkndx_scan_next(s)) != NULL)
+		mkndx_parse_file(f, s->trust, idc);
+}
+
+static void *mkndx_scan_thread(void *arg)
+{
+	struct mkndx_scan *s = arg;
+	struct apk_id_cache idc;
+
+	apk_id_cache_init(&idc, s->root_fd);
+	mkndx_scan_files(s, &idc);
+	apk_id_cache_free(&idc);
+	return NULL;
+}
+
+static void mkndx_scan(struct mkndx_scan *s, unsigned int jobs, struct apk_id_cache *idc)
+{
+	pthread_t *threads;
+	unsigned int i, n = 0;
+
+	if (jobs > s->num) jobs = s->num;
+	threads = jobs > 1 ? calloc(jobs - 1, sizeof *threads) : NULL;
+	for (i = 0; threads && i < jobs - 1; i++, n++)
+		if (pthread_create(&threads[i], NULL, mkndx_scan_thread, s) != 0) break;
+	mkndx_scan_files(s, idc);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+struct mkndx_shard {
+	struct adb db;
+	struct adb_obj pkgs, pkg;
+	int cur;
+};
+
+static int mkndx_shard_next(struct mkndx_shard *s)
+{
+	if (s->cur > adb_ra_num(&s->pkgs)) return 0;
+	if (++s->cur > adb_ra_num(&s->pkgs)) return 0;
+	adb_ro_obj(&s->pkgs, s->cur, &s->pkg);
+	return 1;
+}
+
+/* Merge indexes built from separate sets of packages, e.g. on each
+ * build host. The shard package arrays are sorted, so the entries are
+ * copied in order and no package file is opened. */
+static int mkndx_merge(struct mkndx_ctx *ctx, struct apk_ctx *ac, struct apk_string_array *args)
+{
+	struct apk_out *out = &ac->out;
+	struct apk_trust *trust = apk_ctx_get_trust(ac);
+	struct mkndx_shard *shards, *s, *best;
+	struct adb_obj root;
+	adb_val_t val;
+	size_t i, num = args->num;
+	int r = 0;
+
+	shards = calloc(num ?: 1, sizeof *shards);
+	if (!shards) return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		s = &shards[i];
+		r = adb_m_map(&s->db, open(args->item[i], O_RDONLY), ADB_SCHEMA_INDEX, trust);
+		if (r) {
+			apk_err(out, "%s: %s", args->item[i], apk_error_str(r));
+			goto done;
+		}
+		adb_ro_obj(adb_r_rootobj(&s->db, &root, &schema_index), ADBI_NDX_PACKAGES, &s->pkgs);
+		mkndx_shard_next(s);
+	}
+
+	do {
+		best = NULL;
+		for (s = shards; s < &shards[num]; s++) {
+			if (s->cur > adb_ra_num(&s->pkgs)) continue;
+			if (!best || schema_pkginfo.compare(&s->pkg, &best->pkg) < 0) best = s;
+		}
+		if (!best) break;
+
+		val = adb_wa_append(&ctx->pkgs, adb_w_copy(&ctx->db, &best->db, adb_ro_val(&best->pkgs, best->cur)));
+		if (ADB_IS_ERROR(val)) {
+			r = -ADB_VAL_VALUE(val);
+			apk_err(out, "%s: %s", args->item[best - shards], apk_error_str(r));
+			goto done;
+		}
+
+		// the same package in several shards is included once
+		for (s = best + 1; s < &shards[num]; s++) {
+			if (s->cur > adb_ra_num(&s->pkgs)) continue;
+			if (schema_pkginfo.compare(&s->pkg, &best->pkg) != 0) continue;
+			if (adb_ro_int(&s->pkg, ADBI_PI_FILE_SIZE) != adb_ro_int(&best->pkg, ADBI_PI_FILE_SIZE)) {
+				apk_warn(out, BLOB_FMT "-" BLOB_FMT ": differs in %s, using %s",
+					BLOB_PRINTF(adb_ro_blob(&best->pkg, ADBI_PI_NAME)),
+					BLOB_PRINTF(adb_ro_blob(&best->pkg, ADBI_PI_VERSION)),
+					args->item[s - shards], args->item[best - shards]);
+			}
+			mkndx_shard_next(s);
+		}
+		mkndx_shard_next(best);
+	} while (1);
+
+done:
+	for (i = 0; i < num; i++)
+		adb_free(&shards[i].db);
+	free(shards);
+	return r;
+}
+
 static int mkndx_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
 	struct apk_out *out = &ac->out;
 	struct apk_id_cache *idc = apk_ctx_get_id_cache(ac);
 	struct apk_trust *trust = apk_ctx_get_trust(ac);
-	struct adb odb, tmpdb;
-	struct adb_obj oroot, opkgs, ndx, tmpl;
+	struct adb odb = {};
+	struct adb_obj oroot, opkgs, ndx, root, pkgs;
+	struct apk_ostream *os;
 	struct apk_file_info fi;
-	adb_val_t match;
-	int r, found, errors = 0, newpkgs = 0, numpkgs;
+	struct mkndx_scan scan = {};
+	struct mkndx_file *files, *f;
+	adb_val_t val;
+	int r, errors = 0, newpkgs = 0, numpkgs;
 	struct mkndx_ctx *ctx = pctx;
-	char **parg;
 	time_t index_mtime = 0;
+	size_t i, size_hint = 0;
 
 	if (ctx->output == NULL) {
 		apk_err(out, "Please specify --output FILE");
 		return -1;
 	}
 
-	adb_w_init_tmp(&tmpdb, 200);
-	adb_wo_alloca(&tmpl, &schema_pkginfo, &tmpdb);
+	/* A merged index is about as large as its shards together, and
+	 * a package entry takes a few hundred bytes */
+	for (i = 0; ctx->merge && i < args->num; i++)
+		if (apk_fileinfo_get(AT_FDCWD, args->item[i], 0, &fi, 0) == 0)
+			size_hint += fi.size;
+	if (!ctx->merge) size_hint = args->num * 256;
 
-	adb_w_init_alloca(&ctx->db, ADB_SCHEMA_INDEX, 1000);
+	adb_w_init_dynamic(&ctx->db, ADB_SCHEMA_INDEX, 1000, size_hint);
 	adb_wo_alloca(&ndx, &schema_index, &ctx->db);
 	adb_wo_alloca(&ctx->pkgs, &schema_pkginfo_array, &ctx->db);
 
+	if (ctx->merge) {
+		r = mkndx_merge(ctx, ac, args);
+		if (r) {
+			adb_free(&ctx->db);
+			return r;
+		}
+		goto write;
+	}
+
 	if (ctx->index) {
 		apk_fileinfo_get(AT_FDCWD, ctx->index, 0, &fi, 0);
 		index_mtime = fi.mtime;
@@ -224,85 +419,105 @@ static int mkndx_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *a
 		adb_ro_obj(adb_r_rootobj(&odb, &oroot, &schema_index), ADBI_NDX_PACKAGES, &opkgs);
 	}
 
-	foreach_array_item(parg, args) {
-		r = apk_fileinfo_get(AT_FDCWD, *parg, 0, &fi, 0);
-		if (r < 0) {
-		err_pkg:
-			apk_err(out, "%s: %s", *parg, apk_error_str(r));
-			errors++;
-			continue;
-		}
-		ctx->file_size = fi.size;
+	files = calloc(args->num ?: 1, sizeof *files);
+	if (!files) return -ENOMEM;
+
+	for (i = 0; i < args->num; i++) {
+		f = &files[i];
+		f->name = args->item[i];
+		f->r = apk_fileinfo_get(AT_FDCWD, f->name, 0, &fi, 0);
+		if (f->r < 0) continue;
+		f->size = fi.size;
 
-		found = FALSE;
 		if (index_mtime >= fi.mtime) {
-			char *fname, *fend;
+			const char *fname, *fend;
 			apk_blob_t bname, bver;
 
 			/* Check that it looks like a package name */
-			fname = strrchr(*parg, '/');
+			fname = strrchr(f->name, '/');
 			if (fname == NULL)
-				fname = *parg;
+				fname = f->name;
 			else
 				fname++;
 			fend = strstr(fname, ".apk");
-			if (!fend) goto do_file;
+			if (!fend) continue;
 			if (fend-fname > 10 && fend[-9] == '.') fend -= 9;
-			if (apk_pkg_parse_name(APK_BLOB_PTR_PTR(fname, fend-1),
+			if (apk_pkg_parse_name(APK_BLOB_PTR_PTR((char *) fname, (char *) fend-1),
 					       &bname, &bver) < 0)
-				goto do_file;
-
-			adb_wo_resetdb(&tmpl);
-			adb_wo_blob(&tmpl, ADBI_PI_NAME, bname);
-			adb_wo_blob(&tmpl, ADBI_PI_VERSION, bver);
-			match = adb_w_obj(&tmpl);
+				continue;
 
-			for (int i = 0; (i = adb_ra_find(&opkgs, i, &tmpdb, match)) > 0; ) {
+			for (int j = 0; (j = apk_ndx_find(&opkgs, APK_NDX_HASH_NAME, bname, j)) > 0; ) {
 				struct adb_obj pkg;
-				adb_val_t val;
 
-				adb_ro_obj(&opkgs, i, &pkg);
-				if (apk_blob_compare(bname, adb_ro_blob(&pkg, ADBI_PI_NAME))) continue;
+				adb_ro_obj(&opkgs, j, &pkg);
 				if (apk_blob_compare(bver,  adb_ro_blob(&pkg, ADBI_PI_VERSION))) continue;
 				if (fi.size != adb_ro_int(&pkg, ADBI_PI_FILE_SIZE)) continue;
 
-				val = adb_wa_append(&ctx->pkgs, adb_w_copy(&ctx->db, &odb, adb_ro_val(&opkgs, i)));
-				if (ADB_IS_ERROR(val))
-					errors++;
-
-				found = TRUE;
+				f->reuse = j;
 				break;
 			}
 		}
-		if (!found) {
-		do_file:
-			apk_sign_ctx_init(&ctx->sctx, APK_SIGN_VERIFY, NULL, trust);
-			r = apk_tar_parse(
-				apk_istream_gunzip_mpart(apk_istream_from_file(AT_FDCWD, *parg), apk_sign_ctx_mpart_cb, &ctx->sctx),
-				mkndx_parse_v2_tar, ctx, idc);
-			apk_sign_ctx_free(&ctx->sctx);
-			if (r < 0 && r != -ECANCELED) goto err_pkg;
-			newpkgs++;
+	}
+
+	scan = (struct mkndx_scan) {
+		.files = files,
+		.num = args->num,
+		.trust = trust,
+		.root_fd = ac->root_fd,
+	};
+	pthread_mutex_init(&scan.mutex, NULL);
+	mkndx_scan(&scan, ctx->jobs, idc);
+	pthread_mutex_destroy(&scan.mutex);
+
+	for (i = 0; i < args->num; i++) {
+		f = &files[i];
+		if (f->reuse) {
+			val = adb_wa_append(&ctx->pkgs, adb_w_copy(&ctx->db, &odb, adb_ro_val(&opkgs, f->reuse)));
+			if (ADB_IS_ERROR(val))
+				errors++;
+			continue;
+		}
+		if (f->r == 0 && !APK_BLOB_IS_NULL(f->pkginfo)) {
+			val = adb_wa_append(
+				&ctx->pkgs,
+				mkndx_read_v2_pkginfo(
+					&ctx->db, f->pkginfo, f->size,
+					ctx->rewrite_arch));
+			if (ADB_IS_ERROR(val)) f->r = -ADB_VAL_VALUE(val);
 		}
+		if (f->r < 0) {
+			apk_err(out, "%s: %s", f->name, apk_error_str(f->r));
+			errors++;
+			continue;
+		}
+		newpkgs++;
 	}
+	for (i = 0; i < args->num; i++)
+		free(files[i].pkginfo.ptr);
+	free(files);
+
 	if (errors) {
 		apk_err(out, "%d errors, not creating index", errors);
 		return -1;
 	}
 
+write:
 	numpkgs = adb_ra_num(&ctx->pkgs);
 	adb_wo_blob(&ndx, ADBI_NDX_DESCRIPTION, APK_BLOB_STR(ctx->description));
 	adb_wo_obj(&ndx, ADBI_NDX_PACKAGES, &ctx->pkgs);
 	adb_w_rootobj(&ndx);
+	adb_ro_obj(adb_r_rootobj(&ctx->db, &root, &schema_index), ADBI_NDX_PACKAGES, &pkgs);
 
-	r = adb_c_create(
-		apk_ostream_to_file(AT_FDCWD, ctx->output, 0644),
-		&ctx->db, trust);
+	os = apk_ostream_to_file(AT_FDCWD, ctx->output, 0644);
+	if (adb_c_adb(os, &ctx->db, trust) == 0) apk_ndx_c_hash(os, &pkgs);
+	r = IS_ERR(os) ? PTR_ERR(os) : apk_ostream_close(os);
 
 	adb_free(&ctx->db);
 	adb_free(&odb);
 
-	if (r == 0)
+	if (r == 0 && ctx->merge)
+		apk_msg(out, "Index has %d packages merged from %zu indexes", numpkgs, args->num);
+	else if (r == 0)
 		apk_msg(out, "Index has %d packages (of which %d are new)", numpkgs, newpkgs);
 	else
 		apk_err(out, "Index creation failed: %s", apk_error_str(r));
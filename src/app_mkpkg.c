@@ -33,12 +33,16 @@ struct mkpkg_ctx {
 	apk_blob_t info[ADBI_PI_MAX];
 	uint64_t installed_size;
 	struct apk_pathbuilder pb;
+	int compression;
+	unsigned int seekable : 1;
 };
 
 #define MKPKG_OPTIONS(OPT) \
+	OPT(OPT_MKPKG_compression,	APK_OPT_ARG "compression") \
 	OPT(OPT_MKPKG_files,	APK_OPT_ARG APK_OPT_SH("f") "files") \
 	OPT(OPT_MKPKG_info,	APK_OPT_ARG APK_OPT_SH("i") "info") \
 	OPT(OPT_MKPKG_output,	APK_OPT_ARG APK_OPT_SH("o") "output") \
+	OPT(OPT_MKPKG_seekable,	"seekable") \
 
 APK_OPT_APPLET(option_desc, MKPKG_OPTIONS);
 
@@ -50,6 +54,13 @@ static int option_parse_applet(void *ctx, struct apk_ctx *ac, int optch, const c
 	int i;
 
 	switch (optch) {
+	case OPT_MKPKG_compression:
+		ictx->compression = apk_compression_by_name(optarg);
+		if (ictx->compression < 0) {
+			apk_err(out, "unsupported compression: %s", optarg);
+			return -EINVAL;
+		}
+		break;
 	case OPT_MKPKG_info:
 		apk_blob_split(APK_BLOB_STR(optarg), APK_BLOB_STRLIT(":"), &l, &r);
 		i = adb_s_field_by_name_blob(&schema_pkginfo, l);
@@ -65,6 +76,9 @@ static int option_parse_applet(void *ctx, struct apk_ctx *ac, int optch, const c
 	case OPT_MKPKG_output:
 		ictx->output = optarg;
 		break;
+	case OPT_MKPKG_seekable:
+		ictx->seekable = 1;
+		break;
 	default:
 		return -ENOTSUP;
 	}
@@ -169,6 +183,163 @@ static char *pkgi_filename(struct adb_obj *pkgi, char *buf, size_t n)
 	return buf;
 }
 
+static int mkpkg_has_data(struct adb_obj *file)
+{
+	return APK_BLOB_IS_NULL(adb_ro_blob(file, ADBI_FI_TARGET)) &&
+		adb_ro_int(file, ADBI_FI_SIZE) != 0;
+}
+
+static int mkpkg_write_block(struct mkpkg_ctx *ctx, struct apk_ostream *os, int files_fd,
+			     unsigned int path_idx, unsigned int file_idx, struct adb_obj *file)
+{
+	struct adb_data_package hdr = {
+		.path_idx = path_idx,
+		.file_idx = file_idx,
+	};
+	int r;
+
+	apk_pathbuilder_pushb(&ctx->pb, adb_ro_blob(file, ADBI_FI_NAME));
+	r = adb_c_block_data(
+		os, APK_BLOB_STRUCT(hdr), adb_ro_int(file, ADBI_FI_SIZE),
+		apk_istream_from_fd(openat(files_fd,
+			apk_pathbuilder_cstr(&ctx->pb),
+			O_RDONLY)));
+	apk_pathbuilder_pop(&ctx->pb);
+	return r;
+}
+
+static int mkpkg_copy_range(struct apk_ostream *os, int fd, off_t offs, off_t size)
+{
+	struct apk_istream *is;
+	ssize_t r;
+
+	if (lseek(fd, offs, SEEK_SET) < 0) return apk_ostream_cancel(os, -errno);
+	is = apk_istream_from_fd(dup(fd));
+	if (IS_ERR(is)) return apk_ostream_cancel(os, PTR_ERR(is));
+	r = apk_stream_copy(is, os, size, 0, 0, 0);
+	apk_istream_close(is);
+	if (r != size) return apk_ostream_cancel(os, r < 0 ? r : -EIO);
+	return 0;
+}
+
+/* Rebuild the package with the data block offsets. The arrays are
+ * already sorted, so the path and file indexes do not change. */
+static void mkpkg_seekable_adb(struct adb *ndb, struct adb_obj *pkg, const uint32_t *offs, uint32_t data_size)
+{
+	struct adb *db = pkg->db;
+	struct adb_obj npkg, npaths, ndir, nfiles, nfile;
+	struct adb_obj paths, path, files, file;
+	int i, j, k;
+
+	/* The offsets add a few bytes per file */
+	adb_w_init_dynamic(ndb, ADB_SCHEMA_PACKAGE, db->num_entries, db->adb.len + db->adb.len / 4);
+	adb_wo_alloca(&npkg, &schema_package, ndb);
+	adb_wo_alloca(&npaths, &schema_dir_array, ndb);
+	adb_wo_alloca(&ndir, &schema_dir, ndb);
+	adb_wo_alloca(&nfiles, &schema_file_array, ndb);
+	adb_wo_alloca(&nfile, &schema_file, ndb);
+
+	adb_ro_obj(pkg, ADBI_PKG_PATHS, &paths);
+	for (i = ADBI_FIRST; i <= adb_ra_num(&paths); i++) {
+		adb_ro_obj(&paths, i, &path);
+		adb_ro_obj(&path, ADBI_DI_FILES, &files);
+		for (j = ADBI_FIRST; j <= adb_ra_num(&files); j++) {
+			adb_ro_obj(&files, j, &file);
+			for (k = ADBI_FIRST; k < ADBI_FI_MAX; k++)
+				adb_wo_val(&nfile, k, adb_w_copy(ndb, db, adb_ro_val(&file, k)));
+			if (mkpkg_has_data(&file))
+				adb_wo_int(&nfile, ADBI_FI_DATA_OFFSET, *offs++);
+			adb_wa_append_obj(&nfiles, &nfile);
+		}
+		adb_wo_val(&ndir, ADBI_DI_NAME, adb_w_copy(ndb, db, adb_ro_val(&path, ADBI_DI_NAME)));
+		adb_wo_val(&ndir, ADBI_DI_ACL, adb_w_copy(ndb, db, adb_ro_val(&path, ADBI_DI_ACL)));
+		adb_wo_obj(&ndir, ADBI_DI_FILES, &nfiles);
+		adb_wa_append_obj(&npaths, &ndir);
+	}
+
+	for (k = ADBI_FIRST; k < ADBI_PKG_MAX; k++)
+		if (k != ADBI_PKG_PATHS)
+			adb_wo_val(&npkg, k, adb_w_copy(ndb, db, adb_ro_val(pkg, k)));
+	adb_wo_obj(&npkg, ADBI_PKG_PATHS, &npaths);
+	adb_wo_int(&npkg, ADBI_PKG_DATA_SIZE, data_size);
+	adb_w_rootobj(&npkg);
+}
+
+/* Seekable packages compress each data block as a separate gzip member
+ * or zstd frame, so a reader can start decompressing at any block. The
+ * blocks are first compressed to a temporary file to learn their
+ * offsets, which are recorded in the signed ADB header. */
+static int mkpkg_write_seekable(struct mkpkg_ctx *ctx, struct adb_obj *pkg, struct apk_trust *trust)
+{
+	struct adb_obj paths, path, files, file;
+	struct apk_ostream *os;
+	struct adb ndb = {};
+	uint32_t *offs = NULL;
+	off_t pos = 0, end;
+	size_t n = 0;
+	int i, j, r = -ENOMEM, files_fd = -1;
+	FILE *tmp;
+
+	tmp = tmpfile();
+	if (!tmp) return -errno;
+
+	adb_ro_obj(pkg, ADBI_PKG_PATHS, &paths);
+	for (i = ADBI_FIRST; i <= adb_ra_num(&paths); i++)
+		n += adb_ra_num(adb_ro_obj(adb_ro_obj(&paths, i, &path), ADBI_DI_FILES, &files));
+	offs = malloc(sizeof(uint32_t[n ?: 1]));
+	if (!offs) goto err;
+
+	n = 0;
+	files_fd = openat(AT_FDCWD, ctx->files_dir, O_RDONLY);
+	for (i = ADBI_FIRST; i <= adb_ra_num(&paths); i++) {
+		adb_ro_obj(&paths, i, &path);
+		adb_ro_obj(&path, ADBI_DI_FILES, &files);
+
+		apk_pathbuilder_setb(&ctx->pb, adb_ro_blob(&path, ADBI_DI_NAME));
+		for (j = ADBI_FIRST; j <= adb_ra_num(&files); j++) {
+			adb_ro_obj(&files, j, &file);
+			if (!mkpkg_has_data(&file)) continue;
+			if (pos > UINT32_MAX) {
+				r = -EFBIG;
+				goto err;
+			}
+			offs[n++] = pos;
+			os = apk_ostream_compress(apk_ostream_to_fd(dup(fileno(tmp))), ctx->compression, 0);
+			mkpkg_write_block(ctx, os, files_fd, i, j, &file);
+			r = apk_ostream_close(os);
+			if (r) goto err;
+			pos = lseek(fileno(tmp), 0, SEEK_CUR);
+		}
+	}
+	if (pos > UINT32_MAX) {
+		r = -EFBIG;
+		goto err;
+	}
+
+	// header goes after the data in the temporary file
+	mkpkg_seekable_adb(&ndb, pkg, offs, pos);
+	os = apk_ostream_compress(apk_ostream_to_fd(dup(fileno(tmp))), ctx->compression, 0);
+	adb_c_adb(os, &ndb, trust);
+	r = apk_ostream_close(os);
+	if (r) goto err;
+	end = lseek(fileno(tmp), 0, SEEK_CUR);
+
+	os = apk_ostream_to_file(AT_FDCWD, ctx->output, 0644);
+	if (IS_ERR(os)) {
+		r = PTR_ERR(os);
+		goto err;
+	}
+	mkpkg_copy_range(os, fileno(tmp), pos, end - pos);
+	mkpkg_copy_range(os, fileno(tmp), 0, pos);
+	r = apk_ostream_close(os);
+err:
+	if (files_fd >= 0) close(files_fd);
+	adb_free(&ndb);
+	free(offs);
+	fclose(tmp);
+	return r;
+}
+
 static int mkpkg_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
 	struct apk_out *out = &ac->out;
@@ -180,7 +351,7 @@ static int mkpkg_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *a
 	char outbuf[PATH_MAX];
 
 	ctx->ac = ac;
-	adb_w_init_alloca(&ctx->db, ADB_SCHEMA_PACKAGE, 40);
+	adb_w_init_dynamic(&ctx->db, ADB_SCHEMA_PACKAGE, 40, 0);
 	adb_wo_alloca(&pkg, &schema_package, &ctx->db);
 	adb_wo_alloca(&pkgi, &schema_pkginfo, &ctx->db);
 	adb_wo_alloca(&ctx->paths, &schema_dir_array, &ctx->db);
@@ -234,34 +405,23 @@ static int mkpkg_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *a
 
 	// construct package with ADB as header, and the file data in
 	// concatenated data blocks
-	os = apk_ostream_gzip(apk_ostream_to_file(AT_FDCWD, ctx->output, 0644));
+	if (ctx->seekable) {
+		r = mkpkg_write_seekable(ctx, &pkg, trust);
+		goto err;
+	}
+	os = apk_ostream_compress(apk_ostream_to_file(AT_FDCWD, ctx->output, 0644), ctx->compression, 0);
 	adb_c_adb(os, &ctx->db, trust);
 	int files_fd = openat(AT_FDCWD, ctx->files_dir, O_RDONLY);
 	for (i = ADBI_FIRST; i <= adb_ra_num(&ctx->paths); i++) {
 		struct adb_obj path, files, file;
 		adb_ro_obj(&ctx->paths, i, &path);
 		adb_ro_obj(&path, ADBI_DI_FILES, &files);
-		apk_blob_t dirname = adb_ro_blob(&path, ADBI_DI_NAME);
 
-		apk_pathbuilder_setb(&ctx->pb, dirname);
+		apk_pathbuilder_setb(&ctx->pb, adb_ro_blob(&path, ADBI_DI_NAME));
 		for (j = ADBI_FIRST; j <= adb_ra_num(&files); j++) {
 			adb_ro_obj(&files, j, &file);
-			apk_blob_t filename = adb_ro_blob(&file, ADBI_FI_NAME);
-			apk_blob_t target = adb_ro_blob(&file, ADBI_FI_TARGET);
-			size_t sz = adb_ro_int(&file, ADBI_FI_SIZE);
-			if (!APK_BLOB_IS_NULL(target)) continue;
-			if (!sz) continue;
-			struct adb_data_package hdr = {
-				.path_idx = i,
-				.file_idx = j,
-			};
-			apk_pathbuilder_pushb(&ctx->pb, filename);
-			adb_c_block_data(
-				os, APK_BLOB_STRUCT(hdr), sz,
-				apk_istream_from_fd(openat(files_fd,
-					apk_pathbuilder_cstr(&ctx->pb),
-					O_RDONLY)));
-			apk_pathbuilder_pop(&ctx->pb);
+			if (!mkpkg_has_data(&file)) continue;
+			mkpkg_write_block(ctx, os, files_fd, i, j, &file);
 		}
 	}
 	close(files_fd);
@@ -7,11 +7,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "apk_defines.h"
 #include "apk_applet.h"
 #include "apk_database.h"
 #include "apk_version.h"
 #include "apk_print.h"
+#include "apk_adb.h"
+#include "apk_query.h"
 
 extern const char * const apk_installed_file;
 
@@ -61,8 +64,47 @@ zlib1g policy:
 	}
 }
 
+static int query_version_cmp(const void *p1, const void *p2)
+{
+	const struct apk_query_pkg *qp1 = p1, *qp2 = p2;
+	return adb_ro_cmp(&qp2->obj, &qp1->obj, ADBI_PI_VERSION);
+}
+
+static void query_print_policy(struct apk_query *q, const char *match, apk_blob_t name,
+			       struct apk_query_pkg *pkgs, size_t num, void *ctx)
+{
+	struct apk_out *out = &q->ac->out;
+	struct apk_query_pkg *qp, *prev = NULL;
+
+	if (APK_BLOB_IS_NULL(name)) return;
+
+	/* Indexes have no tags, and the same version from several
+	 * indexes is listed once with each of them */
+	qsort(pkgs, num, sizeof *pkgs, query_version_cmp);
+	for (qp = pkgs; qp < &pkgs[num]; qp++) {
+		if (apk_blob_compare(adb_ro_blob(&qp->obj, ADBI_PI_NAME), name) != 0)
+			continue;
+		if (prev == NULL)
+			apk_out(out, BLOB_FMT " policy:", BLOB_PRINTF(name));
+		if (prev == NULL || query_version_cmp(prev, qp) != 0)
+			apk_out(out, "  " BLOB_FMT ":", BLOB_PRINTF(adb_ro_blob(&qp->obj, ADBI_PI_VERSION)));
+		apk_out(out, "    %s", qp->ndx->url);
+		prev = qp;
+	}
+}
+
 static int policy_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
+	struct apk_query q;
+	int r;
+
+	if (apk_query_enabled(ac)) {
+		r = apk_query_open(&q, ac);
+		if (r) return r;
+		apk_query_foreach_matching(&q, args, 0, query_print_policy, NULL);
+		apk_query_close(&q);
+		return 0;
+	}
 	apk_name_foreach_matching(ac->db, args, apk_foreach_genid(), print_policy, NULL);
 	return 0;
 }
@@ -70,6 +112,7 @@ static int policy_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *a
 static struct apk_applet apk_policy = {
 	.name = "policy",
 	.open_flags = APK_OPENF_READ,
+	.optgroups = { &optgroup_global, &optgroup_query },
 	.main = policy_main,
 };
 
@@ -13,6 +13,8 @@
 #include "apk_applet.h"
 #include "apk_package.h"
 #include "apk_database.h"
+#include "apk_adb.h"
+#include "apk_query.h"
 
 struct search_ctx {
 	void (*print_result)(struct search_ctx *ctx, struct apk_package *pkg);
@@ -172,13 +174,92 @@ static int print_pkg(apk_hash_item item, void *pctx)
 	return 0;
 }
 
+static void query_print_package(struct search_ctx *ctx, struct adb_obj *pkg)
+{
+	apk_blob_t name = adb_ro_blob(pkg, ADBI_PI_NAME);
+	apk_blob_t origin = adb_ro_blob(pkg, ADBI_PI_ORIGIN);
+
+	if (ctx->print_package == print_origin_name) {
+		printf(BLOB_FMT, BLOB_PRINTF(origin.len ? origin : name));
+		if (ctx->verbosity > 0)
+			printf("-" BLOB_FMT, BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)));
+	} else {
+		printf(BLOB_FMT, BLOB_PRINTF(name));
+		if (ctx->verbosity > 0)
+			printf("-" BLOB_FMT, BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)));
+		if (ctx->verbosity > 1)
+			printf(" - " BLOB_FMT, BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_DESCRIPTION)));
+	}
+	printf("\n");
+}
+
+static void query_print_rdep(struct apk_query *q, struct apk_query_pkg *qp, void *pctx)
+{
+	query_print_package(pctx, &qp->obj);
+}
+
+static void query_print_result_pkg(struct apk_query *q, struct search_ctx *ctx, struct adb_obj *pkg)
+{
+	apk_blob_t name = adb_ro_blob(pkg, ADBI_PI_NAME), b;
+	char **pmatch;
+
+	if (ctx->search_description) {
+		b = adb_ro_blob(pkg, ADBI_PI_DESCRIPTION);
+		foreach_array_item(pmatch, ctx->filter) {
+			if (memmem(b.ptr, b.len, *pmatch, strlen(*pmatch)) != NULL ||
+			    memmem(name.ptr, name.len, *pmatch, strlen(*pmatch)) != NULL)
+				goto match;
+		}
+		return;
+	}
+	if (ctx->search_origin) {
+		b = adb_ro_blob(pkg, ADBI_PI_ORIGIN);
+		foreach_array_item(pmatch, ctx->filter) {
+			if (b.len && apk_blob_compare(APK_BLOB_STR(*pmatch), b) == 0)
+				goto match;
+		}
+		return;
+	}
+match:
+	if (ctx->print_result != print_rdepends) {
+		query_print_package(ctx, pkg);
+		return;
+	}
+	if (ctx->verbosity > 0)
+		printf(BLOB_FMT "-" BLOB_FMT " is required by:\n",
+			BLOB_PRINTF(name), BLOB_PRINTF(adb_ro_blob(pkg, ADBI_PI_VERSION)));
+	apk_query_foreach_rdepend(q, name, query_print_rdep, ctx);
+}
+
+static void query_print_result(struct apk_query *q, const char *match, apk_blob_t name,
+			       struct apk_query_pkg *pkgs, size_t num, void *pctx)
+{
+	struct search_ctx *ctx = pctx;
+	struct apk_query_pkg *qp, *best = NULL;
+
+	if (ctx->show_all) {
+		for (qp = pkgs; qp < &pkgs[num]; qp++)
+			query_print_result_pkg(q, ctx, &qp->obj);
+		return;
+	}
+	for (qp = pkgs; qp < &pkgs[num]; qp++) {
+		if (best == NULL ||
+		    adb_ro_cmp(&qp->obj, &best->obj, ADBI_PI_VERSION) > 0)
+			best = qp;
+	}
+	if (best)
+		query_print_result_pkg(q, ctx, &best->obj);
+}
+
 static int search_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *args)
 {
 	struct apk_database *db = ac->db;
 	struct search_ctx *ctx = (struct search_ctx *) pctx;
+	struct apk_query q;
 	char *tmp, **pmatch;
+	int r;
 
-	ctx->verbosity = apk_out_verbosity(&db->ctx->out);
+	ctx->verbosity = apk_out_verbosity(&ac->out);
 	ctx->filter = args;
 	ctx->matches = apk_foreach_genid() | APK_DEP_SATISFIES;
 	if (ctx->print_package == NULL)
@@ -186,6 +267,23 @@ static int search_main(void *pctx, struct apk_ctx *ac, struct apk_string_array *
 	if (ctx->print_result == NULL)
 		ctx->print_result = ctx->print_package;
 
+	if (apk_query_enabled(ac)) {
+		r = apk_query_open(&q, ac);
+		if (r) return r;
+		if (!ctx->search_exact) {
+			foreach_array_item(pmatch, ctx->filter) {
+				tmp = alloca(strlen(*pmatch) + 3);
+				sprintf(tmp, "*%s*", *pmatch);
+				*pmatch = tmp;
+			}
+		}
+		apk_query_foreach_matching(
+			&q, (ctx->search_description || ctx->search_origin) ? NULL : args,
+			APK_FOREACH_NULL_MATCHES_ALL, query_print_result, ctx);
+		apk_query_close(&q);
+		return 0;
+	}
+
 	if (ctx->search_description || ctx->search_origin)
 		return apk_hash_foreach(&db->available.packages, print_pkg, ctx);
 
@@ -206,7 +304,7 @@ static struct apk_applet apk_search = {
 	.name = "search",
 	.open_flags = APK_OPENF_READ | APK_OPENF_NO_STATE,
 	.context_size = sizeof(struct search_ctx),
-	.optgroups = { &optgroup_global, &optgroup_applet },
+	.optgroups = { &optgroup_global, &optgroup_applet, &optgroup_query },
 	.main = search_main,
 };
 
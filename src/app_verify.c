@@ -29,7 +29,7 @@ static int verify_main(void *ctx, struct apk_ctx *ac, struct apk_string_array *a
 	foreach_array_item(parg, args) {
 		apk_sign_ctx_init(&sctx, APK_SIGN_VERIFY, NULL, trust);
 		r = apk_tar_parse(
-			apk_istream_gunzip_mpart(apk_istream_from_file(AT_FDCWD, *parg),
+			apk_istream_decompress_mpart(apk_istream_from_file(AT_FDCWD, *parg),
 						 apk_sign_ctx_mpart_cb, &sctx),
 			apk_sign_ctx_verify_tar, &sctx, idc);
 		ok = sctx.control_verified && sctx.data_verified;
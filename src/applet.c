@@ -6,6 +6,7 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <stdlib.h>
 #include <zlib.h>
 #include "apk_applet.h"
 #include "apk_print.h"
@@ -41,6 +42,22 @@ struct apk_applet *apk_applet_find(const char *name)
 	return NULL;
 }
 
+int apk_opt_count(struct apk_out *out, const char *opt, const char *arg,
+		  unsigned int min, unsigned int max, unsigned int *val)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(arg, &end, 10);
+	if (arg[0] < '0' || arg[0] > '9' || *end || (errno && errno != ERANGE) || v < min) {
+		apk_err(out, "%s: invalid count: %s", opt, arg);
+		return -EINVAL;
+	}
+	*val = v > max ? max : v;
+	return 0;
+}
+
 static inline int is_group(struct apk_applet *applet, const char *topic)
 {
 	if (!applet) return strcasecmp(topic, "apk") == 0;
@@ -147,6 +147,62 @@ int apk_blob_cspn(apk_blob_t blob, const apk_spn_match reject, apk_blob_t *l, ap
 }
 #endif
 
+/* Newline scanning compares a vector of bytes at once and turns the
+ * result into a bit mask with SCAN_BITS bits per input byte. */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH	32
+#define SCAN_BITS	1
+static inline uint64_t scan_newlines(const char *p)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *) p);
+	return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH	16
+#define SCAN_BITS	1
+static inline uint64_t scan_newlines(const char *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+	return (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_WIDTH	16
+#define SCAN_BITS	4
+static inline uint64_t scan_newlines(const char *p)
+{
+	uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *) p), vdupq_n_u8('\n'));
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+#endif
+
+int apk_blob_split_lines(apk_blob_t blob, apk_blob_t *lines, int max, apk_blob_t *left)
+{
+	char *ptr = blob.ptr, *start = blob.ptr, *end = blob.ptr + blob.len, *nl;
+	int n = 0;
+
+#ifdef SCAN_WIDTH
+	for (; n < max && end - ptr >= SCAN_WIDTH; ptr += SCAN_WIDTH) {
+		uint64_t m = scan_newlines(ptr);
+		while (m) {
+			int bit = __builtin_ctzll(m) & ~(SCAN_BITS - 1);
+			nl = ptr + bit / SCAN_BITS;
+			lines[n++] = APK_BLOB_PTR_LEN(start, nl - start);
+			start = nl + 1;
+			if (n >= max) goto done;
+			m &= ~((((uint64_t) 1 << SCAN_BITS) - 1) << bit);
+		}
+	}
+#endif
+	for (; n < max && start < end && (nl = memchr(start, '\n', end - start)) != NULL; start = nl + 1)
+		lines[n++] = APK_BLOB_PTR_LEN(start, nl - start);
+done:
+	*left = APK_BLOB_PTR_LEN(start, end - start);
+	return n;
+}
+
 int apk_blob_rsplit(apk_blob_t blob, char split, apk_blob_t *l, apk_blob_t *r)
 {
 	char *sep;
@@ -7,10 +7,13 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <limits.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include "apk_defines.h"
 #include "apk_database.h"
 #include "apk_package.h"
@@ -196,14 +199,145 @@ static int cmp_upgrade(struct apk_change *change)
 	return 0;
 }
 
+struct trigger_job {
+	struct apk_installed_package *ipkg;
+	FILE *output, *errors;
+	pid_t pid;
+	int status;
+};
+
+struct trigger_queue {
+	struct apk_database *db;
+	struct trigger_job *jobs;
+	unsigned int num, running, reported;
+};
+
+static int ipkg_serial_triggers(struct apk_installed_package *ipkg)
+{
+	char **trigger;
+
+	/* Packages list "serial" among their triggers to opt out of
+	 * running concurrently with other trigger scripts. */
+	foreach_array_item(trigger, ipkg->triggers)
+		if (strcmp(*trigger, "serial") == 0)
+			return TRUE;
+	return FALSE;
+}
+
+static void trigger_queue_report(struct trigger_queue *q)
+{
+	struct trigger_job *job;
+
+	/* Report finished scripts in the order they were started */
+	for (; q->reported < q->num; q->reported++) {
+		job = &q->jobs[q->reported];
+		if (job->pid > 0) break;
+		if (job->pid == 0)
+			apk_ipkg_reap_script(job->ipkg, q->db, APK_SCRIPT_TRIGGER, job->status,
+					     job->output ? fileno(job->output) : -1,
+					     job->errors ? fileno(job->errors) : -1);
+		if (job->output) fclose(job->output);
+		if (job->errors) fclose(job->errors);
+		apk_string_array_free(&job->ipkg->pending_triggers);
+	}
+}
+
+static struct trigger_job *trigger_queue_find(struct trigger_queue *q, pid_t pid)
+{
+	struct trigger_job *job;
+
+	for (job = &q->jobs[q->reported]; job < &q->jobs[q->num]; job++)
+		if (job->pid > 0 && (pid == 0 || job->pid == pid)) return job;
+	return NULL;
+}
+
+static int trigger_job_reap(struct trigger_queue *q, struct trigger_job *job, int flags)
+{
+	int status;
+	pid_t pid;
+
+	do pid = waitpid(job->pid, &status, flags);
+	while (pid < 0 && errno == EINTR);
+	if (pid == 0) return 0;
+
+	/* A child that can no longer be waited for counts as failed */
+	job->status = pid > 0 ? status : 127 << 8;
+	job->pid = 0;
+	q->running--;
+	return 1;
+}
+
+static void trigger_queue_wait(struct trigger_queue *q)
+{
+	struct trigger_job *job;
+	siginfo_t info;
+	int reaped, r;
+
+	/* Only our own scripts are reaped, so children started elsewhere
+	 * in the process are left for their owners to wait for. */
+	for (;;) {
+		reaped = 0;
+		for (job = &q->jobs[q->reported]; job < &q->jobs[q->num]; job++)
+			if (job->pid > 0) reaped += trigger_job_reap(q, job, WNOHANG);
+		if (reaped || !q->running) break;
+
+		/* Sleep until any child exits, without reaping it */
+		info.si_pid = 0;
+		r = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+		if (r == 0 && info.si_pid > 0 && trigger_queue_find(q, info.si_pid)) continue;
+		if (r < 0 && errno == EINTR) continue;
+
+		/* Someone else's child is pending, so block on the oldest script */
+		trigger_job_reap(q, trigger_queue_find(q, 0), 0);
+		break;
+	}
+	trigger_queue_report(q);
+}
+
+static void trigger_queue_drain(struct trigger_queue *q)
+{
+	while (q->running) trigger_queue_wait(q);
+	trigger_queue_report(q);
+}
+
+static void trigger_queue_add(struct trigger_queue *q, struct apk_installed_package *ipkg)
+{
+	struct trigger_job *job;
+
+	while (q->running >= q->db->ctx->trigger_jobs)
+		trigger_queue_wait(q);
+
+	job = &q->jobs[q->num++];
+	*job = (struct trigger_job) { .ipkg = ipkg };
+
+	/* Capture output so it can be printed in a stable order */
+	job->output = tmpfile();
+	if (job->output) fcntl(fileno(job->output), F_SETFD, FD_CLOEXEC);
+	job->errors = tmpfile();
+	if (job->errors) fcntl(fileno(job->errors), F_SETFD, FD_CLOEXEC);
+
+	fflush(stdout);
+	job->pid = apk_ipkg_spawn_script(ipkg, q->db, APK_SCRIPT_TRIGGER,
+					 ipkg->pending_triggers->item,
+					 job->output ? fileno(job->output) : -1,
+					 job->errors ? fileno(job->errors) : -1);
+	if (job->pid > 0) q->running++;
+	else job->pid = -1;
+	trigger_queue_report(q);
+}
+
 static void run_triggers(struct apk_database *db, struct apk_changeset *changeset)
 {
+	struct trigger_queue q = { .db = db };
 	struct apk_change *change;
 	struct apk_installed_package *ipkg;
 
 	if (apk_db_fire_triggers(db) == 0)
 		return;
 
+	if (db->ctx->trigger_jobs > 1)
+		q.jobs = calloc(changeset->changes->num, sizeof *q.jobs);
+
 	foreach_array_item(change, changeset->changes) {
 		struct apk_package *pkg = change->new_pkg;
 		if (pkg == NULL)
@@ -213,10 +347,17 @@ static void run_triggers(struct apk_database *db, struct apk_changeset *changese
 			continue;
 
 		*apk_string_array_add(&ipkg->pending_triggers) = NULL;
+		if (q.jobs && !ipkg_serial_triggers(ipkg)) {
+			trigger_queue_add(&q, ipkg);
+			continue;
+		}
+		trigger_queue_drain(&q);
 		apk_ipkg_run_script(ipkg, db, APK_SCRIPT_TRIGGER,
 				    ipkg->pending_triggers->item);
 		apk_string_array_free(&ipkg->pending_triggers);
 	}
+	trigger_queue_drain(&q);
+	free(q.jobs);
 }
 
 #define PRE_COMMIT_HOOK		0
@@ -245,7 +386,7 @@ static int run_commit_hook(void *ctx, int dirfd, const char *file)
 	}
 	apk_dbg(out, "Executing: %s %s", fn, commit_hook_str[hook->type]);
 
-	if (apk_db_run_script(db, fn, argv) < 0 && hook->type == PRE_COMMIT_HOOK)
+	if (apk_db_run_script(db, -1, fn, argv) < 0 && hook->type == PRE_COMMIT_HOOK)
 		return -2;
 
 	return 0;
@@ -349,9 +490,15 @@ int apk_solver_commit_changeset(struct apk_database *db,
 	apk_db_update_directory_permissions(db);
 	run_triggers(db, changeset);
 
+	/* Make installed files durable before the database refers to them */
+	if ((r = apk_db_syncfs(db)) < 0)
+		apk_warn(out, "Failed to sync filesystems: %s", apk_error_str(r));
+
 all_done:
 	apk_dependency_array_copy(&db->world, world);
 	apk_db_write_config(db);
+	if ((r = apk_db_syncfs(db)) < 0)
+		apk_warn(out, "Failed to sync database: %s", apk_error_str(r));
 	run_commit_hooks(db, POST_COMMIT_HOOK);
 
 	if (!db->performing_self_upgrade) {
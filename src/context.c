@@ -17,6 +17,7 @@ void apk_ctx_init(struct apk_ctx *ac)
 	memset(ac, 0, sizeof *ac);
 	apk_string_array_init(&ac->repository_list);
 	apk_string_array_init(&ac->private_keys);
+	apk_string_array_init(&ac->index_files);
 	apk_out_reset(&ac->out);
 	ac->out.out = stdout;
 	ac->out.err = stderr;
@@ -29,11 +30,14 @@ void apk_ctx_free(struct apk_ctx *ac)
 	apk_trust_free(&ac->trust);
 	apk_string_array_free(&ac->repository_list);
 	apk_string_array_free(&ac->private_keys);
+	apk_string_array_free(&ac->index_files);
 	if (ac->out.log) fclose(ac->out.log);
 }
 
 int apk_ctx_prepare(struct apk_ctx *ac)
 {
+	/* Queries answered from index files do not need the database */
+	if (ac->index_files->num) ac->open_flags = 0;
 	if (ac->flags & APK_SIMULATE &&
 	    ac->open_flags & (APK_OPENF_CREATE | APK_OPENF_WRITE)) {
 		ac->open_flags &= ~(APK_OPENF_CREATE | APK_OPENF_WRITE);
@@ -45,6 +49,7 @@ int apk_ctx_prepare(struct apk_ctx *ac)
 	if (!ac->cache_max_age) ac->cache_max_age = 4*60*60; /* 4 hours default */
 	if (!strcmp(ac->root, "/")) ac->flags |= APK_NO_CHROOT; /* skip chroot if root is default */
 	ac->uvol = getenv("APK_UVOL");
+	apk_io_readahead = ac->io_readahead;
 
 	ac->root_fd = openat(AT_FDCWD, ac->root, O_RDONLY | O_CLOEXEC);
 	if (ac->root_fd < 0 && (ac->open_flags & APK_OPENF_CREATE)) {
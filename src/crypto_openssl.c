@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <openssl/bio.h>
 #include <openssl/pem.h>
@@ -144,3 +145,24 @@ int apk_verify(struct apk_digest_ctx *dctx, void *sig, size_t len)
 	}
 	return 0;
 }
+
+#ifdef APK_DIGEST_FETCH
+
+EVP_MD *apk_digest_evp[APK_DIGEST_SHA512 + 1];
+
+static void apk_crypto_cleanup(void)
+{
+	for (int i = 0; i < ARRAY_SIZE(apk_digest_evp); i++) {
+		EVP_MD_free(apk_digest_evp[i]);
+		apk_digest_evp[i] = NULL;
+	}
+}
+
+void apk_crypto_init(void)
+{
+	for (int i = APK_DIGEST_MD5; i < ARRAY_SIZE(apk_digest_evp); i++)
+		apk_digest_evp[i] = EVP_MD_fetch(NULL, apk_digest_str[i], NULL);
+	atexit(apk_crypto_cleanup);
+}
+
+#endif
@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <fnmatch.h>
+#include <pthread.h>
 #include <sys/vfs.h>
 #include <sys/file.h>
 #include <sys/wait.h>
@@ -55,6 +56,7 @@ static const char * const apk_arch_file = "etc/apk/arch";
 static const char * const apk_lock_file = "lib/apk/db/lock";
 static const char * const apk_scripts_file = "lib/apk/db/scripts.tar";
 static const char * const apk_triggers_file = "lib/apk/db/triggers";
+static const char * const apk_mirrors_file = "mirrors";
 const char * const apk_installed_file = "lib/apk/db/installed";
 
 static struct apk_db_acl *apk_default_acl_dir, *apk_default_acl_file;
@@ -621,6 +623,382 @@ int apk_repo_format_item(struct apk_database *db, struct apk_repository *repo, s
 	}
 }
 
+/* Mirrors. A repository line may list several URLs serving the same
+ * repository. They share the repository checksum and thus the cached index,
+ * and packages are verified against the index whichever mirror they come
+ * from. The mirror expected to be fastest is used, and the next one is tried
+ * when it fails. Measurements are kept in the cache directory. */
+
+static unsigned long mirror_cost(const struct apk_repository_mirror *m)
+{
+	/* Expected milliseconds to fetch one MiB. Unmeasured mirrors sort
+	 * first so that they get measured. */
+	if (m->failed) return ULONG_MAX;
+	return m->latency + (m->throughput ? 1024UL * 1000 / m->throughput : 0);
+}
+
+static int cmp_mirror(const void *p1, const void *p2)
+{
+	unsigned long c1 = mirror_cost(p1), c2 = mirror_cost(p2);
+	return (c1 > c2) - (c1 < c2);
+}
+
+static void apk_repo_rank_mirrors(struct apk_repository *repo)
+{
+	qsort(repo->mirrors->item, repo->mirrors->num, sizeof repo->mirrors->item[0], cmp_mirror);
+	repo->url = repo->mirrors->item[0].url;
+}
+
+static struct apk_repository_mirror *apk_repo_mirror(struct apk_repository *repo, apk_blob_t url)
+{
+	struct apk_repository_mirror *m;
+
+	foreach_array_item(m, repo->mirrors)
+		if (apk_blob_compare(url, APK_BLOB_STR(m->url)) == 0) return m;
+	return NULL;
+}
+
+static int load_mirror(void *ctx, apk_blob_t l)
+{
+	struct apk_repository *repo = ctx;
+	struct apk_repository_mirror *m;
+	unsigned int latency, throughput, failed;
+
+	/* <latency> <throughput> <failed> <url> */
+	latency = apk_blob_pull_uint(&l, 10);
+	apk_blob_pull_char(&l, ' ');
+	throughput = apk_blob_pull_uint(&l, 10);
+	apk_blob_pull_char(&l, ' ');
+	failed = apk_blob_pull_uint(&l, 10);
+	apk_blob_pull_char(&l, ' ');
+	if (APK_BLOB_IS_NULL(l)) return 0;
+
+	m = apk_repo_mirror(repo, l);
+	if (m) {
+		m->latency = latency;
+		m->throughput = throughput;
+		m->failed = !!failed;
+	}
+	return 0;
+}
+
+static void apk_db_load_mirrors(struct apk_database *db, struct apk_repository *repo)
+{
+	apk_blob_t blob;
+
+	blob = apk_blob_from_file(db->cache_fd, apk_mirrors_file);
+	if (!APK_BLOB_IS_NULL(blob)) {
+		apk_blob_for_each_segment(blob, "\n", load_mirror, repo);
+		free(blob.ptr);
+	}
+	apk_repo_rank_mirrors(repo);
+}
+
+static void apk_db_save_mirrors(struct apk_database *db)
+{
+	struct apk_ostream *os;
+	struct apk_repository_mirror *m;
+	char buf[PATH_MAX + 64];
+	int i, n;
+
+	os = apk_ostream_to_file(db->cache_fd, apk_mirrors_file, 0644);
+	if (IS_ERR_OR_NULL(os)) return;
+	for (i = APK_REPOSITORY_FIRST_CONFIGURED; i < db->num_repos; i++) {
+		if (!db->repos[i].mirrors) continue;
+		foreach_array_item(m, db->repos[i].mirrors) {
+			n = snprintf(buf, sizeof buf, "%u %u %u %s\n",
+				     m->latency, m->throughput, m->failed, m->url);
+			if (n < sizeof buf) apk_ostream_write(os, buf, n);
+		}
+	}
+	apk_ostream_close(os);
+}
+
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Mirrors that have not answered the probe by then are ranked as failed,
+ * so a mirror that drops connections does not stall every index update. */
+#define APK_MIRROR_PROBE_TIMEOUT_MS	2000
+
+struct apk_mirror_probe;
+
+struct apk_mirror_probe_item {
+	struct apk_mirror_probe *probe;
+	char url[PATH_MAX];
+	int r;
+	unsigned int latency;
+	unsigned int started : 1;
+	unsigned int done : 1;
+};
+
+struct apk_mirror_probe {
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+	unsigned int refs, pending;
+	struct apk_mirror_probe_item item[];
+};
+
+static void apk_mirror_probe_put(struct apk_mirror_probe *p)
+{
+	int last;
+
+	pthread_mutex_lock(&p->mutex);
+	last = --p->refs == 0;
+	pthread_mutex_unlock(&p->mutex);
+	if (!last) return;
+	pthread_cond_destroy(&p->done);
+	pthread_mutex_destroy(&p->mutex);
+	free(p);
+}
+
+static void *apk_mirror_probe_worker(void *arg)
+{
+	struct apk_mirror_probe_item *pi = arg;
+	struct apk_mirror_probe *p = pi->probe;
+	struct apk_istream *is;
+	struct timespec start;
+	unsigned int latency;
+	int r;
+
+	/* A request conditional on the current time is answered with
+	 * "not modified", so only the round trip is measured. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	is = apk_istream_from_url(pi->url, time(NULL));
+	latency = max(elapsed_ms(&start), 1U);
+	r = IS_ERR(is) ? PTR_ERR(is) : 0;
+	if (!IS_ERR_OR_NULL(is)) apk_istream_close(is);
+
+	pthread_mutex_lock(&p->mutex);
+	pi->r = r;
+	pi->latency = latency;
+	pi->done = 1;
+	p->pending--;
+	pthread_cond_signal(&p->done);
+	pthread_mutex_unlock(&p->mutex);
+	apk_mirror_probe_put(p);
+	return NULL;
+}
+
+static void apk_repo_probe_mirrors(struct apk_database *db, struct apk_repository *repo)
+{
+	struct apk_mirror_probe *p;
+	struct apk_mirror_probe_item *pi;
+	struct apk_repository_mirror *m;
+	struct timespec deadline;
+	pthread_condattr_t cattr;
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i, n = repo->mirrors->num;
+
+	p = calloc(1, sizeof *p + n * sizeof p->item[0]);
+	if (!p) return;
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&p->done, &cattr);
+	pthread_condattr_destroy(&cattr);
+	p->refs = 1;
+
+	/* The probes run detached: one still stuck connecting when the
+	 * deadline passes drops its reference to the results on its own. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&p->mutex);
+	for (i = 0; i < n; i++) {
+		pi = &p->item[i];
+		pi->probe = p;
+		repo->url = repo->mirrors->item[i].url;
+		if (apk_repo_format_real_url(db->arch, repo, NULL, pi->url, sizeof pi->url, NULL) < 0)
+			continue;
+		if (pthread_create(&tid, &attr, apk_mirror_probe_worker, pi) != 0)
+			continue;
+		pi->started = 1;
+		p->refs++;
+		p->pending++;
+	}
+	pthread_attr_destroy(&attr);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += APK_MIRROR_PROBE_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (APK_MIRROR_PROBE_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (p->pending)
+		if (pthread_cond_timedwait(&p->done, &p->mutex, &deadline) == ETIMEDOUT)
+			break;
+
+	for (i = 0; i < n; i++) {
+		pi = &p->item[i];
+		m = &repo->mirrors->item[i];
+		if (!pi->started) continue;
+		m->failed = !pi->done || (pi->r < 0 && pi->r != -EALREADY);
+		if (!m->failed) m->latency = pi->latency;
+	}
+	pthread_mutex_unlock(&p->mutex);
+	apk_mirror_probe_put(p);
+
+	apk_repo_rank_mirrors(repo);
+	db->mirrors_changed = 1;
+}
+
+/* Errors that say something about the mirror, as opposed to the local
+ * cache or the system, which another mirror would not fix. */
+static int apk_repo_mirror_error(int r)
+{
+	switch (r) {
+	case -ECONNABORTED:
+	case -ECONNREFUSED:
+	case -ECONNRESET:
+	case -EHOSTUNREACH:
+	case -ENETUNREACH:
+	case -ETIMEDOUT:
+	case -ENXIO:
+	case -EAGAIN:
+	case -EPROTO:
+	case -EREMOTEIO:
+	case -ENOENT:
+	case -EIO:
+	case -EBADMSG:
+	case -EAPKFORMAT:
+		return 1;
+	}
+	return 0;
+}
+
+static int apk_repo_failover(struct apk_database *db, struct apk_repository *repo, int r)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_repository_mirror *m;
+	struct apk_url_print urlp;
+
+	if (!repo->mirrors || !apk_repo_mirror_error(r)) return 0;
+
+	m = apk_repo_mirror(repo, APK_BLOB_STR(repo->url));
+	if (m) m->failed = 1;
+	apk_repo_rank_mirrors(repo);
+	db->mirrors_changed = 1;
+	if (repo->mirrors->item[0].failed) return 0;
+
+	apk_url_parse(&urlp, repo->url);
+	apk_warn(out, "Switching to mirror " URL_FMT, URL_PRINTF(urlp));
+	return 1;
+}
+
+static void apk_repo_mirror_throughput(struct apk_database *db, struct apk_repository *repo,
+				       const struct apk_transfer_stats *xfer)
+{
+	struct apk_repository_mirror *m;
+
+	/* Small transfers measure mostly latency */
+	if (!repo->mirrors || xfer->bytes < 256*1024 || xfer->usec < 1000) return;
+	m = apk_repo_mirror(repo, APK_BLOB_STR(repo->url));
+	if (!m) return;
+	m->throughput = max(xfer->bytes * 1000000 / 1024 / xfer->usec, (uint64_t) 1);
+	db->mirrors_changed = 1;
+}
+
+#define APK_FETCH_RANGES_MIN	(8*1024*1024)
+
+static struct apk_istream *apk_db_fetch_cache_ranges(struct apk_database *db, const char *url,
+						   time_t since, const char *tmpcacheitem, off_t offset,
+						   time_t validator, off_t size, unsigned int tee_flags,
+						   apk_progress_cb cb, void *cb_ctx,
+						   struct apk_transfer_stats *xfer)
+{
+	struct apk_file_meta meta;
+	struct timespec start;
+	int fd, r;
+
+	fd = openat(db->cache_fd, tmpcacheitem, O_RDWR | O_CREAT | O_CLOEXEC | (offset ? 0 : O_TRUNC), 0644);
+	if (fd < 0) return ERR_PTR(-errno);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = apk_url_fetch_ranges(url, fd, offset, size, db->ctx->fetch_connections,
+				 since, validator, &meta, cb, cb_ctx);
+	if (r == 0 && xfer) {
+		xfer->bytes += size - offset;
+		xfer->usec += elapsed_ms(&start) * 1000ULL;
+	}
+	if (r == 0 && (tee_flags & APK_ISTREAM_TEE_COPY_META))
+		apk_file_meta_to_fd(fd, &meta);
+	/* The ranges complete out of order, so on failure only the part
+	 * that existed before is known to be contiguous. Its mtime is the
+	 * validator for resuming it, so put that back too. */
+	if (r < 0 && offset) {
+		meta = (struct apk_file_meta) { .atime = validator, .mtime = validator };
+		if (ftruncate(fd, offset) < 0) offset = 0;
+		else apk_file_meta_to_fd(fd, &meta);
+	}
+	close(fd);
+	if (r < 0) {
+		if (!offset) unlinkat(db->cache_fd, tmpcacheitem, 0);
+		return ERR_PTR(r);
+	}
+	return apk_istream_from_file(db->cache_fd, tmpcacheitem);
+}
+
+static struct apk_istream *apk_db_fetch_cache_item(struct apk_database *db, int atfd, const char *url,
+						 time_t since, const char *tmpcacheitem, off_t size, off_t *resumed,
+						 unsigned int tee_flags, apk_progress_cb cb, void *cb_ctx,
+						 struct apk_transfer_stats *xfer)
+{
+	struct apk_istream *is;
+	struct stat st;
+	off_t offset = 0;
+	time_t validator = 0;
+
+	/* Continue an interrupted download of an item with known size.
+	 * The partial file's mtime is the Last-Modified of its source. */
+	if (size > 0 && fstatat(db->cache_fd, tmpcacheitem, &st, 0) == 0 &&
+	    S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < size) {
+		offset = st.st_size;
+		validator = st.st_mtime;
+	}
+	*resumed = offset;
+
+	/* Large packages are fetched over several connections into the
+	 * cache item first, and read back from it once complete. */
+	if (db->ctx->fetch_connections > 1 && size - offset >= APK_FETCH_RANGES_MIN &&
+	    atfd == AT_FDCWD && apk_url_local_file(url) == NULL) {
+		is = apk_db_fetch_cache_ranges(db, url, since, tmpcacheitem, offset, validator,
+					       size, tee_flags, cb, cb_ctx, xfer);
+		if (PTR_ERR(is) != -EPROTO && PTR_ERR(is) != -ENOTSUP) return is;
+	}
+
+	is = apk_istream_from_fd_url_range(atfd, url, since, &offset, validator);
+	if (IS_ERR_OR_NULL(is)) return is;
+	if (offset != *resumed) {
+		*resumed = 0;
+		if (offset != 0) {
+			apk_istream_close(is);
+			return ERR_PTR(-EPROTO);
+		}
+	}
+	if (offset) tee_flags |= APK_ISTREAM_TEE_RESUME;
+
+	return apk_istream_tee(is, db->cache_fd, tmpcacheitem, tee_flags, cb, cb_ctx, xfer);
+}
+
+static void apk_db_cache_item_abort(struct apk_database *db, const char *tmpcacheitem, off_t size, off_t resumed)
+{
+	struct stat st;
+
+	/* Keep the partial item if it progressed, it is verified in full
+	 * once completed. Otherwise start over on next attempt. */
+	if (size > 0 && fstatat(db->cache_fd, tmpcacheitem, &st, 0) == 0 &&
+	    st.st_size > resumed && st.st_size < size)
+		return;
+	unlinkat(db->cache_fd, tmpcacheitem, 0);
+}
+
 int apk_cache_download(struct apk_database *db, struct apk_repository *repo,
 		       struct apk_package *pkg, int verify, int autoupdate,
 		       apk_progress_cb cb, void *cb_ctx)
@@ -633,6 +1011,8 @@ int apk_cache_download(struct apk_database *db, struct apk_repository *repo,
 	char url[PATH_MAX];
 	char tmpcacheitem[128], *cacheitem = &tmpcacheitem[tmpprefix.len];
 	apk_blob_t b = APK_BLOB_BUF(tmpcacheitem);
+	off_t size = pkg ? pkg->size : 0, resumed = 0;
+	struct apk_transfer_stats xfer = {0};
 	int r, fd;
 	time_t now = time(NULL);
 
@@ -643,24 +1023,29 @@ int apk_cache_download(struct apk_database *db, struct apk_repository *repo,
 		r = apk_repo_format_cache_index(b, repo);
 	if (r < 0) return r;
 
-	r = apk_repo_format_real_url(db->arch, repo, pkg, url, sizeof(url), &urlp);
-	if (r < 0) return r;
-
 	if (autoupdate && !(db->ctx->force & APK_FORCE_REFRESH)) {
 		if (fstatat(db->cache_fd, cacheitem, &st, 0) == 0 &&
 		    now - st.st_mtime <= db->ctx->cache_max_age)
 			return -EALREADY;
 	}
+	if (!pkg && repo->mirrors && !(db->ctx->flags & APK_SIMULATE))
+		apk_repo_probe_mirrors(db, repo);
+
+retry:
+	r = apk_repo_format_real_url(db->arch, repo, pkg, url, sizeof(url), &urlp);
+	if (r < 0) return r;
 	apk_msg(out, "fetch " URL_FMT, URL_PRINTF(urlp));
 
 	if (db->ctx->flags & APK_SIMULATE) return 0;
 	if (cb) cb(cb_ctx, 0);
+	xfer = (struct apk_transfer_stats) {0};
 
 	if (verify != APK_SIGN_NONE) {
 		apk_sign_ctx_init(&sctx, APK_SIGN_VERIFY, NULL, apk_ctx_get_trust(db->ctx));
-		is = apk_istream_from_url(url, apk_db_url_since(db, st.st_mtime));
-		is = apk_istream_tee(is, db->cache_fd, tmpcacheitem, !autoupdate, cb, cb_ctx);
-		is = apk_istream_gunzip_mpart(is, apk_sign_ctx_mpart_cb, &sctx);
+		is = apk_db_fetch_cache_item(db, AT_FDCWD, url, apk_db_url_since(db, st.st_mtime),
+					     tmpcacheitem, size, &resumed,
+					     autoupdate ? 0 : APK_ISTREAM_TEE_COPY_META, cb, cb_ctx, &xfer);
+		is = apk_istream_decompress_mpart(is, apk_sign_ctx_mpart_cb, &sctx);
 		r = apk_tar_parse(is, apk_sign_ctx_verify_tar, &sctx, db->id_cache);
 		apk_sign_ctx_free(&sctx);
 	} else {
@@ -672,7 +1057,10 @@ int apk_cache_download(struct apk_database *db, struct apk_repository *repo,
 
 		if (fd >= 0) {
 			struct apk_file_meta meta;
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
 			r = apk_istream_splice(is, fd, APK_IO_ALL, cb, cb_ctx, 0);
+			if (r > 0) xfer = (struct apk_transfer_stats) { r, elapsed_ms(&start) * 1000ULL };
 			if (!autoupdate) {
 				apk_istream_get_meta(is, &meta);
 				apk_file_meta_to_fd(fd, &meta);
@@ -686,9 +1074,11 @@ int apk_cache_download(struct apk_database *db, struct apk_repository *repo,
 		return r;
 	}
 	if (r < 0) {
-		unlinkat(db->cache_fd, tmpcacheitem, 0);
+		apk_db_cache_item_abort(db, tmpcacheitem, size, resumed);
+		if (apk_repo_failover(db, repo, r)) goto retry;
 		return r;
 	}
+	apk_repo_mirror_throughput(db, repo, &xfer);
 
 	if (renameat(db->cache_fd, tmpcacheitem, db->cache_fd, cacheitem) < 0)
 		return -errno;
@@ -773,15 +1163,17 @@ int apk_db_index_read(struct apk_database *db, struct apk_istream *is, int repo)
 	struct hlist_node **diri_node = NULL;
 	struct hlist_node **file_diri_node = NULL;
 	struct apk_checksum xattr_csum;
-	apk_blob_t token = APK_BLOB_STR("\n"), l;
+	apk_blob_t lines[64], l;
 	mode_t mode;
 	uid_t uid;
 	gid_t gid;
-	int field, r, lineno = 0;
+	int field, r, lineno = 0, i = 0, n = 0;
 
 	if (IS_ERR_OR_NULL(is)) return PTR_ERR(is);
 
-	while (!APK_BLOB_IS_NULL(l = apk_istream_get_delim(is, token))) {
+	/* Lines are split from the stream buffer a batch at a time */
+	while (i < n || (i = 0, n = apk_istream_get_lines(is, lines, ARRAY_SIZE(lines))) > 0) {
+		l = lines[i++];
 		lineno++;
 
 		if (l.len < 2) {
@@ -1751,6 +2143,9 @@ int apk_db_write_config(struct apk_database *db)
 		return -1;
 	}
 
+	apk_db_syncfs_track(db, "etc/apk");
+	apk_db_syncfs_track(db, "lib/apk/db");
+
 	os = apk_ostream_to_file(db->root_fd, apk_world_file, 0644);
 	if (IS_ERR_OR_NULL(os)) return PTR_ERR(os);
 	apk_deps_write(db, db->world, os, APK_BLOB_PTR_LEN("\n", 1));
@@ -1798,9 +2193,19 @@ void apk_db_close(struct apk_database *db)
 		}
 	}
 
+	if (db->mirrors_changed) apk_db_save_mirrors(db);
 	for (i = APK_REPOSITORY_FIRST_CONFIGURED; i < db->num_repos; i++) {
-		free((void*) db->repos[i].url);
-		free(db->repos[i].description.ptr);
+		struct apk_repository *repo = &db->repos[i];
+		struct apk_repository_mirror *m;
+
+		if (repo->mirrors) {
+			foreach_array_item(m, repo->mirrors)
+				free(m->url);
+			apk_mirror_array_free(&repo->mirrors);
+		} else {
+			free((void*) repo->url);
+		}
+		free(repo->description.ptr);
 	}
 	foreach_array_item(ppath, db->protected_paths)
 		free(ppath->relative_pattern);
@@ -1826,6 +2231,10 @@ void apk_db_close(struct apk_database *db)
 		db->cache_remount_dir = NULL;
 	}
 
+	for (i = 0; i < db->syncfs.num; i++)
+		close(db->syncfs.fd[i]);
+	db->syncfs.num = 0;
+
 	if (db->cache_fd) close(db->cache_fd);
 	if (db->lock_fd) close(db->lock_fd);
 }
@@ -1906,38 +2315,70 @@ int apk_db_fire_triggers(struct apk_database *db)
 	return db->pending_triggers;
 }
 
-int apk_db_run_script(struct apk_database *db, char *fn, char **argv)
+pid_t apk_db_spawn_script(struct apk_database *db, int script_fd, char *fn, char **argv, int out_fd, int err_fd)
 {
 	struct apk_out *out = &db->ctx->out;
-	int status;
-	pid_t pid;
 	static char * const environment[] = {
 		"PATH=/usr/sbin:/usr/bin:/sbin:/bin",
 		NULL
 	};
+	const char * volatile child_op = NULL;
+	volatile int child_errno = 0;
+	sigset_t all, old;
+	pid_t pid;
 
-	pid = fork();
-	if (pid == -1) {
-		apk_err(out, "%s: fork: %s", basename(fn), strerror(errno));
-		return -2;
-	}
+	/* vfork() avoids copying the page tables of the whole database.
+	 * The child shares our memory until execve(), so it may only do
+	 * plain syscalls, and reports failures back via child_op/errno.
+	 * Signals are blocked so no handler runs on the shared stack. */
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &old);
+	pid = vfork();
 	if (pid == 0) {
 		umask(0022);
 
+		if ((out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0) ||
+		    (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)) {
+			child_op = "dup2";
+			goto child_err;
+		}
 		if (fchdir(db->root_fd) != 0) {
-			apk_err(out, "%s: fchdir: %s", basename(fn), strerror(errno));
-			exit(127);
+			child_op = "fchdir";
+			goto child_err;
 		}
-
 		if (!(db->ctx->flags & APK_NO_CHROOT) && chroot(".") != 0) {
-			apk_err(out, "%s: chroot: %s", basename(fn), strerror(errno));
-			exit(127);
+			child_op = "chroot";
+			goto child_err;
 		}
 
-		execve(fn, argv, environment);
-		exit(127); /* should not get here */
+		/* The interpreter opens the script via /dev/fd */
+		if (script_fd >= 0 && fcntl(script_fd, F_SETFD, 0) != 0) {
+			child_op = "fcntl";
+			goto child_err;
+		}
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		if (script_fd >= 0) fexecve(script_fd, argv, environment);
+		else execve(fn, argv, environment);
+		_exit(127); /* should not get here */
+	child_err:
+		child_errno = errno;
+		_exit(127);
 	}
-	waitpid(pid, &status, 0);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+
+	if (pid == -1) {
+		apk_err(out, "%s: fork: %s", basename(fn), strerror(errno));
+		return -1;
+	}
+	if (child_op)
+		apk_err(out, "%s: %s: %s", basename(fn), child_op, strerror(child_errno));
+	return pid;
+}
+
+int apk_db_script_status(struct apk_database *db, char *fn, int status)
+{
+	struct apk_out *out = &db->ctx->out;
+
 	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
 		apk_err(out, "%s: script exited with error %d", basename(fn), WEXITSTATUS(status));
 		return -1;
@@ -1945,6 +2386,17 @@ int apk_db_run_script(struct apk_database *db, char *fn, char **argv)
 	return 0;
 }
 
+int apk_db_run_script(struct apk_database *db, int script_fd, char *fn, char **argv)
+{
+	int status;
+	pid_t pid;
+
+	pid = apk_db_spawn_script(db, script_fd, fn, argv, -1, -1);
+	if (pid < 0) return -2;
+	waitpid(pid, &status, 0);
+	return apk_db_script_status(db, fn, status);
+}
+
 static int update_permissions(apk_hash_item item, void *ctx)
 {
 	struct apk_database *db = (struct apk_database *) ctx;
@@ -1988,6 +2440,50 @@ void apk_db_update_directory_permissions(struct apk_database *db)
 	apk_hash_foreach(&db->installed.dirs, update_permissions, db);
 }
 
+void apk_db_syncfs_track(struct apk_database *db, const char *dir)
+{
+	struct stat st;
+	int i, fd;
+
+	if (!(db->ctx->flags & APK_DURABLE) || db->syncfs.overflow) return;
+	if (!dir[0]) dir = ".";
+
+	if (fstatat(db->root_fd, dir, &st, 0) != 0) return;
+	for (i = 0; i < db->syncfs.num; i++)
+		if (db->syncfs.dev[i] == st.st_dev) return;
+
+	/* Too many filesystems to track, fall back to global sync */
+	if (db->syncfs.num >= ARRAY_SIZE(db->syncfs.fd)) goto overflow;
+
+	fd = openat(db->root_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) goto overflow;
+
+	db->syncfs.dev[db->syncfs.num] = st.st_dev;
+	db->syncfs.fd[db->syncfs.num] = fd;
+	db->syncfs.num++;
+	return;
+overflow:
+	db->syncfs.overflow = 1;
+}
+
+int apk_db_syncfs(struct apk_database *db)
+{
+	int i, r = 0;
+
+	if (!(db->ctx->flags & APK_DURABLE) || (db->ctx->flags & APK_SIMULATE))
+		return 0;
+
+	if (db->syncfs.overflow) {
+		sync();
+		return 0;
+	}
+	for (i = 0; i < db->syncfs.num; i++) {
+		if (syncfs(db->syncfs.fd[i]) < 0 && !r)
+			r = -errno;
+	}
+	return r;
+}
+
 int apk_db_cache_active(struct apk_database *db)
 {
 	return db->ctx->cache_dir != apk_static_cache_dir;
@@ -2192,13 +2688,13 @@ static int load_index(struct apk_database *db, struct apk_istream *is,
 		ctx.repo = repo;
 		ctx.found = 0;
 		apk_sign_ctx_init(&ctx.sctx, APK_SIGN_VERIFY, NULL, apk_ctx_get_trust(db->ctx));
-		r = apk_tar_parse(apk_istream_gunzip_mpart(is, apk_sign_ctx_mpart_cb, &ctx.sctx), load_apkindex, &ctx, db->id_cache);
+		r = apk_tar_parse(apk_istream_decompress_mpart(is, apk_sign_ctx_mpart_cb, &ctx.sctx), load_apkindex, &ctx, db->id_cache);
 		apk_sign_ctx_free(&ctx.sctx);
 
 		if (r >= 0 && ctx.found == 0)
 			r = -ENOMSG;
 	} else {
-		apk_db_index_read(db, apk_istream_gunzip(is), repo);
+		apk_db_index_read(db, apk_istream_decompress(is), repo);
 	}
 	return r;
 }
@@ -2213,14 +2709,26 @@ int apk_db_index_read_file(struct apk_database *db, const char *file, int repo)
 	return load_index(db, apk_istream_from_file(AT_FDCWD, file), targz, repo);
 }
 
+static int add_repository_mirror(void *ctx, apk_blob_t url)
+{
+	struct apk_repository *repo = ctx;
+
+	if (url.len == 0 || apk_repo_mirror(repo, url)) return 0;
+	*apk_mirror_array_add(&repo->mirrors) = (struct apk_repository_mirror) {
+		.url = apk_blob_cstr(url),
+	};
+	return 0;
+}
+
 int apk_db_add_repository(apk_database_t _db, apk_blob_t _repository)
 {
 	struct apk_database *db = _db.db;
 	struct apk_out *out = &db->ctx->out;
 	struct apk_repository *repo;
 	struct apk_url_print urlp;
-	apk_blob_t brepo, btag;
-	int repo_num, r, targz = 1, tag_id = 0;
+	struct apk_istream *is;
+	apk_blob_t brepo, btag, bmirrors;
+	int repo_num, r, targz = 1, tag_id = 0, cached = 0;
 	char buf[PATH_MAX], *url;
 
 	brepo = _repository;
@@ -2234,10 +2742,14 @@ int apk_db_add_repository(apk_database_t _db, apk_blob_t _repository)
 		tag_id = apk_db_get_tag_id(db, btag);
 	}
 
+	/* Further space separated URLs are mirrors of the first one */
+	if (!apk_blob_split(brepo, APK_BLOB_STRLIT(" "), &brepo, &bmirrors))
+		bmirrors = APK_BLOB_NULL;
+
 	url = apk_blob_cstr(brepo);
 	for (repo_num = 0; repo_num < db->num_repos; repo_num++) {
 		repo = &db->repos[repo_num];
-		if (strcmp(url, repo->url) == 0) {
+		if (repo->mirrors ? apk_repo_mirror(repo, brepo) != NULL : strcmp(url, repo->url) == 0) {
 			db->repo_tags[tag_id].allowed_repos |=
 				BIT(repo_num) & db->available_repos;
 			free(url);
@@ -2257,6 +2769,13 @@ int apk_db_add_repository(apk_database_t _db, apk_blob_t _repository)
 
 	apk_blob_checksum(brepo, apk_checksum_default(), &repo->csum);
 
+	if (!APK_BLOB_IS_NULL(bmirrors)) {
+		apk_mirror_array_init(&repo->mirrors);
+		*apk_mirror_array_add(&repo->mirrors) = (struct apk_repository_mirror) { .url = url };
+		apk_blob_for_each_segment(bmirrors, " ", add_repository_mirror, repo);
+		apk_db_load_mirrors(db, repo);
+	}
+
 	if (apk_url_local_file(repo->url) == NULL) {
 		if (!(db->ctx->flags & APK_NO_NETWORK))
 			db->available_repos |= BIT(repo_num);
@@ -2266,6 +2785,7 @@ int apk_db_add_repository(apk_database_t _db, apk_blob_t _repository)
 		} else {
 			if (db->autoupdate) apk_repository_update(db, repo);
 			r = apk_repo_format_cache_index(APK_BLOB_BUF(buf), repo);
+			cached = 1;
 		}
 	} else {
 		db->local_repos |= BIT(repo_num);
@@ -2273,7 +2793,9 @@ int apk_db_add_repository(apk_database_t _db, apk_blob_t _repository)
 		r = apk_repo_format_real_url(db->arch, repo, NULL, buf, sizeof(buf), &urlp);
 	}
 	if (r == 0) {
-		r = load_index(db, apk_istream_from_fd_url(db->cache_fd, buf, apk_db_url_since(db, 0)), targz, repo_num);
+		if (cached) is = apk_istream_from_file_mmap(db->cache_fd, buf);
+		else is = apk_istream_from_fd_url(db->cache_fd, buf, apk_db_url_since(db, 0));
+		r = load_index(db, is, targz, repo_num);
 	}
 
 	if (r != 0) {
@@ -2675,6 +3197,7 @@ static void apk_db_migrate_files(struct apk_database *db,
 	hlist_for_each_entry_safe(diri, dc, dn, &ipkg->owned_dirs, pkg_dirs_list) {
 		dir = diri->dir;
 		dir->modified = 1;
+		apk_db_syncfs_track(db, dir->name);
 
 		hlist_for_each_entry_safe(file, fc, fn, &diri->owned_files, diri_files_list) {
 			snprintf(name, sizeof(name), DIR_FILE_FMT, DIR_FILE_PRINTF(diri->dir, file));
@@ -2768,11 +3291,13 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 {
 	struct apk_out *out = &db->ctx->out;
 	struct install_ctx ctx;
-	struct apk_istream *is = NULL, *cache_is;
-	struct apk_repository *repo;
+	struct apk_istream *is = NULL;
+	struct apk_repository *repo = NULL;
 	struct apk_package *pkg = ipkg->pkg;
 	char file[PATH_MAX];
 	char tmpcacheitem[128], *cacheitem = &tmpcacheitem[tmpprefix.len];
+	off_t resumed = 0;
+	struct apk_transfer_stats xfer = {0};
 	int r, filefd = AT_FDCWD, need_copy = FALSE;
 
 	if (pkg->filename == NULL) {
@@ -2781,6 +3306,7 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 			r = -ENOPKG;
 			goto err_msg;
 		}
+retry:
 		r = apk_repo_format_item(db, repo, pkg, &filefd, file, sizeof(file));
 		if (r < 0)
 			goto err_msg;
@@ -2796,24 +3322,27 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 	if (!apk_db_cache_active(db))
 		need_copy = FALSE;
 
-	is = apk_istream_from_fd_url(filefd, file, apk_db_url_since(db, 0));
+	if (need_copy) {
+		apk_blob_t b = APK_BLOB_BUF(tmpcacheitem);
+		apk_blob_push_blob(&b, tmpprefix);
+		apk_pkg_format_cache_pkg(b, pkg);
+		is = apk_db_fetch_cache_item(db, filefd, file, apk_db_url_since(db, 0),
+					     tmpcacheitem, pkg->size, &resumed,
+					     APK_ISTREAM_TEE_COPY_META, NULL, NULL, &xfer);
+	} else if (filefd == db->cache_fd) {
+		is = apk_istream_from_file_mmap(filefd, file);
+	} else {
+		is = apk_istream_from_fd_url(filefd, file, apk_db_url_since(db, 0));
+	}
 	if (IS_ERR_OR_NULL(is)) {
 		r = PTR_ERR(is);
+		/* Only the open is retried on another mirror; once the
+		 * stream is being extracted scripts may have already run. */
+		if (repo && apk_repo_failover(db, repo, r) > 0) goto retry;
 		if (r == -ENOENT && pkg->filename == NULL)
 			r = -EAPKSTALEINDEX;
 		goto err_msg;
 	}
-	if (need_copy) {
-		apk_blob_t b = APK_BLOB_BUF(tmpcacheitem);
-		apk_blob_push_blob(&b, tmpprefix);
-		apk_pkg_format_cache_pkg(b, pkg);
-		cache_is = apk_istream_tee(is, db->cache_fd, tmpcacheitem, 1, NULL, NULL);
-		if (!IS_ERR_OR_NULL(cache_is))
-			is = cache_is;
-		else
-			apk_warn(out, PKG_VER_FMT": unable to cache: %s",
-				PKG_VER_PRINTF(pkg), apk_error_str(errno));
-	}
 
 	ctx = (struct install_ctx) {
 		.db = db,
@@ -2826,7 +3355,7 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 		.cb_ctx = cb_ctx,
 	};
 	apk_sign_ctx_init(&ctx.sctx, APK_SIGN_VERIFY_IDENTITY, &pkg->csum, apk_ctx_get_trust(db->ctx));
-	r = apk_tar_parse(apk_istream_gunzip_mpart(is, apk_sign_ctx_mpart_cb, &ctx.sctx), apk_db_install_archive_entry, &ctx, db->id_cache);
+	r = apk_tar_parse(apk_istream_decompress_mpart(is, apk_sign_ctx_mpart_cb, &ctx.sctx), apk_db_install_archive_entry, &ctx, db->id_cache);
 	apk_sign_ctx_free(&ctx.sctx);
 
 	if (need_copy) {
@@ -2834,11 +3363,12 @@ static int apk_db_unpack_pkg(struct apk_database *db,
 			renameat(db->cache_fd, tmpcacheitem, db->cache_fd, cacheitem);
 			pkg->repos |= BIT(APK_REPOSITORY_CACHED);
 		} else {
-			unlinkat(db->cache_fd, tmpcacheitem, 0);
+			apk_db_cache_item_abort(db, tmpcacheitem, pkg->size, resumed);
 		}
 	}
 	if (r != 0)
 		goto err_msg;
+	if (repo) apk_repo_mirror_throughput(db, repo, &xfer);
 
 	apk_db_run_pending_script(&ctx);
 	return 0;
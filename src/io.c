@@ -15,10 +15,14 @@
 #include <malloc.h>
 #include <dirent.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <sys/sendfile.h>
 #include <pwd.h>
 #include <grp.h>
 
@@ -32,6 +36,7 @@
 #endif
 
 size_t apk_io_bufsize = 128*1024;
+unsigned int apk_io_readahead = 0;
 
 static void apk_file_meta_from_fd(int fd, struct apk_file_meta *meta)
 {
@@ -171,6 +176,32 @@ apk_blob_t apk_istream_get_delim(struct apk_istream *is, apk_blob_t token)
 	return (struct apk_blob) { .len = is->err < 0 ? is->err : 0 };
 }
 
+int apk_istream_get_lines(struct apk_istream *is, apk_blob_t *lines, int max)
+{
+	apk_blob_t left;
+	int n;
+
+	do {
+		n = apk_blob_split_lines(APK_BLOB_PTR_LEN((char*)is->ptr, is->end - is->ptr), lines, max, &left);
+		if (n) {
+			is->ptr = (uint8_t*)left.ptr;
+			return n;
+		}
+		if (is->end - is->ptr == is->buf_size) {
+			is->err = -ENOBUFS;
+			break;
+		}
+	} while (!__apk_istream_fill(is));
+
+	/* Last line before end-of-file, like apk_istream_get_delim() */
+	if (is->ptr && is->err > 0) {
+		lines[0] = APK_BLOB_PTR_LEN((char*)is->ptr, is->end - is->ptr);
+		is->ptr = is->end = 0;
+		return 1;
+	}
+	return is->err < 0 ? is->err : 0;
+}
+
 static void segment_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
 {
 	struct apk_segment_istream *sis = container_of(is, struct apk_segment_istream, is);
@@ -244,9 +275,10 @@ struct apk_tee_istream {
 	struct apk_istream is;
 	struct apk_istream *inner_is;
 	int fd, copy_meta;
-	size_t size;
+	size_t size, resume_left;
 	apk_progress_cb cb;
 	void *cb_ctx;
+	struct apk_transfer_stats *stats;
 };
 
 static void tee_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
@@ -272,7 +304,28 @@ static ssize_t tee_read(struct apk_istream *is, void *ptr, size_t size)
 	struct apk_tee_istream *tee = container_of(is, struct apk_tee_istream, is);
 	ssize_t r;
 
-	r = tee->inner_is->ops->read(tee->inner_is, ptr, size);
+	if (tee->resume_left) {
+		/* Replay the previously stored data first */
+		r = read(tee->fd, ptr, min(size, tee->resume_left));
+		if (r <= 0) return r < 0 ? -errno : -EIO;
+		tee->resume_left -= r;
+		tee->size += r;
+		if (tee->cb) tee->cb(tee->cb_ctx, tee->size);
+		return r;
+	}
+
+	if (tee->stats) {
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		r = tee->inner_is->ops->read(tee->inner_is, ptr, size);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		tee->stats->usec += (end.tv_sec - start.tv_sec) * 1000000LL +
+				    (end.tv_nsec - start.tv_nsec) / 1000;
+		if (r > 0) tee->stats->bytes += r;
+	} else {
+		r = tee->inner_is->ops->read(tee->inner_is, ptr, size);
+	}
 	if (r <= 0) return r;
 
 	return __tee_write(tee, ptr, r);
@@ -301,19 +354,32 @@ static const struct apk_istream_ops tee_istream_ops = {
 	.close = tee_close,
 };
 
-struct apk_istream *apk_istream_tee(struct apk_istream *from, int atfd, const char *to, int copy_meta, apk_progress_cb cb, void *cb_ctx)
+struct apk_istream *apk_istream_tee(struct apk_istream *from, int atfd, const char *to, unsigned int flags,
+				    apk_progress_cb cb, void *cb_ctx, struct apk_transfer_stats *stats)
 {
 	struct apk_tee_istream *tee;
+	struct stat st = { .st_size = 0 };
 	int fd, r;
 
 	if (IS_ERR_OR_NULL(from)) return ERR_CAST(from);
 
-	fd = openat(atfd, to, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC,
+	/* When resuming, 'from' continues where the existing file ends */
+	if ((flags & APK_ISTREAM_TEE_RESUME) && from->ptr != from->end) {
+		r = -EINVAL;
+		goto err_is;
+	}
+
+	fd = openat(atfd, to, O_CREAT | O_RDWR | O_CLOEXEC |
+		    ((flags & APK_ISTREAM_TEE_RESUME) ? 0 : O_TRUNC),
 		    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	if (fd < 0) {
 		r = -errno;
 		goto err_is;
 	}
+	if ((flags & APK_ISTREAM_TEE_RESUME) && fstat(fd, &st) < 0) {
+		r = -errno;
+		goto err_fd;
+	}
 
 	tee = malloc(sizeof *tee);
 	if (!tee) {
@@ -329,9 +395,11 @@ struct apk_istream *apk_istream_tee(struct apk_istream *from, int atfd, const ch
 		.is.end = from->end,
 		.inner_is = from,
 		.fd = fd,
-		.copy_meta = copy_meta,
+		.copy_meta = !!(flags & APK_ISTREAM_TEE_COPY_META),
+		.resume_left = st.st_size,
 		.cb = cb,
 		.cb_ctx = cb_ctx,
+		.stats = stats,
 	};
 
 	if (from->ptr != from->end) {
@@ -349,9 +417,50 @@ err_is:
 	return ERR_PTR(r);
 }
 
+#define APK_SPLICE_COPY_FILE_RANGE	0
+#define APK_SPLICE_SENDFILE		1
+#define APK_SPLICE_SPLICE		2
+#define APK_SPLICE_NONE			3
+
+static ssize_t __apk_fd_splice(int in_fd, off_t *off, int out_fd, size_t size, int *method)
+{
+	ssize_t r = -1;
+
+	/* Try the kernel copy primitives from the most to the least
+	 * capable, and remember the first one that works for this input.
+	 * The errors checked mean that the primitive does not work
+	 * between these two kinds of files. */
+	switch (*method) {
+	case APK_SPLICE_COPY_FILE_RANGE:
+		r = copy_file_range(in_fd, off, out_fd, NULL, size, 0);
+		if (r >= 0) return r;
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+		    errno != EOPNOTSUPP && errno != EBADF)
+			return -errno;
+		*method = APK_SPLICE_SENDFILE;
+		/* fallthrough */
+	case APK_SPLICE_SENDFILE:
+		r = sendfile(out_fd, in_fd, off, size);
+		if (r >= 0) return r;
+		if (errno != EINVAL && errno != ENOSYS) return -errno;
+		*method = APK_SPLICE_SPLICE;
+		/* fallthrough */
+	case APK_SPLICE_SPLICE:
+		if (!off) {
+			r = splice(in_fd, NULL, out_fd, NULL, size, 0);
+			if (r >= 0) return r;
+			if (errno != EINVAL && errno != ENOSYS) return -errno;
+		}
+		*method = APK_SPLICE_NONE;
+		/* fallthrough */
+	default:
+		return -ENOTSUP;
+	}
+}
+
 struct apk_mmap_istream {
 	struct apk_istream is;
-	int fd;
+	int fd, splice_method;
 };
 
 static void mmap_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
@@ -365,6 +474,19 @@ static ssize_t mmap_read(struct apk_istream *is, void *ptr, size_t size)
 	return 0;
 }
 
+static ssize_t mmap_splice(struct apk_istream *is, int fd, size_t size)
+{
+	struct apk_mmap_istream *mis = container_of(is, struct apk_mmap_istream, is);
+	off_t off = is->ptr - is->buf;
+	ssize_t r;
+
+	if (is->ptr == is->end) return 0;
+	r = __apk_fd_splice(mis->fd, &off, fd, min(size, (size_t)(is->end - is->ptr)), &mis->splice_method);
+	if (r > 0) is->ptr += r;
+	else if (r == 0) r = -EIO;
+	return r;
+}
+
 static int mmap_close(struct apk_istream *is)
 {
 	int r = is->err;
@@ -380,6 +502,7 @@ static const struct apk_istream_ops mmap_istream_ops = {
 	.get_meta = mmap_get_meta,
 	.read = mmap_read,
 	.close = mmap_close,
+	.splice = mmap_splice,
 };
 
 static inline struct apk_istream *apk_mmap_istream_from_fd(int fd)
@@ -414,7 +537,7 @@ static inline struct apk_istream *apk_mmap_istream_from_fd(int fd)
 
 struct apk_fd_istream {
 	struct apk_istream is;
-	int fd;
+	int fd, splice_method;
 };
 
 static void fdi_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
@@ -433,6 +556,26 @@ static ssize_t fdi_read(struct apk_istream *is, void *ptr, size_t size)
 	return r;
 }
 
+static ssize_t fdi_splice(struct apk_istream *is, int fd, size_t size)
+{
+	struct apk_fd_istream *fis = container_of(is, struct apk_fd_istream, is);
+	ssize_t r;
+
+	if (is->ptr != is->end) {
+		/* Already buffered data is written out first */
+		size = min(size, (size_t)(is->end - is->ptr));
+		r = write(fd, is->ptr, size);
+		if (r < 0) return -errno;
+		is->ptr += r;
+		return r;
+	}
+	if (is->err) return is->err < 0 ? is->err : 0;
+
+	r = __apk_fd_splice(fis->fd, NULL, fd, size, &fis->splice_method);
+	if (r == 0) is->err = 1;
+	return r;
+}
+
 static int fdi_close(struct apk_istream *is)
 {
 	int r = is->err;
@@ -447,14 +590,222 @@ static const struct apk_istream_ops fd_istream_ops = {
 	.get_meta = fdi_get_meta,
 	.read = fdi_read,
 	.close = fdi_close,
+	.splice = fdi_splice,
+};
+
+/* Readahead istream. A helper thread keeps up to 'depth' buffers filled
+ * from the file while the consumer decompresses or parses the previous
+ * ones, so slow storage latency overlaps with the processing. Only used
+ * for regular files, where a read never blocks indefinitely and the thread
+ * can always be joined on close. Splicing stops the thread and hands the
+ * rest of the file to the kernel once the filled buffers are written. */
+
+struct apk_ra_slot {
+	ssize_t len;
+	uint8_t *data;
+};
+
+struct apk_ra_istream {
+	struct apk_istream is;
+	int fd, stop, stopped, splice_method;
+	unsigned int depth, head, tail;
+	size_t offset, slot_size;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t filled, drained;
+	struct apk_ra_slot slots[];
 };
 
+static void *ra_thread(void *arg)
+{
+	struct apk_ra_istream *ris = arg;
+	struct apk_ra_slot *slot;
+	ssize_t r;
+
+	pthread_mutex_lock(&ris->mutex);
+	while (!ris->stop) {
+		if (ris->head - ris->tail == ris->depth) {
+			pthread_cond_wait(&ris->drained, &ris->mutex);
+			continue;
+		}
+		slot = &ris->slots[ris->head % ris->depth];
+		pthread_mutex_unlock(&ris->mutex);
+
+		do r = read(ris->fd, slot->data, ris->slot_size);
+		while (r < 0 && errno == EINTR);
+		slot->len = r < 0 ? -errno : r;
+
+		pthread_mutex_lock(&ris->mutex);
+		ris->head++;
+		pthread_cond_signal(&ris->filled);
+		if (r <= 0) break;
+	}
+	pthread_mutex_unlock(&ris->mutex);
+	return NULL;
+}
+
+static void rai_get_meta(struct apk_istream *is, struct apk_file_meta *meta)
+{
+	struct apk_ra_istream *ris = container_of(is, struct apk_ra_istream, is);
+	apk_file_meta_from_fd(ris->fd, meta);
+}
+
+static ssize_t rai_read(struct apk_istream *is, void *ptr, size_t size)
+{
+	struct apk_ra_istream *ris = container_of(is, struct apk_ra_istream, is);
+	struct apk_ra_slot *slot;
+	ssize_t r;
+	size_t n;
+
+	if (!ris->stopped) {
+		pthread_mutex_lock(&ris->mutex);
+		while (ris->tail == ris->head)
+			pthread_cond_wait(&ris->filled, &ris->mutex);
+		pthread_mutex_unlock(&ris->mutex);
+	} else if (ris->tail == ris->head) {
+		r = read(ris->fd, ptr, size);
+		if (r < 0) return -errno;
+		return r;
+	}
+
+	/* The slot at tail belongs to the consumer until tail advances.
+	 * The end of file or error slot is never released. */
+	slot = &ris->slots[ris->tail % ris->depth];
+	if (slot->len <= 0) return slot->len;
+
+	n = min(size, slot->len - ris->offset);
+	memcpy(ptr, slot->data + ris->offset, n);
+	ris->offset += n;
+	if (ris->offset == slot->len) {
+		ris->offset = 0;
+		pthread_mutex_lock(&ris->mutex);
+		ris->tail++;
+		pthread_cond_signal(&ris->drained);
+		pthread_mutex_unlock(&ris->mutex);
+	}
+	return n;
+}
+
+static void rai_stop(struct apk_ra_istream *ris)
+{
+	if (ris->stopped) return;
+	pthread_mutex_lock(&ris->mutex);
+	ris->stop = 1;
+	pthread_cond_signal(&ris->drained);
+	pthread_mutex_unlock(&ris->mutex);
+	pthread_join(ris->thread, NULL);
+	ris->stopped = 1;
+}
+
+static ssize_t rai_splice(struct apk_istream *is, int fd, size_t size)
+{
+	struct apk_ra_istream *ris = container_of(is, struct apk_ra_istream, is);
+	struct apk_ra_slot *slot;
+	ssize_t r;
+
+	if (is->ptr != is->end) {
+		/* Already buffered data is written out first */
+		size = min(size, (size_t)(is->end - is->ptr));
+		r = write(fd, is->ptr, size);
+		if (r < 0) return -errno;
+		is->ptr += r;
+		return r;
+	}
+	if (is->err) return is->err < 0 ? is->err : 0;
+
+	rai_stop(ris);
+	if (ris->tail != ris->head) {
+		slot = &ris->slots[ris->tail % ris->depth];
+		if (slot->len <= 0) {
+			if (slot->len == 0) is->err = 1;
+			return slot->len;
+		}
+		r = write(fd, slot->data + ris->offset, min(size, slot->len - ris->offset));
+		if (r < 0) return -errno;
+		ris->offset += r;
+		if (ris->offset == slot->len) {
+			ris->offset = 0;
+			ris->tail++;
+		}
+		return r;
+	}
+
+	r = __apk_fd_splice(ris->fd, NULL, fd, size, &ris->splice_method);
+	if (r == 0) is->err = 1;
+	return r;
+}
+
+static int rai_close(struct apk_istream *is)
+{
+	struct apk_ra_istream *ris = container_of(is, struct apk_ra_istream, is);
+	int r = is->err;
+
+	rai_stop(ris);
+
+	pthread_cond_destroy(&ris->drained);
+	pthread_cond_destroy(&ris->filled);
+	pthread_mutex_destroy(&ris->mutex);
+	close(ris->fd);
+	free(ris);
+	return r < 0 ? r : 0;
+}
+
+static const struct apk_istream_ops ra_istream_ops = {
+	.get_meta = rai_get_meta,
+	.read = rai_read,
+	.close = rai_close,
+	.splice = rai_splice,
+};
+
+static struct apk_istream *apk_ra_istream_from_fd(int fd, unsigned int depth)
+{
+	struct apk_ra_istream *ris;
+	size_t slot_size = apk_io_bufsize;
+	uint8_t *data;
+	int i;
+
+	depth = min(depth, APK_IO_READAHEAD_MAX);
+	ris = malloc(sizeof *ris + depth * sizeof ris->slots[0] +
+		     apk_io_bufsize + depth * slot_size);
+	if (ris == NULL) return ERR_PTR(-ENOMEM);
+
+	*ris = (struct apk_ra_istream) {
+		.is.ops = &ra_istream_ops,
+		.is.buf = (uint8_t *) &ris->slots[depth],
+		.is.buf_size = apk_io_bufsize,
+		.fd = fd,
+		.depth = depth,
+		.slot_size = slot_size,
+	};
+	data = ris->is.buf + apk_io_bufsize;
+	for (i = 0; i < depth; i++)
+		ris->slots[i].data = data + i * slot_size;
+
+	pthread_mutex_init(&ris->mutex, NULL);
+	pthread_cond_init(&ris->filled, NULL);
+	pthread_cond_init(&ris->drained, NULL);
+	if (pthread_create(&ris->thread, NULL, ra_thread, ris) != 0) {
+		pthread_cond_destroy(&ris->drained);
+		pthread_cond_destroy(&ris->filled);
+		pthread_mutex_destroy(&ris->mutex);
+		free(ris);
+		return ERR_PTR(-EAGAIN);
+	}
+	return &ris->is;
+}
+
 struct apk_istream *apk_istream_from_fd(int fd)
 {
 	struct apk_fd_istream *fis;
+	struct stat st;
 
 	if (fd < 0) return ERR_PTR(-EBADF);
 
+	if (apk_io_readahead && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		struct apk_istream *is = apk_ra_istream_from_fd(fd, apk_io_readahead);
+		if (!IS_ERR(is)) return is;
+	}
+
 	fis = malloc(sizeof(*fis) + apk_io_bufsize);
 	if (fis == NULL) {
 		close(fd);
@@ -485,6 +836,26 @@ struct apk_istream *apk_istream_from_file(int atfd, const char *file)
 	return apk_istream_from_fd(fd);
 }
 
+struct apk_istream *apk_istream_from_file_mmap(int atfd, const char *file)
+{
+	struct apk_istream *is;
+	int fd;
+
+	/* Map the whole file so that it is handed out as a single
+	 * buffer, and fall back to reads if it cannot be mapped. With
+	 * readahead enabled, reads are preferred: page faults on the
+	 * mapping would stall the reader on slow storage.
+	 * Only use this for files apk replaces by renaming, such as its
+	 * cache: truncating a mapped file raises SIGBUS in the reader. */
+	fd = openat(atfd, file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return ERR_PTR(-errno);
+	if (apk_io_readahead) return apk_istream_from_fd(fd);
+
+	is = apk_mmap_istream_from_fd(fd);
+	if (!IS_ERR_OR_NULL(is)) return is;
+	return apk_istream_from_fd(fd);
+}
+
 ssize_t apk_stream_copy(struct apk_istream *is, struct apk_ostream *os, size_t size,
 			apk_progress_cb cb, void *cb_ctx, struct apk_digest_ctx *dctx)
 {
@@ -519,9 +890,26 @@ ssize_t apk_istream_splice(struct apk_istream *is, int fd, size_t size,
 	size_t bufsz, done = 0, togo;
 	ssize_t r;
 
-	bufsz = size;
-	if (size > 128 * 1024) {
-		if (size != APK_IO_ALL) {
+	if (!dctx && is->ops->splice) {
+		/* Nothing to look at, let the kernel move the data. */
+		while (done < size) {
+			if (cb != NULL) cb(cb_ctx, done);
+
+			r = is->ops->splice(is, fd, min(size - done, 2*1024*1024));
+			if (r == -ENOTSUP) break;
+			if (r < 0) return r;
+			if (r == 0) {
+				if (size != APK_IO_ALL && done != size) return -EBADMSG;
+				return done;
+			}
+			done += r;
+		}
+		if (done == size) return done;
+	}
+
+	bufsz = size - done;
+	if (bufsz > 128 * 1024) {
+		if (size != APK_IO_ALL && done == 0) {
 			r = posix_fallocate(fd, 0, size);
 			if (r == 0)
 				mmapbase = mmap(NULL, size, PROT_READ | PROT_WRITE,
@@ -687,6 +1075,8 @@ void apk_fileinfo_hash_xattr(struct apk_file_info *fi, uint8_t alg)
 	apk_fileinfo_hash_xattr_array(fi->xattrs, alg, &fi->xattr_digest);
 }
 
+#define APK_FI_SMALL_FILE	(16*1024)
+
 int apk_fileinfo_get(int atfd, const char *filename, unsigned int flags,
 		     struct apk_file_info *fi, struct apk_atom_pool *atoms)
 {
@@ -756,6 +1146,27 @@ int apk_fileinfo_get(int atfd, const char *filename, unsigned int flags,
 			return -errno;
 
 		apk_digest_calc(&fi->digest, hash_alg, target, st.st_size);
+	} else if (st.st_size <= APK_FI_SMALL_FILE) {
+		/* Most files hashed here are small. Read them through a
+		 * stack buffer instead of setting up an istream and its
+		 * large heap buffer for each of them. */
+		struct apk_digest_ctx dctx;
+		uint8_t buf[APK_FI_SMALL_FILE];
+		ssize_t len, total = 0;
+		int fd;
+
+		fd = openat(atfd, filename, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			if (apk_digest_ctx_init(&dctx, hash_alg) == 0) {
+				while ((len = read(fd, buf, sizeof buf)) > 0) {
+					apk_digest_ctx_update(&dctx, buf, len);
+					if ((total += len) >= st.st_size) break;
+				}
+				apk_digest_ctx_final(&dctx, &fi->digest);
+				apk_digest_ctx_free(&dctx);
+			}
+			close(fd);
+		}
 	} else {
 		struct apk_istream *is = apk_istream_from_file(atfd, filename);
 		if (!IS_ERR_OR_NULL(is)) {
@@ -817,6 +1228,43 @@ struct apk_istream *apk_istream_from_file_gz(int atfd, const char *file)
 	return apk_istream_gunzip(apk_istream_from_file(atfd, file));
 }
 
+int apk_compression_by_name(const char *name)
+{
+	apk_blob_t method = APK_BLOB_STR(name), level;
+	unsigned int l = 0;
+
+	/* METHOD[:LEVEL], the level is only selectable for zstd */
+	if (apk_blob_split(method, APK_BLOB_STRLIT(":"), &method, &level)) {
+		l = apk_blob_pull_uint(&level, 10);
+		if (level.len != 0 || l < 1 || l > 22) return -EINVAL;
+	}
+	if (apk_blob_compare(method, APK_BLOB_STRLIT("gzip")) == 0)
+		return l ? -EINVAL : APK_COMPRESSION_GZIP;
+	if (apk_blob_compare(method, APK_BLOB_STRLIT("zstd")) == 0) {
+#ifdef HAVE_ZSTD
+		return APK_COMPRESSION_ZSTD | (l << 8);
+#else
+		return -ENOTSUP;
+#endif
+	}
+	return -EINVAL;
+}
+
+struct apk_ostream *apk_ostream_compress(struct apk_ostream *os, int compression, unsigned int threads)
+{
+	switch (APK_COMPRESSION_METHOD(compression)) {
+#ifdef HAVE_ZSTD
+	case APK_COMPRESSION_ZSTD:
+		return apk_ostream_zstd(os, APK_COMPRESSION_LEVEL(compression) ?: APK_ZSTD_DEFAULT_LEVEL);
+#endif
+	case APK_COMPRESSION_GZIP:
+		return apk_ostream_gzip_threads(os, threads);
+	default:
+		apk_ostream_close(os);
+		return ERR_PTR(-ENOTSUP);
+	}
+}
+
 struct apk_fd_ostream {
 	struct apk_ostream os;
 	int fd;
@@ -844,6 +1292,28 @@ static ssize_t safe_write(int fd, const void *ptr, size_t size)
 	return i;
 }
 
+static ssize_t safe_writev(int fd, struct iovec *vec, int nvec)
+{
+	ssize_t i = 0, r;
+
+	while (nvec > 0) {
+		r = writev(fd, vec, min(nvec, IOV_MAX));
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			return i;
+		i += r;
+		for (; nvec > 0 && r >= vec->iov_len; vec++, nvec--)
+			r -= vec->iov_len;
+		if (nvec > 0) {
+			vec->iov_base += r;
+			vec->iov_len -= r;
+		}
+	}
+
+	return i;
+}
+
 static ssize_t fdo_flush(struct apk_fd_ostream *fos)
 {
 	ssize_t r;
@@ -882,6 +1352,35 @@ static ssize_t fdo_write(struct apk_ostream *os, const void *ptr, size_t size)
 	return size;
 }
 
+static ssize_t fdo_writev(struct apk_ostream *os, const struct iovec *vec, size_t nvec)
+{
+	struct apk_fd_ostream *fos = container_of(os, struct apk_fd_ostream, os);
+	struct iovec *iov;
+	size_t i, size = 0;
+	ssize_t r;
+
+	for (i = 0; i < nvec; i++) size += vec[i].iov_len;
+	if (size + fos->bytes < sizeof(fos->buffer)) {
+		for (i = 0; i < nvec; i++) {
+			memcpy(&fos->buffer[fos->bytes], vec[i].iov_base, vec[i].iov_len);
+			fos->bytes += vec[i].iov_len;
+		}
+		return size;
+	}
+
+	/* Anything buffered goes out with the same system call */
+	iov = alloca((nvec + 1) * sizeof *iov);
+	iov[0] = (struct iovec) { .iov_base = fos->buffer, .iov_len = fos->bytes };
+	memcpy(&iov[1], vec, nvec * sizeof *vec);
+	r = safe_writev(fos->fd, iov, nvec + 1);
+	if (r != size + fos->bytes) {
+		apk_ostream_cancel(&fos->os, r < 0 ? r : -EIO);
+		return r < 0 ? r : -EIO;
+	}
+	fos->bytes = 0;
+	return size;
+}
+
 static int fdo_close(struct apk_ostream *os)
 {
 	struct apk_fd_ostream *fos = container_of(os, struct apk_fd_ostream, os);
@@ -914,6 +1413,7 @@ static int fdo_close(struct apk_ostream *os)
 
 static const struct apk_ostream_ops fd_ostream_ops = {
 	.write = fdo_write,
+	.writev = fdo_writev,
 	.close = fdo_close,
 };
 
@@ -1003,6 +1503,20 @@ struct apk_ostream *apk_ostream_counter(off_t *counter)
 	return &cos->os;
 }
 
+ssize_t apk_ostream_writev(struct apk_ostream *os, const struct iovec *vec, size_t nvec)
+{
+	size_t i, size = 0;
+	ssize_t r;
+
+	if (os->ops->writev) return os->ops->writev(os, vec, nvec);
+	for (i = 0; i < nvec; i++) {
+		r = apk_ostream_write(os, vec[i].iov_base, vec[i].iov_len);
+		if (r < 0) return r;
+		size += r;
+	}
+	return size;
+}
+
 size_t apk_ostream_write_string(struct apk_ostream *os, const char *string)
 {
 	size_t len;
@@ -1060,11 +1574,17 @@ static struct cache_item *idcache_by_name(struct apk_id_hash *hash, apk_blob_t n
 {
 	struct cache_item *ci;
 	struct hlist_node *pos;
-	unsigned long h = apk_blob_hash(name);
+	unsigned long h;
+
+	/* Archive entries mostly repeat the previous owner */
+	ci = hash->last;
+	if (ci && apk_blob_compare(name, APK_BLOB_PTR_LEN(ci->name, ci->len)) == 0)
+		return ci;
 
+	h = apk_blob_hash(name);
 	hlist_for_each_entry(ci, pos, &hash->by_name[h % ARRAY_SIZE(hash->by_name)], by_name)
 		if (apk_blob_compare(name, APK_BLOB_PTR_LEN(ci->name, ci->len)) == 0)
-			return ci;
+			return hash->last = ci;
 	return 0;
 }
 
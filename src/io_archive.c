@@ -53,10 +53,13 @@ struct tar_header {
 #define GET_OCTAL(s)	get_octal(s, sizeof(s))
 #define PUT_OCTAL(s,v)	put_octal(s, sizeof(s), v)
 
-static unsigned int get_octal(char *s, size_t l)
+static inline unsigned int get_octal(const char *s, size_t l)
 {
-	apk_blob_t b = APK_BLOB_PTR_LEN(s, l);
-	return apk_blob_pull_uint(&b, 8);
+	unsigned int val = 0;
+
+	for (; l && *s >= '0' && *s <= '7'; s++, l--)
+		val = val * 8 + (*s - '0');
+	return val;
 }
 
 static void put_octal(char *s, size_t l, size_t value)
@@ -126,49 +129,74 @@ static void handle_extended_header(struct apk_file_info *fi, apk_blob_t hdr)
 	}
 }
 
+static struct tar_header *tar_get_header(struct apk_istream *is, int *r)
+{
+	struct tar_header *hdr;
+
+	/* The header is used in place from the stream buffer, and is only
+	 * valid until the stream is read again. */
+	hdr = apk_istream_get(is, sizeof *hdr);
+	if (!IS_ERR(hdr)) {
+		*r = sizeof *hdr;
+		return hdr;
+	}
+	if (is->err < 0) *r = is->err;
+	else if (is->ptr != is->end) *r = -EBADMSG;
+	else *r = 0;
+	return NULL;
+}
+
+static char *tar_strcpy(char *dst, const char *src, size_t n)
+{
+	n = strnlen(src, n);
+	memcpy(dst, src, n);
+	dst[n] = 0;
+	return dst;
+}
+
 int apk_tar_parse(struct apk_istream *is, apk_archive_entry_parser parser,
 		  void *ctx, struct apk_id_cache *idc)
 {
 	struct apk_file_info entry;
 	struct apk_segment_istream segment;
-	struct tar_header buf;
+	struct tar_header *buf;
 	int end = 0, r;
 	size_t toskip, paxlen = 0;
 	apk_blob_t pax = APK_BLOB_NULL, longname = APK_BLOB_NULL;
-	char filename[sizeof buf.name + sizeof buf.prefix + 2];
+	char filename[sizeof buf->name + sizeof buf->prefix + 2];
+	char linkname[sizeof buf->linkname + 1];
+	char uname[sizeof buf->uname + 1], gname[sizeof buf->gname + 1];
 
 	if (IS_ERR_OR_NULL(is)) return PTR_ERR(is) ?: -EINVAL;
 
 	memset(&entry, 0, sizeof(entry));
-	entry.name = buf.name;
-	while ((r = apk_istream_read(is, &buf, 512)) == 512) {
-		if (buf.name[0] == '\0') {
+	entry.name = filename;
+	while ((buf = tar_get_header(is, &r)) != NULL) {
+		if (buf->name[0] == '\0') {
 			if (end) break;
 			end++;
 			continue;
 		}
 
 		entry = (struct apk_file_info){
-			.size  = GET_OCTAL(buf.size),
-			.uid   = apk_id_cache_resolve_uid(idc, TAR_BLOB(buf.uname), GET_OCTAL(buf.uid)),
-			.gid   = apk_id_cache_resolve_gid(idc, TAR_BLOB(buf.gname), GET_OCTAL(buf.gid)),
-			.mode  = GET_OCTAL(buf.mode) & 07777,
-			.mtime = GET_OCTAL(buf.mtime),
+			.size  = GET_OCTAL(buf->size),
+			.uid   = apk_id_cache_resolve_uid(idc, TAR_BLOB(buf->uname), GET_OCTAL(buf->uid)),
+			.gid   = apk_id_cache_resolve_gid(idc, TAR_BLOB(buf->gname), GET_OCTAL(buf->gid)),
+			.mode  = GET_OCTAL(buf->mode) & 07777,
+			.mtime = GET_OCTAL(buf->mtime),
 			.name  = entry.name,
-			.uname = buf.uname,
-			.gname = buf.gname,
-			.device = makedev(GET_OCTAL(buf.devmajor),
-					  GET_OCTAL(buf.devminor)),
+			.uname = tar_strcpy(uname, buf->uname, sizeof buf->uname),
+			.gname = tar_strcpy(gname, buf->gname, sizeof buf->gname),
 			.xattrs = entry.xattrs,
 		};
-		if (buf.prefix[0] && buf.typeflag != 'x' && buf.typeflag != 'g') {
-			snprintf(filename, sizeof filename, "%.*s/%.*s",
-				 (int) sizeof buf.prefix, buf.prefix,
-				 (int) sizeof buf.name, buf.name);
-			entry.name = filename;
+		if (entry.name == filename) {
+			if (buf->prefix[0] && buf->typeflag != 'x' && buf->typeflag != 'g')
+				snprintf(filename, sizeof filename, "%.*s/%.*s",
+					 (int) sizeof buf->prefix, buf->prefix,
+					 (int) sizeof buf->name, buf->name);
+			else
+				tar_strcpy(filename, buf->name, sizeof buf->name);
 		}
-		buf.mode[0] = 0; /* to nul terminate 100-byte buf.name */
-		buf.magic[0] = 0; /* to nul terminate 100-byte buf.linkname */
 		apk_xattr_array_resize(&entry.xattrs, 0);
 
 		if (entry.size >= SSIZE_MAX-512) goto err;
@@ -179,7 +207,7 @@ int apk_tar_parse(struct apk_istream *is, apk_archive_entry_parser parser,
 		}
 
 		toskip = (entry.size + 511) & -512;
-		switch (buf.typeflag) {
+		switch (buf->typeflag) {
 		case 'L': /* GNU long name extension */
 			if ((r = blob_realloc(&longname, entry.size+1)) != 0 ||
 			    (r = apk_istream_read(is, longname.ptr, entry.size)) != entry.size)
@@ -196,17 +224,21 @@ int apk_tar_parse(struct apk_istream *is, apk_archive_entry_parser parser,
 			break;
 		case '1': /* hard link */
 			entry.mode |= S_IFREG;
-			if (!entry.link_target) entry.link_target = buf.linkname;
+			if (!entry.link_target)
+				entry.link_target = tar_strcpy(linkname, buf->linkname, sizeof buf->linkname);
 			break;
 		case '2': /* symbolic link */
 			entry.mode |= S_IFLNK;
-			if (!entry.link_target) entry.link_target = buf.linkname;
+			if (!entry.link_target)
+				entry.link_target = tar_strcpy(linkname, buf->linkname, sizeof buf->linkname);
 			break;
 		case '3': /* char device */
 			entry.mode |= S_IFCHR;
+			entry.device = makedev(GET_OCTAL(buf->devmajor), GET_OCTAL(buf->devminor));
 			break;
 		case '4': /* block device */
 			entry.mode |= S_IFBLK;
+			entry.device = makedev(GET_OCTAL(buf->devmajor), GET_OCTAL(buf->devminor));
 			break;
 		case '5': /* directory */
 			entry.mode |= S_IFDIR;
@@ -239,7 +271,7 @@ int apk_tar_parse(struct apk_istream *is, apk_archive_entry_parser parser,
 			if (r != 0) goto err;
 			apk_istream_close(&segment.is);
 
-			entry.name = buf.name;
+			entry.name = filename;
 			toskip -= entry.size;
 			paxlen = 0;
 		}
@@ -251,8 +283,8 @@ int apk_tar_parse(struct apk_istream *is, apk_archive_entry_parser parser,
 	/* Read remaining end-of-archive records, to ensure we read all of
 	 * the file. The underlying istream is likely doing checksumming. */
 	if (r == 512) {
-		while ((r = apk_istream_read(is, &buf, 512)) == 512) {
-			if (buf.name[0] != 0) break;
+		while ((buf = tar_get_header(is, &r)) != NULL) {
+			if (buf->name[0] != 0) break;
 		}
 	}
 	if (r == 0) goto ok;
@@ -8,9 +8,11 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include "apk_defines.h"
@@ -20,6 +22,10 @@ struct apk_gzip_istream {
 	struct apk_istream is;
 	struct apk_istream *zis;
 	z_stream zs;
+	void *zstd;
+	unsigned int member_start : 1;
+	unsigned int member_zstd : 1;
+	unsigned int zstd_flush : 1;
 
 	apk_multipart_cb cb;
 	void *cbctx;
@@ -44,6 +50,46 @@ static int gzi_boundary_change(struct apk_gzip_istream *gis)
 	return r;
 }
 
+/* Each member is gzip or a zstd frame, so that a gzip signature can
+ * be prepended to zstd compressed data. */
+static int gzi_member_start(struct apk_gzip_istream *gis)
+{
+	static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	gis->member_start = 0;
+	gis->member_zstd = memcmp(gis->zs.next_in, zstd_magic, min(gis->zs.avail_in, (uInt) sizeof zstd_magic)) == 0;
+	if (!gis->member_zstd) return 0;
+#ifdef HAVE_ZSTD
+	if (!gis->zstd) gis->zstd = apk_zstd_decoder_new();
+	return gis->zstd ? 0 : -ENOMEM;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int gzi_zstd_inflate(struct apk_gzip_istream *gis)
+{
+#ifdef HAVE_ZSTD
+	const uint8_t *in = gis->zs.next_in;
+	uint8_t *out = gis->zs.next_out;
+	size_t in_len = gis->zs.avail_in, out_len = gis->zs.avail_out;
+	int r;
+
+	r = apk_zstd_decode(gis->zstd, &in, &in_len, &out, &out_len);
+	gis->zs.next_in = (void *) in;
+	gis->zs.avail_in = in_len;
+	gis->zs.next_out = out;
+	gis->zs.avail_out = out_len;
+	/* With the output full, the decoder may hold more of the frame
+	 * and is called again before more input is read */
+	gis->zstd_flush = r == 0 && out_len == 0;
+	if (r < 0) return Z_DATA_ERROR;
+	return r ? Z_STREAM_END : Z_OK;
+#else
+	return Z_DATA_ERROR;
+#endif
+}
+
 static ssize_t gzi_read(struct apk_istream *is, void *ptr, size_t size)
 {
 	struct apk_gzip_istream *gis = container_of(is, struct apk_gzip_istream, is);
@@ -58,7 +104,7 @@ static ssize_t gzi_read(struct apk_istream *is, void *ptr, size_t size)
 				goto ret;
 			gis->cbarg = APK_BLOB_NULL;
 		}
-		if (gis->zs.avail_in == 0) {
+		if (gis->zs.avail_in == 0 && !gis->zstd_flush) {
 			apk_blob_t blob;
 
 			if (gis->cb != NULL && gis->cbprev != NULL &&
@@ -75,18 +121,32 @@ static ssize_t gzi_read(struct apk_istream *is, void *ptr, size_t size)
 				gis->is.err = blob.len;
 				goto ret;
 			} else if (gis->zs.avail_in == 0) {
-				gis->is.err = 1;
+				/* A zstd frame cut short is truncated input */
+				gis->is.err = gis->member_zstd && !gis->member_start ? -EIO : 1;
 				gis->cbarg = APK_BLOB_NULL;
 				gzi_boundary_change(gis);
 				goto ret;
 			}
 		}
 
-		r = inflate(&gis->zs, Z_NO_FLUSH);
+		if (gis->member_start) {
+			r = gzi_member_start(gis);
+			if (r < 0) {
+				gis->is.err = r;
+				break;
+			}
+		}
+		if (gis->member_zstd)
+			r = gzi_zstd_inflate(gis);
+		else
+			r = inflate(&gis->zs, Z_NO_FLUSH);
 		switch (r) {
 		case Z_STREAM_END:
-			/* Digest the inflated bytes */
-			if (gis->zis->err && gis->zs.avail_in == 0)
+			/* Digest the inflated bytes. A clean end of input is
+			 * handled on the next read like with streamed input, so
+			 * that the final boundary is not signalled before the
+			 * data of a fully buffered (mmapped) member is read. */
+			if (gis->zis->err < 0 && gis->zs.avail_in == 0)
 				gis->is.err = gis->zis->err;
 			if (gis->cb != NULL) {
 				gis->cbarg = APK_BLOB_PTR_LEN(gis->cbprev, (void *) gis->zs.next_in - gis->cbprev); 
@@ -101,9 +161,9 @@ static ssize_t gzi_read(struct apk_istream *is, void *ptr, size_t size)
 				gzi_boundary_change(gis);
 				goto ret;
 			}
-			inflateEnd(&gis->zs);
-			if (inflateInit2(&gis->zs, 15+32) != Z_OK)
+			if (!gis->member_zstd && inflateReset(&gis->zs) != Z_OK)
 				return -ENOMEM;
+			gis->member_start = 1;
 			if (gis->cb && gis->zs.avail_out != size) goto ret;
 			break;
 		case Z_OK:
@@ -124,6 +184,9 @@ static int gzi_close(struct apk_istream *is)
 	struct apk_gzip_istream *gis = container_of(is, struct apk_gzip_istream, is);
 
 	inflateEnd(&gis->zs);
+#ifdef HAVE_ZSTD
+	if (gis->zstd) apk_zstd_decoder_free(gis->zstd);
+#endif
 	r = apk_istream_close(gis->zis);
 	free(gis);
 	return r;
@@ -149,6 +212,7 @@ struct apk_istream *apk_istream_gunzip_mpart(struct apk_istream *is, apk_multipa
 		.is.buf = (uint8_t*)(gis + 1),
 		.is.buf_size = apk_io_bufsize,
 		.zis = is,
+		.member_start = 1,
 		.cb = cb,
 		.cbctx = ctx,
 	};
@@ -251,3 +315,275 @@ err:
 	return ERR_PTR(-ENOMEM);
 }
 
+
+/* Parallel gzip compression. The input is cut in fixed size blocks that
+ * are deflated independently, each primed with the last 32k of input
+ * preceding it, and flushed to a byte boundary. The raw deflate outputs
+ * are concatenated in order into a single gzip member. As the block
+ * boundaries do not depend on the number of threads, the result is the
+ * same for any thread count above one. */
+
+#define GZ_MT_BLOCK_SIZE	(128*1024)
+#define GZ_MT_DICT_SIZE		(32*1024)
+
+enum {
+	GZ_JOB_FREE = 0,
+	GZ_JOB_QUEUED,
+	GZ_JOB_RUNNING,
+	GZ_JOB_DONE,
+};
+
+struct apk_gzip_job {
+	int state, last, rc;
+	unsigned long seq;
+	uLong crc;
+	size_t dict_len, in_len, out_len, out_size;
+	unsigned char *out;
+	unsigned char in[GZ_MT_DICT_SIZE + GZ_MT_BLOCK_SIZE];
+};
+
+struct apk_gzip_mt_ostream {
+	struct apk_ostream os;
+	struct apk_ostream *output;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued, done;
+	unsigned int num_threads, num_jobs, quit;
+	pthread_t *threads;
+	struct apk_gzip_job *jobs;
+	unsigned long seq;
+	unsigned int cur;
+	uLong crc, size;
+	int rc;
+};
+
+static int gzo_mt_deflate(z_stream *zs, struct apk_gzip_job *job)
+{
+	int r;
+
+	if (deflateReset(zs) != Z_OK) return -EIO;
+	if (job->dict_len && deflateSetDictionary(zs, job->in, job->dict_len) != Z_OK)
+		return -EIO;
+
+	zs->next_in = &job->in[job->dict_len];
+	zs->avail_in = job->in_len;
+	job->out_len = 0;
+	do {
+		if (job->out_len == job->out_size) {
+			size_t sz = job->out_size ? job->out_size * 2 : deflateBound(zs, job->in_len) + 16;
+			unsigned char *out = realloc(job->out, sz);
+			if (!out) return -ENOMEM;
+			job->out = out;
+			job->out_size = sz;
+		}
+		zs->next_out = &job->out[job->out_len];
+		zs->avail_out = job->out_size - job->out_len;
+		r = deflate(zs, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+		job->out_len = job->out_size - zs->avail_out;
+		if (r == Z_STREAM_ERROR) return -EIO;
+		if (r == Z_BUF_ERROR && zs->avail_out) return -EIO;
+	} while (zs->avail_out == 0 || (job->last && r != Z_STREAM_END));
+
+	job->crc = crc32(crc32(0L, Z_NULL, 0), &job->in[job->dict_len], job->in_len);
+	return 0;
+}
+
+static void *gzo_mt_worker(void *ctx)
+{
+	struct apk_gzip_mt_ostream *gos = ctx;
+	struct apk_gzip_job *job;
+	z_stream zs = {0};
+	int zok;
+	unsigned int i;
+
+	zok = deflateInit2(&zs, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	pthread_mutex_lock(&gos->mutex);
+	while (1) {
+		job = NULL;
+		for (i = 0; i < gos->num_jobs; i++) {
+			struct apk_gzip_job *j = &gos->jobs[i];
+			if (j->state != GZ_JOB_QUEUED) continue;
+			if (!job || j->seq < job->seq) job = j;
+		}
+		if (!job) {
+			if (gos->quit) break;
+			pthread_cond_wait(&gos->queued, &gos->mutex);
+			continue;
+		}
+		job->state = GZ_JOB_RUNNING;
+		pthread_mutex_unlock(&gos->mutex);
+
+		job->rc = zok ? gzo_mt_deflate(&zs, job) : -ENOMEM;
+
+		pthread_mutex_lock(&gos->mutex);
+		job->state = GZ_JOB_DONE;
+		pthread_cond_broadcast(&gos->done);
+	}
+	pthread_mutex_unlock(&gos->mutex);
+
+	if (zok) deflateEnd(&zs);
+	return NULL;
+}
+
+static void gzo_mt_output(struct apk_gzip_mt_ostream *gos, struct apk_gzip_job *job)
+{
+	pthread_mutex_lock(&gos->mutex);
+	while (job->state == GZ_JOB_QUEUED || job->state == GZ_JOB_RUNNING)
+		pthread_cond_wait(&gos->done, &gos->mutex);
+	pthread_mutex_unlock(&gos->mutex);
+
+	if (job->state != GZ_JOB_DONE) return;
+	job->state = GZ_JOB_FREE;
+	if (gos->rc) return;
+	if (job->rc) {
+		gos->rc = job->rc;
+		return;
+	}
+	if (apk_ostream_write(gos->output, job->out, job->out_len) != job->out_len) {
+		gos->rc = -EIO;
+		return;
+	}
+	gos->crc = crc32_combine(gos->crc, job->crc, job->in_len);
+	gos->size += job->in_len;
+}
+
+static void gzo_mt_queue(struct apk_gzip_mt_ostream *gos, int last)
+{
+	struct apk_gzip_job *job = &gos->jobs[gos->cur], *next;
+	size_t dict_len;
+
+	job->last = last;
+	job->seq = gos->seq++;
+	pthread_mutex_lock(&gos->mutex);
+	job->state = GZ_JOB_QUEUED;
+	pthread_cond_signal(&gos->queued);
+	pthread_mutex_unlock(&gos->mutex);
+	if (last) return;
+
+	/* Wait for the oldest block and prime the next one with the
+	 * tail of the data just queued */
+	gos->cur = (gos->cur + 1) % gos->num_jobs;
+	next = &gos->jobs[gos->cur];
+	gzo_mt_output(gos, next);
+
+	dict_len = min((size_t) GZ_MT_DICT_SIZE, job->dict_len + job->in_len);
+	memcpy(next->in, &job->in[job->dict_len + job->in_len - dict_len], dict_len);
+	next->dict_len = dict_len;
+	next->in_len = 0;
+}
+
+static ssize_t gzo_mt_write(struct apk_ostream *os, const void *ptr, size_t size)
+{
+	struct apk_gzip_mt_ostream *gos = container_of(os, struct apk_gzip_mt_ostream, os);
+	struct apk_gzip_job *job;
+	size_t left = size, n;
+
+	while (left && !gos->rc) {
+		job = &gos->jobs[gos->cur];
+		n = min(left, GZ_MT_BLOCK_SIZE - job->in_len);
+		memcpy(&job->in[job->dict_len + job->in_len], ptr, n);
+		job->in_len += n;
+		ptr += n;
+		left -= n;
+		if (job->in_len == GZ_MT_BLOCK_SIZE) gzo_mt_queue(gos, 0);
+	}
+	if (gos->rc) return gos->rc;
+	return size;
+}
+
+static int gzo_mt_close(struct apk_ostream *os)
+{
+	struct apk_gzip_mt_ostream *gos = container_of(os, struct apk_gzip_mt_ostream, os);
+	unsigned char trailer[8];
+	unsigned int i;
+	int r, rc;
+
+	gzo_mt_queue(gos, 1);
+	for (i = 1; i <= gos->num_jobs; i++)
+		gzo_mt_output(gos, &gos->jobs[(gos->cur + i) % gos->num_jobs]);
+
+	pthread_mutex_lock(&gos->mutex);
+	gos->quit = 1;
+	pthread_cond_broadcast(&gos->queued);
+	pthread_mutex_unlock(&gos->mutex);
+	for (i = 0; i < gos->num_threads; i++)
+		pthread_join(gos->threads[i], NULL);
+
+	for (i = 0; i < 4; i++) {
+		trailer[i] = gos->crc >> (8*i);
+		trailer[4+i] = gos->size >> (8*i);
+	}
+	rc = gos->rc;
+	if (!rc && apk_ostream_write(gos->output, trailer, sizeof trailer) != sizeof trailer)
+		rc = -EIO;
+	r = apk_ostream_close(gos->output);
+	if (r != 0) rc = r;
+
+	for (i = 0; i < gos->num_jobs; i++)
+		free(gos->jobs[i].out);
+	pthread_cond_destroy(&gos->queued);
+	pthread_cond_destroy(&gos->done);
+	pthread_mutex_destroy(&gos->mutex);
+	free(gos->threads);
+	free(gos->jobs);
+	free(gos);
+
+	return rc;
+}
+
+static const struct apk_ostream_ops gzip_mt_ostream_ops = {
+	.write = gzo_mt_write,
+	.close = gzo_mt_close,
+};
+
+struct apk_ostream *apk_ostream_gzip_threads(struct apk_ostream *output, unsigned int threads)
+{
+	/* Header as written by zlib for level 9: no mtime, unix */
+	static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 3 };
+	struct apk_gzip_mt_ostream *gos;
+	unsigned int i;
+
+	if (threads <= 1) return apk_ostream_gzip(output);
+	if (IS_ERR_OR_NULL(output)) return ERR_CAST(output);
+	threads = min(threads, APK_GZIP_THREADS_MAX);
+
+	gos = calloc(1, sizeof *gos);
+	if (!gos) goto err;
+
+	*gos = (struct apk_gzip_mt_ostream) {
+		.os.ops = &gzip_mt_ostream_ops,
+		.output = output,
+		.num_jobs = 2 * threads,
+		.crc = crc32(0L, Z_NULL, 0),
+	};
+	gos->jobs = calloc(gos->num_jobs, sizeof gos->jobs[0]);
+	gos->threads = calloc(threads, sizeof gos->threads[0]);
+	if (!gos->jobs || !gos->threads) goto err_free;
+
+	pthread_mutex_init(&gos->mutex, NULL);
+	pthread_cond_init(&gos->queued, NULL);
+	pthread_cond_init(&gos->done, NULL);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&gos->threads[i], NULL, gzo_mt_worker, gos) != 0)
+			break;
+		gos->num_threads++;
+	}
+	if (!gos->num_threads) {
+		pthread_cond_destroy(&gos->queued);
+		pthread_cond_destroy(&gos->done);
+		pthread_mutex_destroy(&gos->mutex);
+		goto err_free;
+	}
+
+	if (apk_ostream_write(output, header, sizeof header) != sizeof header)
+		gos->rc = -EIO;
+
+	return &gos->os;
+err_free:
+	free(gos->jobs);
+	free(gos->threads);
+	free(gos);
+err:
+	apk_ostream_close(output);
+	return ERR_PTR(-ENOMEM);
+}
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #include <fetch.h>
 
@@ -101,7 +102,7 @@ static const struct apk_istream_ops fetch_istream_ops = {
 	.close = fetch_close,
 };
 
-static struct apk_istream *apk_istream_fetch(const char *url, time_t since)
+static struct apk_istream *apk_istream_fetch(const char *url, time_t since, off_t *offset, time_t validator)
 {
 	struct apk_fetch_istream *fis = NULL;
 	struct url *u;
@@ -120,7 +121,12 @@ static struct apk_istream *apk_istream_fetch(const char *url, time_t since)
 		goto err;
 	}
 
-	if (since != APK_ISTREAM_FORCE_REFRESH) {
+	if (offset && *offset > 0) {
+		/* Continue from offset if the content is unchanged */
+		u->offset = *offset;
+		u->last_modified = validator;
+		flags = since != APK_ISTREAM_FORCE_REFRESH ? "r" : "Cr";
+	} else if (since != APK_ISTREAM_FORCE_REFRESH) {
 		u->last_modified = since;
 		flags = "i";
 	}
@@ -130,6 +136,7 @@ static struct apk_istream *apk_istream_fetch(const char *url, time_t since)
 		rc = fetch_maperror(fetchLastErrCode);
 		goto err;
 	}
+	if (offset) *offset = u->offset;
 
 	*fis = (struct apk_fetch_istream) {
 		.is.ops = &fetch_istream_ops,
@@ -152,5 +159,185 @@ struct apk_istream *apk_istream_from_fd_url_if_modified(int atfd, const char *ur
 {
 	if (apk_url_local_file(url) != NULL)
 		return apk_istream_from_file(atfd, apk_url_local_file(url));
-	return apk_istream_fetch(url, since);
+	return apk_istream_fetch(url, since, NULL, 0);
+}
+
+struct apk_istream *apk_istream_from_fd_url_range(int atfd, const char *url, time_t since,
+						  off_t *offset, time_t validator)
+{
+	if (apk_url_local_file(url) != NULL) {
+		*offset = 0;
+		return apk_istream_from_file(atfd, apk_url_local_file(url));
+	}
+	return apk_istream_fetch(url, since, offset, validator);
+}
+
+/* Range download. The remainder of an object of known size is split into
+ * chunks which worker threads fetch with bounded range requests and write
+ * in place. Each request takes its connection from the libfetch connection
+ * cache, so the workers keep reusing up to its per-host limit of
+ * keep-alive connections. The Last-Modified of the first response, or of
+ * the partial file being resumed, is sent as If-Range with every request
+ * so all ranges come from the same version of the object. */
+
+#define APK_FETCH_RANGE_MIN	(1024*1024)
+
+struct apk_fetch_ranges {
+	const char *url;
+	int fd, err;
+	off_t size, next, done, chunk;
+	time_t since, validator;
+	unsigned int running;
+	pthread_mutex_t mutex;
+	pthread_cond_t progress;
+};
+
+static int fetch_range(struct apk_fetch_ranges *fr, off_t offset, off_t length, void *buf)
+{
+	struct url *u;
+	struct url_stat us;
+	const char *flags;
+	fetchIO *io;
+	ssize_t r;
+	int rc = 0;
+
+	u = fetchParseURL(fr->url);
+	if (!u) return -EAPKBADURL;
+	u->offset = offset;
+	u->length = length;
+
+	pthread_mutex_lock(&fr->mutex);
+	u->last_modified = fr->validator;
+	pthread_mutex_unlock(&fr->mutex);
+	if (u->last_modified) {
+		flags = fr->since != APK_ISTREAM_FORCE_REFRESH ? "r" : "Cr";
+	} else if (fr->since != APK_ISTREAM_FORCE_REFRESH) {
+		u->last_modified = fr->since;
+		flags = "i";
+	} else {
+		flags = "C";
+	}
+
+	io = fetchXGet(u, &us, flags);
+	if (!io) {
+		rc = fetch_maperror(fetchLastErrCode);
+		goto err;
+	}
+	/* Servers without range support, or an object that changed since
+	 * the validator, return the whole object */
+	if (u->offset != offset || u->length != length || us.size != fr->size) {
+		rc = -EPROTO;
+		goto err_io;
+	}
+	pthread_mutex_lock(&fr->mutex);
+	if (!fr->validator) fr->validator = us.mtime;
+	else if (us.mtime != fr->validator) rc = -EPROTO;
+	pthread_mutex_unlock(&fr->mutex);
+	if (rc) goto err_io;
+
+	while (length > 0) {
+		r = fetchIO_read(io, buf, min((off_t) apk_io_bufsize, length));
+		if (r <= 0) {
+			rc = -EIO;
+			break;
+		}
+		if (pwrite(fr->fd, buf, r, offset) != r) {
+			rc = -ENOSPC;
+			break;
+		}
+		offset += r;
+		length -= r;
+
+		pthread_mutex_lock(&fr->mutex);
+		fr->done += r;
+		if (fr->err) rc = fr->err;
+		pthread_cond_signal(&fr->progress);
+		pthread_mutex_unlock(&fr->mutex);
+		if (rc) break;
+	}
+err_io:
+	fetchIO_close(io);
+err:
+	fetchFreeURL(u);
+	return rc;
+}
+
+static void *fetch_range_worker(void *arg)
+{
+	struct apk_fetch_ranges *fr = arg;
+	off_t offset, length;
+	void *buf;
+	int r;
+
+	buf = malloc(apk_io_bufsize);
+
+	pthread_mutex_lock(&fr->mutex);
+	if (!buf) fr->err = -ENOMEM;
+	while (!fr->err && fr->next < fr->size) {
+		offset = fr->next;
+		length = min(fr->size - offset, fr->chunk);
+		fr->next += length;
+		pthread_mutex_unlock(&fr->mutex);
+
+		r = fetch_range(fr, offset, length, buf);
+
+		pthread_mutex_lock(&fr->mutex);
+		if (r < 0 && !fr->err) fr->err = r;
+	}
+	fr->running--;
+	pthread_cond_signal(&fr->progress);
+	pthread_mutex_unlock(&fr->mutex);
+
+	free(buf);
+	return NULL;
+}
+
+int apk_url_fetch_ranges(const char *url, int fd, off_t offset, off_t size, unsigned int connections,
+			 time_t since, time_t validator, struct apk_file_meta *meta,
+			 apk_progress_cb cb, void *cb_ctx)
+{
+	struct apk_fetch_ranges fr = {
+		.url = url,
+		.fd = fd,
+		.size = size,
+		.next = offset,
+		.done = offset,
+		.since = since,
+		.validator = validator,
+		/* Several chunks per connection even out their speeds */
+		.chunk = max((size - offset) / (connections * 4), (off_t) APK_FETCH_RANGE_MIN),
+	};
+	pthread_t threads[connections];
+	unsigned int i, n = 0;
+	off_t done;
+
+	if (strncmp(url, "http:", 5) != 0 && strncmp(url, "https:", 6) != 0)
+		return -ENOTSUP;
+
+	pthread_mutex_init(&fr.mutex, NULL);
+	pthread_cond_init(&fr.progress, NULL);
+
+	pthread_mutex_lock(&fr.mutex);
+	for (i = 0; i < connections; i++) {
+		if (pthread_create(&threads[n], NULL, fetch_range_worker, &fr) != 0) break;
+		fr.running = ++n;
+	}
+	if (n == 0) fr.err = -EAGAIN;
+	while (fr.running) {
+		pthread_cond_wait(&fr.progress, &fr.mutex);
+		done = fr.done;
+		pthread_mutex_unlock(&fr.mutex);
+		if (cb) cb(cb_ctx, done);
+		pthread_mutex_lock(&fr.mutex);
+	}
+	pthread_mutex_unlock(&fr.mutex);
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&fr.progress);
+	pthread_mutex_destroy(&fr.mutex);
+
+	if (fr.err) return fr.err;
+	if (meta) *meta = (struct apk_file_meta) { .atime = fr.validator, .mtime = fr.validator };
+	return 0;
 }
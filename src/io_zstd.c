@@ -0,0 +1,133 @@
+/* io_zstd.c - Alpine Package Keeper (APK)
+ *
+ * Copyright (C) 2008-2011 Timo Teräs <timo.teras@iki.fi>
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <zstd.h>
+
+#include "apk_defines.h"
+#include "apk_io.h"
+
+/* Zstandard streams. A zstd frame is the counterpart of a gzip member:
+ * the multipart reader in io_gunzip.c decodes zstd frames with these,
+ * so that both kinds of members can be mixed in one stream. */
+
+void *apk_zstd_decoder_new(void)
+{
+	return ZSTD_createDCtx();
+}
+
+void apk_zstd_decoder_free(void *dec)
+{
+	ZSTD_freeDCtx(dec);
+}
+
+/* Decodes from *in to *out and advances both. Returns 1 when a frame
+ * was completely decoded and flushed, 0 if more input or output space
+ * is needed, or a negative error. */
+int apk_zstd_decode(void *dec, const uint8_t **in, size_t *in_len, uint8_t **out, size_t *out_len)
+{
+	ZSTD_inBuffer ib = { .src = *in, .size = *in_len };
+	ZSTD_outBuffer ob = { .dst = *out, .size = *out_len };
+	size_t r;
+
+	r = ZSTD_decompressStream(dec, &ob, &ib);
+	*in += ib.pos;
+	*in_len -= ib.pos;
+	*out += ob.pos;
+	*out_len -= ob.pos;
+	if (ZSTD_isError(r)) return -EIO;
+	return r == 0;
+}
+
+struct apk_zstd_ostream {
+	struct apk_ostream os;
+	struct apk_ostream *output;
+	ZSTD_CCtx *ctx;
+	size_t buf_size;
+	uint8_t buf[];
+};
+
+static int zo_compress(struct apk_zstd_ostream *zos, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{
+	ZSTD_outBuffer out;
+	size_t r;
+
+	do {
+		out = (ZSTD_outBuffer) { .dst = zos->buf, .size = zos->buf_size };
+		r = ZSTD_compressStream2(zos->ctx, &out, in, mode);
+		if (ZSTD_isError(r)) return -EIO;
+		if (out.pos != 0 &&
+		    apk_ostream_write(zos->output, zos->buf, out.pos) != out.pos)
+			return -EIO;
+	} while (mode == ZSTD_e_end ? r != 0 : in->pos != in->size);
+
+	return 0;
+}
+
+static ssize_t zo_write(struct apk_ostream *os, const void *ptr, size_t size)
+{
+	struct apk_zstd_ostream *zos = container_of(os, struct apk_zstd_ostream, os);
+	ZSTD_inBuffer in = { .src = ptr, .size = size };
+	int r;
+
+	r = zo_compress(zos, &in, ZSTD_e_continue);
+	if (r < 0) return r;
+	return size;
+}
+
+static int zo_close(struct apk_ostream *os)
+{
+	struct apk_zstd_ostream *zos = container_of(os, struct apk_zstd_ostream, os);
+	ZSTD_inBuffer in = {};
+	int r, rc;
+
+	rc = zo_compress(zos, &in, ZSTD_e_end);
+	r = apk_ostream_close(zos->output);
+	if (r != 0) rc = r;
+
+	ZSTD_freeCCtx(zos->ctx);
+	free(zos);
+
+	return rc;
+}
+
+static const struct apk_ostream_ops zstd_ostream_ops = {
+	.write = zo_write,
+	.close = zo_close,
+};
+
+struct apk_ostream *apk_ostream_zstd(struct apk_ostream *output, int level)
+{
+	struct apk_zstd_ostream *zos;
+	size_t buf_size = ZSTD_CStreamOutSize();
+
+	if (IS_ERR_OR_NULL(output)) return ERR_CAST(output);
+
+	zos = malloc(sizeof(*zos) + buf_size);
+	if (zos == NULL) goto err;
+
+	*zos = (struct apk_zstd_ostream) {
+		.os.ops = &zstd_ostream_ops,
+		.output = output,
+		.ctx = ZSTD_createCCtx(),
+		.buf_size = buf_size,
+	};
+	if (!zos->ctx ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(zos->ctx, ZSTD_c_compressionLevel, level)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(zos->ctx, ZSTD_c_checksumFlag, 1))) {
+		ZSTD_freeCCtx(zos->ctx);
+		free(zos);
+		goto err;
+	}
+
+	return &zos->os;
+err:
+	apk_ostream_close(output);
+	return ERR_PTR(-ENOMEM);
+}
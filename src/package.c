@@ -16,6 +16,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 
@@ -933,7 +934,7 @@ int apk_pkg_read(struct apk_database *db, const char *file,
 	ctx.pkg->size = fi.size;
 
 	r = apk_tar_parse(
-		apk_istream_gunzip_mpart(apk_istream_from_file(AT_FDCWD, file), apk_sign_ctx_mpart_cb, sctx),
+		apk_istream_decompress_mpart(apk_istream_from_file(AT_FDCWD, file), apk_sign_ctx_mpart_cb, sctx),
 		read_info_entry, &ctx, db->id_cache);
 	if (r < 0 && r != -ECANCELED)
 		goto err;
@@ -996,42 +997,107 @@ int apk_ipkg_add_script(struct apk_installed_package *ipkg,
 	return 0;
 }
 
-void apk_ipkg_run_script(struct apk_installed_package *ipkg,
-			 struct apk_database *db,
-			 unsigned int type, char **argv)
+static int script_memfd_usable(struct apk_database *db)
+{
+	struct stat st;
+
+	/* The interpreter opens an fexecve()d script via /dev/fd, so the
+	 * target root needs /dev/fd and a mounted /proc. */
+	if (!(db->ctx->flags & APK_SCRIPTS_MEMFD)) return 0;
+	if (!db->script_memfd_checked) {
+		db->script_memfd_checked = 1;
+		db->script_memfd =
+			fstatat(db->root_fd, "dev/fd", &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+			faccessat(db->root_fd, "proc/self/fd", F_OK, 0) == 0;
+	}
+	return db->script_memfd;
+}
+
+static int script_memfd(struct apk_database *db, const char *name, apk_blob_t script)
+{
+#ifdef MFD_CLOEXEC
+	int fd;
+
+	if (!script_memfd_usable(db)) return -1;
+
+	/* Close-on-exec so that concurrently spawned scripts do not
+	 * inherit it; the child clears the flag before fexecve() */
+#ifdef MFD_EXEC
+	fd = memfd_create(name, MFD_EXEC | MFD_CLOEXEC);
+	if (fd < 0 && errno == EINVAL)
+#endif
+		fd = memfd_create(name, MFD_CLOEXEC);
+	if (fd < 0) return -1;
+	if (write(fd, script.ptr, script.len) != script.len) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+static int ipkg_write_script(struct apk_installed_package *ipkg,
+			     struct apk_database *db,
+			     unsigned int type, char **argv, char fn[static PATH_MAX],
+			     int *script_fd)
 {
-	struct apk_out *out = &db->ctx->out;
 	struct apk_package *pkg = ipkg->pkg;
-	char fn[PATH_MAX];
-	int fd, root_fd = db->root_fd;
+	int fd, r, root_fd = db->root_fd;
 
 	if (type >= APK_SCRIPT_MAX || ipkg->script[type].ptr == NULL)
-		return;
+		return 0;
 
 	argv[0] = (char *) apk_script_types[type];
 
 	/* Avoid /tmp as it can be mounted noexec */
-	snprintf(fn, sizeof(fn), "var/cache/misc/" PKG_VER_FMT ".%s",
+	snprintf(fn, PATH_MAX, "var/cache/misc/" PKG_VER_FMT ".%s",
 		PKG_VER_PRINTF(pkg),
 		apk_script_types[type]);
 
 	if ((db->ctx->flags & (APK_NO_SCRIPTS | APK_SIMULATE)) != 0)
-		return;
+		return 0;
+
+	*script_fd = script_memfd(db, &fn[15], ipkg->script[type]);
+	if (*script_fd >= 0) return 1;
 
-	apk_msg(out, "Executing %s", &fn[15]);
 	fd = openat(root_fd, fn, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0755);
 	if (fd < 0) {
 		mkdirat(root_fd, "var/cache/misc", 0755);
 		fd = openat(root_fd, fn, O_CREAT|O_RDWR|O_TRUNC|O_CLOEXEC, 0755);
-		if (fd < 0) goto err_log;
+		if (fd < 0) return -errno;
 	}
 	if (write(fd, ipkg->script[type].ptr, ipkg->script[type].len) < 0) {
+		r = -errno;
 		close(fd);
-		goto err_log;
+		return r;
 	}
 	close(fd);
+	return 1;
+}
+
+static void ipkg_cleanup_script(struct apk_database *db, const char *fn, int script_fd)
+{
+	if (script_fd >= 0) close(script_fd);
+	else unlinkat(db->root_fd, fn, 0);
+}
+
+void apk_ipkg_run_script(struct apk_installed_package *ipkg,
+			 struct apk_database *db,
+			 unsigned int type, char **argv)
+{
+	struct apk_out *out = &db->ctx->out;
+	char fn[PATH_MAX];
+	int r, script_fd = -1;
 
-	if (apk_db_run_script(db, fn, argv) < 0)
+	r = ipkg_write_script(ipkg, db, type, argv, fn, &script_fd);
+	if (r == 0) return;
+
+	apk_msg(out, "Executing %s", &fn[15]);
+	if (r < 0) goto err_log;
+
+	if (apk_db_run_script(db, script_fd, fn, argv) < 0)
 		goto err;
 
 	/* Script may have done something that changes id cache contents */
@@ -1040,11 +1106,75 @@ void apk_ipkg_run_script(struct apk_installed_package *ipkg,
 	goto cleanup;
 
 err_log:
-	apk_err(out, "%s: failed to execute: %s", &fn[15], apk_error_str(errno));
+	apk_err(out, "%s: failed to execute: %s", &fn[15], apk_error_str(r));
 err:
 	ipkg->broken_script = 1;
 cleanup:
-	unlinkat(root_fd, fn, 0);
+	ipkg_cleanup_script(db, fn, script_fd);
+}
+
+pid_t apk_ipkg_spawn_script(struct apk_installed_package *ipkg,
+			    struct apk_database *db,
+			    unsigned int type, char **argv, int out_fd, int err_fd)
+{
+	struct apk_out *out = &db->ctx->out;
+	char fn[PATH_MAX];
+	pid_t pid = -1;
+	int r, script_fd = -1;
+
+	r = ipkg_write_script(ipkg, db, type, argv, fn, &script_fd);
+	if (r == 0) return 0;
+	if (r < 0) {
+		apk_err(out, "%s: failed to execute: %s", &fn[15], apk_error_str(r));
+		goto err;
+	}
+
+	pid = apk_db_spawn_script(db, script_fd, fn, argv, out_fd, err_fd);
+	if (pid > 0) {
+		/* The child holds its own reference to the memfd */
+		if (script_fd >= 0) close(script_fd);
+		return pid;
+	}
+err:
+	ipkg->broken_script = 1;
+	ipkg_cleanup_script(db, fn, script_fd);
+	return -1;
+}
+
+static void ipkg_replay_output(int fd, FILE *f)
+{
+	char buf[1024];
+	ssize_t n;
+
+	if (fd < 0 || lseek(fd, 0, SEEK_SET) != 0) return;
+	fflush(f);
+	while ((n = read(fd, buf, sizeof buf)) > 0)
+		fwrite(buf, 1, n, f);
+	fflush(f);
+}
+
+void apk_ipkg_reap_script(struct apk_installed_package *ipkg,
+			  struct apk_database *db,
+			  unsigned int type, int status, int out_fd, int err_fd)
+{
+	struct apk_out *out = &db->ctx->out;
+	struct apk_package *pkg = ipkg->pkg;
+	char fn[PATH_MAX];
+
+	snprintf(fn, sizeof fn, "var/cache/misc/" PKG_VER_FMT ".%s",
+		PKG_VER_PRINTF(pkg),
+		apk_script_types[type]);
+
+	apk_msg(out, "Executing %s", &fn[15]);
+	ipkg_replay_output(out_fd, out->out);
+	ipkg_replay_output(err_fd, out->err);
+
+	if (apk_db_script_status(db, fn, status) < 0)
+		ipkg->broken_script = 1;
+	else
+		apk_id_cache_reset(db->id_cache);
+
+	unlinkat(db->root_fd, fn, 0);
 }
 
 static int parse_index_line(void *ctx, apk_blob_t line)
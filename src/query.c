@@ -0,0 +1,220 @@
+/* query.c - Alpine Package Keeper (APK)
+ *
+ * Copyright (C) 2005-2008 Natanael Copa <n@tanael.org>
+ * Copyright (C) 2008-2021 Timo Teräs <timo.teras@iki.fi>
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "apk_adb.h"
+#include "apk_package.h"
+#include "apk_query.h"
+#include "apk_print.h"
+
+int apk_query_open(struct apk_query *q, struct apk_ctx *ac)
+{
+	struct apk_out *out = &ac->out;
+	struct apk_trust *trust = apk_ctx_get_trust(ac);
+	struct apk_query_index *ndx;
+	struct adb_obj root;
+	int fd, r;
+
+	*q = (struct apk_query) { .ac = ac };
+	if (IS_ERR(trust)) return PTR_ERR(trust);
+	q->ndx = calloc(ac->index_files->num, sizeof *q->ndx);
+	if (!q->ndx) return -ENOMEM;
+
+	for (; q->num_ndx < ac->index_files->num; q->num_ndx++) {
+		ndx = &q->ndx[q->num_ndx];
+		ndx->url = ac->index_files->item[q->num_ndx];
+		fd = open(ndx->url, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			r = -errno;
+		} else {
+			r = adb_m_map(&ndx->db, fd, ADB_SCHEMA_INDEX, trust);
+			close(fd);
+		}
+		if (r) {
+			apk_err(out, "%s: %s", ndx->url, apk_error_str(r));
+			apk_query_close(q);
+			return r;
+		}
+		adb_ro_obj(adb_r_rootobj(&ndx->db, &root, &schema_index), ADBI_NDX_PACKAGES, &ndx->pkgs);
+	}
+	return 0;
+}
+
+void apk_query_close(struct apk_query *q)
+{
+	for (size_t i = 0; i < q->num_ndx; i++)
+		adb_free(&q->ndx[i].db);
+	free(q->ndx);
+	free(q->pkgs);
+	*q = (struct apk_query) {};
+}
+
+static void query_add(struct apk_query *q, struct apk_query_index *ndx, int slot)
+{
+	struct apk_query_pkg *qp;
+	struct adb_obj obj;
+
+	adb_ro_obj(&ndx->pkgs, slot, &obj);
+	for (qp = q->pkgs; qp < &q->pkgs[q->num_pkgs]; qp++)
+		if (qp->obj.obj == obj.obj) return;
+
+	if (q->num_pkgs == q->max_pkgs) {
+		size_t max = q->max_pkgs ? q->max_pkgs * 2 : 16;
+		qp = realloc(q->pkgs, max * sizeof *qp);
+		if (!qp) return;
+		q->pkgs = qp;
+		q->max_pkgs = max;
+	}
+	q->pkgs[q->num_pkgs++] = (struct apk_query_pkg) { .ndx = ndx, .obj = obj };
+}
+
+static apk_blob_t query_name(struct apk_query_index *ndx)
+{
+	struct adb_obj pkg;
+
+	if (ndx->cur > adb_ra_num(&ndx->pkgs)) return APK_BLOB_NULL;
+	return adb_ro_blob(adb_ro_obj(&ndx->pkgs, ndx->cur, &pkg), ADBI_PI_NAME);
+}
+
+static void query_all(struct apk_query *q, struct apk_string_array *filter, apk_query_match_cb cb, void *ctx)
+{
+	struct apk_query_index *ndx;
+	apk_blob_t name, best;
+	char buf[PATH_MAX];
+	char **pmatch;
+
+	/* Every index is sorted by name, so merging them visits the names
+	 * in order and hands over all versions of a name at once. */
+	for (ndx = q->ndx; ndx < &q->ndx[q->num_ndx]; ndx++)
+		ndx->cur = 1;
+
+	for (;;) {
+		best = APK_BLOB_NULL;
+		for (ndx = q->ndx; ndx < &q->ndx[q->num_ndx]; ndx++) {
+			name = query_name(ndx);
+			if (APK_BLOB_IS_NULL(name)) continue;
+			if (APK_BLOB_IS_NULL(best) || apk_blob_sort(name, best) < 0) best = name;
+		}
+		if (APK_BLOB_IS_NULL(best)) break;
+
+		q->num_pkgs = 0;
+		for (ndx = q->ndx; ndx < &q->ndx[q->num_ndx]; ndx++) {
+			for (; apk_blob_compare(query_name(ndx), best) == 0; ndx->cur++)
+				query_add(q, ndx, ndx->cur);
+		}
+
+		if (filter->num == 0) {
+			cb(q, NULL, best, q->pkgs, q->num_pkgs, ctx);
+			continue;
+		}
+		if (best.len >= sizeof buf) continue;
+		memcpy(buf, best.ptr, best.len);
+		buf[best.len] = 0;
+		foreach_array_item(pmatch, filter) {
+			if (fnmatch(*pmatch, buf, 0) == 0) {
+				cb(q, *pmatch, best, q->pkgs, q->num_pkgs, ctx);
+				break;
+			}
+		}
+	}
+}
+
+void apk_query_foreach_matching(struct apk_query *q, struct apk_string_array *filter, unsigned int match,
+				apk_query_match_cb cb, void *ctx)
+{
+	struct apk_string_array *empty;
+	struct apk_query_index *ndx;
+	apk_blob_t name;
+	char **pmatch;
+
+	if (filter == NULL || filter->num == 0) {
+		if (!(match & APK_FOREACH_NULL_MATCHES_ALL))
+			return;
+		apk_string_array_init(&empty);
+		query_all(q, empty, cb, ctx);
+		apk_string_array_free(&empty);
+		return;
+	}
+	foreach_array_item(pmatch, filter) {
+		if (strchr(*pmatch, '*') != NULL) {
+			query_all(q, filter, cb, ctx);
+			return;
+		}
+	}
+
+	/* Exact names go through the index hash tables, and like in the
+	 * database they also find the packages providing the name. */
+	foreach_array_item(pmatch, filter) {
+		name = APK_BLOB_STR(*pmatch);
+		q->num_pkgs = 0;
+		for (ndx = q->ndx; ndx < &q->ndx[q->num_ndx]; ndx++) {
+			for (int i = 0; (i = apk_ndx_find(&ndx->pkgs, APK_NDX_HASH_NAME, name, i)) > 0; )
+				query_add(q, ndx, i);
+			for (int i = 0; (i = apk_ndx_find(&ndx->pkgs, APK_NDX_HASH_PROVIDES, name, i)) > 0; )
+				query_add(q, ndx, i);
+		}
+		cb(q, *pmatch, q->num_pkgs ? name : APK_BLOB_NULL, q->pkgs, q->num_pkgs, ctx);
+	}
+}
+
+void apk_query_foreach_rdepend(struct apk_query *q, apk_blob_t name,
+			       void (*cb)(struct apk_query *q, struct apk_query_pkg *pkg, void *ctx),
+			       void *ctx)
+{
+	struct apk_query_index *ndx;
+	struct apk_query_pkg qp;
+	struct adb_obj deps, dep;
+
+	for (ndx = q->ndx; ndx < &q->ndx[q->num_ndx]; ndx++) {
+		qp.ndx = ndx;
+		for (int i = ADBI_FIRST; i <= adb_ra_num(&ndx->pkgs); i++) {
+			adb_ro_obj(adb_ro_obj(&ndx->pkgs, i, &qp.obj), ADBI_PI_DEPENDS, &deps);
+			for (int j = ADBI_FIRST; j <= adb_ra_num(&deps); j++) {
+				adb_ro_obj(&deps, j, &dep);
+				if (apk_blob_compare(adb_ro_blob(&dep, ADBI_DEP_NAME), name) != 0) continue;
+				cb(q, &qp, ctx);
+				break;
+			}
+		}
+	}
+}
+
+
+/* Option group for querying indexes */
+
+#include "apk_applet.h"
+
+#define QUERY_OPTIONS(OPT) \
+	OPT(OPT_QUERY_from_index,	APK_OPT_ARG "from-index")
+
+APK_OPT_GROUP(options_query, "Query", QUERY_OPTIONS);
+
+static int option_parse_query(void *ctx, struct apk_ctx *ac, int optch, const char *optarg)
+{
+	switch (optch) {
+	case OPT_QUERY_from_index:
+		*apk_string_array_add(&ac->index_files) = (char*) optarg;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+	return 0;
+}
+
+const struct apk_option_group optgroup_query = {
+	.desc = options_query,
+	.parse = option_parse_query,
+};
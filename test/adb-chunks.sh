@@ -0,0 +1,73 @@
+#!/bin/sh
+
+# Writes an index large enough to span several writer chunks and reads
+# every package back. Needs python3 to build the packages.
+
+if ! command -v python3 >/dev/null 2>&1; then
+	echo "SKIP: adb chunks (no python3)"
+	exit 0
+fi
+
+APK="../src/apk --allow-untrusted --no-progress"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+# Descriptions of odd lengths make chunks start at unaligned offsets
+python3 - "$tmp" <<'EOF' || exit 1
+import gzip, hashlib, io, sys, tarfile
+
+def tar(entries, cut):
+	b = io.BytesIO()
+	tf = tarfile.open(fileobj=b, mode='w', format=tarfile.PAX_FORMAT)
+	for name, data in entries:
+		ti = tarfile.TarInfo(name)
+		ti.mtime, ti.mode, ti.uname, ti.gname = 1600000000, 0o644, 'root', 'root'
+		ti.size = len(data)
+		ti.pax_headers = {'APK-TOOLS.checksum.SHA1': hashlib.sha1(data).hexdigest()}
+		tf.addfile(ti, io.BytesIO(data))
+	if cut: return b.getvalue()[:tf.offset]
+	tf.close()
+	return b.getvalue()
+
+for i in range(400):
+	data = gzip.compress(tar([('p%d' % i, b'%d\n' % i)], False), mtime=0)
+	desc = ('package %d ' % i) * (100 + i % 7)
+	info = ('pkgname = p%d\npkgver = 1.%d\npkgdesc = %s\narch = noarch\nsize = 4\n'
+		'origin = p%d\ndatahash = %s\n' % (i, i, desc, i, hashlib.sha256(data).hexdigest()))
+	ctrl = gzip.compress(tar([('.PKGINFO', info.encode())], True), mtime=0)
+	open('%s/p%d-1.%d.apk' % (sys.argv[1], i, i), 'wb').write(ctrl + data)
+EOF
+
+$APK mkndx -o "$tmp/index.adb" "$tmp"/*.apk >/dev/null || { echo "FAIL: mkndx failed"; exit 1; }
+$APK adbdump "$tmp/index.adb" > "$tmp/dump" || { echo "FAIL: adbdump failed"; exit 1; }
+
+python3 - "$tmp/dump" <<'EOF'
+import sys
+pkgs, cur, desc = {}, None, None
+for l in open(sys.argv[1]):
+	l = l.strip()
+	if l.startswith('- name: '):
+		cur = l[8:]
+		pkgs[cur] = {}
+	elif cur and l.startswith('version: '):
+		pkgs[cur]['version'] = l[9:]
+	elif cur and l == 'description: |':
+		desc = pkgs[cur]['description'] = []
+	elif desc is not None and l.startswith('package '):
+		desc.append(l)
+	else:
+		desc = None
+fail = 0
+for i in range(400):
+	p = pkgs.get('p%d' % i)
+	want = ('package %d ' % i) * (100 + i % 7)
+	if not p or p.get('version') != '1.%d' % i or ''.join(p.get('description', [])) != want.strip():
+		print('FAIL: package p%d read back wrong' % i)
+		fail = 1
+if len(pkgs) != 400:
+	print('FAIL: %d packages read back' % len(pkgs))
+	fail = 1
+if not fail:
+	print('OK: adb chunks read back')
+sys.exit(fail)
+EOF
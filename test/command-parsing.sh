@@ -9,6 +9,19 @@ if [ "$help_output" != "$invalid_option_output" ]; then
 	fail=$((fail+1))
 fi
 
+for count in 0 -1 abc 2x; do
+	case "$(../src/apk add --trigger-jobs "$count" 2>&1 >/dev/null)" in
+	*"invalid count"*) ;;
+	*)	echo "FAIL: --trigger-jobs $count accepted"
+		fail=$((fail+1)) ;;
+	esac
+done
+case "$(../src/apk add --trigger-jobs 4 --help 2>&1 >/dev/null)" in
+*"invalid count"*)
+	echo "FAIL: --trigger-jobs 4 rejected"
+	fail=$((fail+1)) ;;
+esac
+
 if [ $fail -eq 0 ]; then
 	echo "OK: command parsing works"
 fi
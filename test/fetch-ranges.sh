@@ -0,0 +1,143 @@
+#!/bin/sh
+
+# Fetches a large package over parallel HTTP ranges from a local stand-in
+# server. Needs python3 for the server and to build the package.
+
+if ! command -v python3 >/dev/null 2>&1; then
+	echo "SKIP: fetch ranges (no python3)"
+	exit 0
+fi
+
+fail=0
+APK="../src/apk --allow-untrusted --no-progress"
+tmp=$(mktemp -d)
+trap 'kill $srv 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+arch=$($APK --print-arch)
+lm="Mon, 01 Jan 2024 00:00:00 GMT"
+
+mkdir -p "$tmp/repo/$arch"
+ARCH=$arch python3 - "$tmp/repo/$arch/big-1.0.apk" "$tmp/blob" <<'EOF' || exit 1
+import gzip, hashlib, io, os, sys, tarfile
+
+def tar(entries, cut):
+	b = io.BytesIO()
+	tf = tarfile.open(fileobj=b, mode='w', format=tarfile.PAX_FORMAT)
+	for name, data in entries:
+		ti = tarfile.TarInfo(name)
+		ti.mtime, ti.mode, ti.uname, ti.gname = 1600000000, 0o644, 'root', 'root'
+		if data is None:
+			ti.type, ti.mode = tarfile.DIRTYPE, 0o755
+			tf.addfile(ti)
+		else:
+			ti.size = len(data)
+			ti.pax_headers = {'APK-TOOLS.checksum.SHA1': hashlib.sha1(data).hexdigest()}
+			tf.addfile(ti, io.BytesIO(data))
+	if cut: return b.getvalue()[:tf.offset]
+	tf.close()
+	return b.getvalue()
+
+blob = os.urandom(12*1024*1024)
+open(sys.argv[2], 'wb').write(blob)
+data = gzip.compress(tar([('usr', None), ('usr/big', blob)], False), mtime=0)
+info = ('pkgname = big\npkgver = 1.0\npkgdesc = test\narch = %s\nsize = %d\n'
+	'origin = big\ndatahash = %s\n' % (os.environ['ARCH'], len(blob), hashlib.sha256(data).hexdigest()))
+ctrl = gzip.compress(tar([('.PKGINFO', info.encode())], True), mtime=0)
+open(sys.argv[1], 'wb').write(ctrl + data)
+EOF
+$APK index -o "$tmp/repo/$arch/APKINDEX.tar.gz" "$tmp/repo/$arch/big-1.0.apk" >/dev/null || exit 1
+
+# The server honours Range and If-Range, logs the headers that matter,
+# and with a "fail" file present drops range responses past 4 MiB.
+python3 - "$tmp" "$lm" <<'EOF' 2>/dev/null &
+import http.server, os, socketserver, sys
+root, lm = sys.argv[1], sys.argv[2]
+class H(http.server.BaseHTTPRequestHandler):
+	protocol_version = 'HTTP/1.1'
+	def log_message(self, *a): pass
+	def do_GET(self):
+		data = open(root + self.path, 'rb').read()
+		rng, ifr = self.headers.get('Range'), self.headers.get('If-Range')
+		with open(root + '/log', 'a') as f:
+			f.write('range=%s if-range=%s cache=%s\n' % (rng, ifr, self.headers.get('Cache-Control')))
+		start, end = 0, len(data) - 1
+		if rng and (ifr is None or ifr == lm):
+			a, b = rng.split('=')[1].split('-')
+			start, end = int(a), int(b) if b else end
+			self.send_response(206)
+			self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, end, len(data)))
+		else:
+			self.send_response(200)
+		self.send_header('Content-Length', str(end - start + 1))
+		self.send_header('Last-Modified', lm)
+		self.end_headers()
+		if rng and start >= 4*1024*1024 and os.path.exists(root + '/fail'):
+			self.wfile.write(data[start:start+1000])
+			self.close_connection = True
+			return
+		self.wfile.write(data[start:end+1])
+class S(socketserver.ThreadingMixIn, http.server.HTTPServer):
+	daemon_threads = True
+s = S(('127.0.0.1', 0), H)
+open(root + '/port', 'w').write(str(s.server_address[1]))
+s.serve_forever()
+EOF
+srv=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -s "$tmp/port" ] && break; sleep 1; done
+url="http://127.0.0.1:$(cat "$tmp/port")/repo"
+
+setup_root() {
+	rm -rf "$tmp/root" "$tmp/log"
+	mkdir -p "$tmp/root/etc/apk/cache" "$tmp/root/var/log"
+	echo "$url" > "$tmp/root/etc/apk/repositories"
+	$APK --root "$tmp/root" --initdb add >/dev/null 2>&1
+	$APK --root "$tmp/root" update >/dev/null 2>&1
+	rm -f "$tmp/log"
+}
+
+check() {
+	if [ "$1" != 0 ]; then
+		echo "FAIL: $2"
+		fail=$((fail+1))
+	fi
+}
+
+setup_root
+$APK --root "$tmp/root" --fetch-connections 4 add big >/dev/null 2>&1
+check $? "ranged install failed"
+cmp -s "$tmp/root/usr/big" "$tmp/blob"
+check $? "ranged install content differs"
+[ "$(grep -c "if-range=$lm" "$tmp/log")" -gt 0 ]
+check $? "ranges were requested without If-Range"
+cached=$(cd "$tmp/root/etc/apk/cache" && ls big-1.0.*.apk)
+
+# A partial item whose validator does not match is downloaded anew
+setup_root
+head -c 2097152 "$tmp/repo/$arch/big-1.0.apk" > "$tmp/root/etc/apk/cache/.apknew.$cached"
+touch -d "2020-01-01 00:00:00 UTC" "$tmp/root/etc/apk/cache/.apknew.$cached"
+$APK --root "$tmp/root" --fetch-connections 4 add big >/dev/null 2>&1
+check $? "install with stale partial item failed"
+cmp -s "$tmp/root/usr/big" "$tmp/blob"
+check $? "install with stale partial item content differs"
+
+# A failed resume keeps the partial item and its validator
+setup_root
+head -c 2097152 "$tmp/repo/$arch/big-1.0.apk" > "$tmp/root/etc/apk/cache/.apknew.$cached"
+touch -d "2024-01-01 00:00:00 UTC" "$tmp/root/etc/apk/cache/.apknew.$cached"
+touch "$tmp/fail"
+$APK --root "$tmp/root" --fetch-connections 4 add big >/dev/null 2>&1
+rm -f "$tmp/fail"
+[ "$(stat -c %s:%Y "$tmp/root/etc/apk/cache/.apknew.$cached")" = "2097152:1704067200" ]
+check $? "failed resume did not restore the partial item"
+
+# --force-refresh bypasses caching proxies for every range
+setup_root
+$APK --root "$tmp/root" --fetch-connections 4 --force-refresh add big >/dev/null 2>&1
+check $? "install with --force-refresh failed"
+! grep "range=bytes" "$tmp/log" | grep -qv "cache=no-cache"
+check $? "ranges were requested without no-cache on --force-refresh"
+
+if [ $fail -eq 0 ]; then
+	echo "OK: fetch ranges work"
+fi
+
+exit $fail
@@ -0,0 +1,109 @@
+#!/bin/sh
+
+# Writes a zstd index, signs it and the packages with a gzip signature
+# member like abuild-sign does, and installs from it. Runs only when apk
+# was built with zstd support; needs python3 and openssl, and the zstd
+# tool for the zstd compressed package.
+
+APK="../src/apk --no-progress"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+for tool in python3 openssl; do
+	if ! command -v $tool >/dev/null 2>&1; then
+		echo "SKIP: zstd ($tool missing)"
+		exit 0
+	fi
+done
+if ! $APK index --compression zstd -o "$tmp/probe" >/dev/null 2>&1; then
+	echo "SKIP: zstd (apk built without zstd)"
+	exit 0
+fi
+
+fail=0
+arch=$($APK --print-arch)
+mkdir -p "$tmp/repo/$arch" "$tmp/root/etc/apk/keys" "$tmp/root/var/log"
+openssl genrsa -out "$tmp/test.rsa" 2048 2>/dev/null || exit 1
+openssl rsa -in "$tmp/test.rsa" -pubout -out "$tmp/root/etc/apk/keys/test.rsa.pub" 2>/dev/null || exit 1
+
+ZSTD=$(command -v zstd) ARCH=$arch python3 - "$tmp" <<'EOF' || exit 1
+import gzip, hashlib, io, os, subprocess, sys, tarfile
+tmp, arch, zstd = sys.argv[1], os.environ['ARCH'], os.environ['ZSTD']
+
+def tar(entries, cut):
+	b = io.BytesIO()
+	tf = tarfile.open(fileobj=b, mode='w', format=tarfile.PAX_FORMAT)
+	for name, data in entries:
+		ti = tarfile.TarInfo(name)
+		ti.mtime, ti.mode, ti.uname, ti.gname = 1600000000, 0o644, 'root', 'root'
+		ti.size = len(data)
+		if not name.startswith('.'):
+			ti.pax_headers = {'APK-TOOLS.checksum.SHA1': hashlib.sha1(data).hexdigest()}
+		tf.addfile(ti, io.BytesIO(data))
+	if cut: return b.getvalue()[:tf.offset]
+	tf.close()
+	return b.getvalue()
+
+def compress(data, method):
+	if method == 'gzip': return gzip.compress(data, mtime=0)
+	return subprocess.run([zstd, '-q', '-c'], input=data, capture_output=True, check=True).stdout
+
+def signature(data):
+	sig = subprocess.run(['openssl', 'dgst', '-sha1', '-sign', tmp + '/test.rsa'],
+		input=data, capture_output=True, check=True).stdout
+	return gzip.compress(tar([('.SIGN.RSA.test.rsa.pub', sig)], True), mtime=0)
+
+methods = ['gzip'] + (['zstd'] if zstd else [])
+for method in methods:
+	name = 'p' + method
+	content = (name + '\n').encode() * 100000
+	data = compress(tar([(name, content)], False), method)
+	info = ('pkgname = %s\npkgver = 1.0\npkgdesc = test\narch = %s\nsize = %d\n'
+		'origin = %s\ndatahash = %s\n' % (name, arch, len(content), name, hashlib.sha256(data).hexdigest()))
+	ctrl = compress(tar([('.PKGINFO', info.encode())], True), method)
+	open('%s/repo/%s/%s-1.0.apk' % (tmp, arch, name), 'wb').write(signature(ctrl) + ctrl + data)
+	open('%s/%s' % (tmp, name), 'wb').write(content)
+open(tmp + '/pkgs', 'w').write(' '.join('p' + m for m in methods))
+EOF
+
+index="$tmp/repo/$arch/APKINDEX.tar.gz"
+$APK --keys-dir "$tmp/root/etc/apk/keys" index --compression zstd:3 -o "$index" "$tmp/repo/$arch"/*.apk >/dev/null
+[ "$(head -c 4 "$index" | od -An -tx1 | tr -d ' ')" = "28b52ffd" ]
+if [ $? != 0 ]; then
+	echo "FAIL: index is not zstd compressed"
+	fail=$((fail+1))
+fi
+
+# Sign the index the way abuild-sign does
+python3 - "$tmp" "$index" <<'EOF' || exit 1
+import gzip, io, subprocess, sys, tarfile
+tmp, index = sys.argv[1], sys.argv[2]
+data = open(index, 'rb').read()
+sig = subprocess.run(['openssl', 'dgst', '-sha1', '-sign', tmp + '/test.rsa'],
+	input=data, capture_output=True, check=True).stdout
+b = io.BytesIO()
+tf = tarfile.open(fileobj=b, mode='w', format=tarfile.USTAR_FORMAT)
+ti = tarfile.TarInfo('.SIGN.RSA.test.rsa.pub')
+ti.size = len(sig)
+tf.addfile(ti, io.BytesIO(sig))
+open(index, 'wb').write(gzip.compress(b.getvalue()[:tf.offset], mtime=0) + data)
+EOF
+
+echo "$tmp/repo" > "$tmp/root/etc/apk/repositories"
+$APK --root "$tmp/root" --initdb add $(cat "$tmp/pkgs") >/dev/null 2>&1
+if [ $? != 0 ]; then
+	echo "FAIL: install from a signed zstd index failed"
+	fail=$((fail+1))
+fi
+for p in $(cat "$tmp/pkgs"); do
+	if ! cmp -s "$tmp/root/$p" "$tmp/$p"; then
+		echo "FAIL: $p content differs"
+		fail=$((fail+1))
+	fi
+done
+
+if [ $fail -eq 0 ]; then
+	echo "OK: zstd works ($(cat "$tmp/pkgs"))"
+fi
+
+exit $fail